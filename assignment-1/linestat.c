@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include "linestat.h"
+
+// The newlines of a 64-byte block come out of the vector compare as a bit mask, and each set bit closes a line.
+// Lines are only counted, never copied, so the work is one compare per 64 bytes plus a few instructions per line
+
+struct job {
+    const char *start, *end;            // whole lines, but for a last line without a newline
+    size_t threshold;
+    struct linestat stat;
+};
+
+static void (*scanLines)(const char *p, const char *end, size_t threshold, struct linestat *stat);
+
+static inline void countLine(struct linestat *stat, size_t len, size_t threshold) {
+    stat->lines++;
+    stat->bytes += len;
+    stat->histogram[len ? 64 - __builtin_clzll(len) : 0]++;
+    if (len > stat->longest || stat->lines == 1) {
+        stat->longest = len;
+        stat->longestLine = stat->lines;
+    }
+    if (len > threshold) {
+        stat->over++;
+    }
+}
+
+// The lines from line on, for the last bytes that make no whole block
+static void scanTail(const char *line, const char *p, const char *end, size_t threshold, struct linestat *stat) {
+    const char *nl;
+
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        countLine(stat, nl - line, threshold);
+        line = p = nl + 1;
+    }
+    if (line < end) {
+        countLine(stat, end - line, threshold);
+    }
+}
+
+static void scanLinesScalar(const char *p, const char *end, size_t threshold, struct linestat *stat) {
+    scanTail(p, p, end, threshold, stat);
+}
+
+__attribute__((target("avx2")))
+static void scanLinesAvx2(const char *p, const char *end, size_t threshold, struct linestat *stat) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const char *line = p;
+    uint64_t mask;
+
+    for (; end - p >= 64; p += 64) {
+        mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), newline)) |
+               (uint64_t) (uint32_t) _mm256_movemask_epi8(
+                   _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 32)), newline)) << 32;
+        while (mask != 0) {
+            countLine(stat, p + __builtin_ctzll(mask) - line, threshold);
+            line = p + __builtin_ctzll(mask) + 1;
+            mask &= mask - 1;
+        }
+    }
+    scanTail(line, p, end, threshold, stat);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void scanLinesAvx512(const char *p, const char *end, size_t threshold, struct linestat *stat) {
+    const __m512i newline = _mm512_set1_epi8('\n');
+    const char *line = p;
+    uint64_t mask;
+
+    for (; end - p >= 64; p += 64) {
+        mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p), newline);
+        while (mask != 0) {
+            countLine(stat, p + __builtin_ctzll(mask) - line, threshold);
+            line = p + __builtin_ctzll(mask) + 1;
+            mask &= mask - 1;
+        }
+    }
+    scanTail(line, p, end, threshold, stat);
+}
+
+static void *scanJob(void *arg) {
+    struct job *job = arg;
+
+    scanLines(job->start, job->end, job->threshold, &job->stat);
+    return NULL;
+}
+
+void mylinestat(const char *data, size_t size, size_t threshold, int threads, struct linestat *stat) {
+    struct job *jobs;
+    pthread_t *tids;
+    const char *nl;
+    int t, i;
+
+    if (scanLines == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512bw")) {
+            scanLines = scanLinesAvx512;
+        } else if (__builtin_cpu_supports("avx2")) {
+            scanLines = scanLinesAvx2;
+        } else {
+            scanLines = scanLinesScalar;
+        }
+    }
+
+    memset(stat, 0, sizeof(*stat));
+    // a thread gets at least a megabyte
+    if (threads < 1) {
+        threads = 1;
+    }
+    if ((size_t)threads > size / (1 << 20) + 1) {
+        threads = size / (1 << 20) + 1;
+    }
+    jobs = calloc(threads, sizeof(struct job));
+    tids = malloc(threads * sizeof(pthread_t));
+    if (jobs == NULL || tids == NULL) {
+        free(jobs);
+        free(tids);
+        scanLines(data, data + size, threshold, stat);
+        return;
+    }
+
+    // each share ends after the first newline from its even split on, so that no line is cut in two
+    for (t = 0; t < threads; t++) {
+        jobs[t].start = t == 0 ? data : jobs[t - 1].end;
+        jobs[t].end = data + size * (t + 1) / threads;
+        if (jobs[t].end < jobs[t].start) {
+            jobs[t].end = jobs[t].start;
+        }
+        nl = memchr(jobs[t].end, '\n', data + size - jobs[t].end);
+        jobs[t].end = nl != NULL ? nl + 1 : data + size;
+        jobs[t].threshold = threshold;
+    }
+    for (t = 0; t < threads - 1; t++) {
+        if (pthread_create(&tids[t], NULL, scanJob, &jobs[t])) {
+            scanJob(&jobs[t]);
+            tids[t] = 0;
+        }
+    }
+    scanJob(&jobs[threads - 1]);
+
+    for (t = 0; t < threads; t++) {
+        if (t < threads - 1 && tids[t]) {
+            pthread_join(tids[t], NULL);
+        }
+        if (jobs[t].stat.lines > 0 && (jobs[t].stat.longest > stat->longest || stat->lines == 0)) {
+            stat->longest = jobs[t].stat.longest;
+            stat->longestLine = stat->lines + jobs[t].stat.longestLine;
+        }
+        stat->lines += jobs[t].stat.lines;
+        stat->bytes += jobs[t].stat.bytes;
+        stat->over += jobs[t].stat.over;
+        for (i = 0; i < LINESTAT_BUCKETS; i++) {
+            stat->histogram[i] += jobs[t].stat.histogram[i];
+        }
+    }
+    free(jobs);
+    free(tids);
+}
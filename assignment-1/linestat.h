@@ -0,0 +1,20 @@
+// linestat.h
+//
+// Line length statistics over a block of memory, behind mystrlen -f.
+
+#include <stddef.h>
+
+#define LINESTAT_BUCKETS 65             // lengths 0, 1, 2-3, 4-7, ... up to 2^63 and beyond
+
+struct linestat {
+    size_t lines;                       // a last line without a newline counts too
+    size_t bytes;                       // in the lines, without their newlines
+    size_t longest;                     // length of the longest line
+    size_t longestLine;                 // its number, counting from 1
+    size_t over;                        // lines longer than the threshold
+    size_t histogram[LINESTAT_BUCKETS]; // lines by the bit length of their length
+};
+
+// Measures the newline-separated lines of data[0 .. size). Each of threads workers takes a share of the lines,
+// split at newlines, and their statistics are merged into stat
+void mylinestat(const char *data, size_t size, size_t threshold, int threads, struct linestat *stat);
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mystring.h"
+#include "strsort.h"
+
+// With -s, sorts the lines of a file in byte order like LC_ALL=C sort, or with -u keeps one of each like sort -u.
+// The file is mapped privately and every newline becomes the NUL ending its line, so the lines are sorted and written
+// out where they are, without being copied. Lines must not hold NUL bytes themselves
+
+#define OUTPUT_BUFFER (1 << 20)
+
+static char *output;
+static size_t outputUsed;
+
+void writeAll(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            fprintf(stderr, "ERROR: Could not write the output\n");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+void writeLine(int fd, const char *line) {
+    size_t len = mystrlen(line);
+
+    if (outputUsed + len + 1 > OUTPUT_BUFFER) {
+        writeAll(fd, output, outputUsed);
+        outputUsed = 0;
+        if (len + 1 > OUTPUT_BUFFER) {
+            writeAll(fd, line, len);
+            writeAll(fd, "\n", 1);
+            return;
+        }
+    }
+    memcpy(output + outputUsed, line, len);
+    output[outputUsed + len] = '\n';
+    outputUsed += len + 1;
+}
+
+int sortLines(int argc, char ** argv) {
+    const char **lines = NULL, *outfile = NULL;
+    char *data, *p, *end, *nl;
+    size_t n = 0, size = 0, i;
+    long page = sysconf(_SC_PAGESIZE);
+    int opt, unique = 0, threads = 0, fd, out = STDOUT_FILENO;
+    struct stat st;
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "uj:o:")) != -1) {
+        switch (opt) {
+        case 'u':
+            unique = 1;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc != optind + 1) {
+        puts("Usage: strcmp -s [-u] [-j threads] [-o output] <file_to_sort>");
+        return 1;
+    }
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "ERROR: Could not open %s\n", argv[optind]);
+        return 1;
+    }
+    if (outfile != NULL) {
+        out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            fprintf(stderr, "ERROR: Could not create %s\n", outfile);
+            return 1;
+        }
+    }
+    output = malloc(OUTPUT_BUFFER);
+    if (output == NULL) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        return 1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+
+    // private and writable, populated up front so the newline stores don't fault page by page
+    data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map %s\n", argv[optind]);
+        return 1;
+    }
+    close(fd);
+
+    for (p = data, end = data + st.st_size; p < end; p = nl + 1) {
+        if (n == size) {
+            size = size ? 2 * size : 1 << 16;
+            lines = realloc(lines, size * sizeof(char *));
+            if (lines == NULL) {
+                fprintf(stderr, "ERROR: Out of memory\n");
+                return 1;
+            }
+        }
+        lines[n++] = p;
+        nl = memchr(p, '\n', end - p);
+        if (nl != NULL) {
+            *nl = '\0';
+        } else if (st.st_size % page != 0) {
+            // the rest of the last page reads as zeros, ending the last line
+            break;
+        } else {
+            // a last line without a newline that fills its page has no room for the NUL
+            lines[n - 1] = strndup(p, end - p);
+            if (lines[n - 1] == NULL) {
+                fprintf(stderr, "ERROR: Out of memory\n");
+                return 1;
+            }
+            break;
+        }
+    }
+
+    mystrsort(lines, n, threads);
+
+    for (i = 0; i < n; i++) {
+        if (!unique || i == 0 || mystrcmp(lines[i - 1], lines[i]) != 0) {
+            writeLine(out, lines[i]);
+        }
+    }
+    writeAll(out, output, outputUsed);
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+        return sortLines(argc, argv);
+    }
+    if (argc != 3) {
+        puts("Usage: strcmp <first_string_to_compare> <second_string_to_compare>");
+        puts("       strcmp -s [-u] [-j threads] [-o output] <file_to_sort>");
+        return 1;
+    }
+
+    if (mystrcmp(argv[1], argv[2]) == 0) {
+        puts("The two strings are identical.");
+    } else {
+        puts("The two strings are different.");
+    }
+    return 0;
+}
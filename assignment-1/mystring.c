@@ -0,0 +1,353 @@
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+#include "mystring.h"
+
+// The vector strlen variants only load whole aligned vectors, which never span two pages.
+// strcmp can't align both strings at once, so before an unaligned load it checks that neither string is within
+// one vector of the end of its page. When one is, the bytes up to that page end are compared one at a time,
+// or for AVX-512 with a masked load, which doesn't fault on the bytes it leaves out
+
+#define PAGE_SIZE 4096
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define LOWS 0x7f7f7f7f7f7f7f7fULL
+
+// Words read through this type may alias the chars of the string
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+// Bytes until a or b reaches the end of its page, whichever comes first
+static inline size_t toPageEnd(const char *a, const char *b) {
+    size_t ka = PAGE_SIZE - ((uintptr_t) a & (PAGE_SIZE - 1));
+    size_t kb = PAGE_SIZE - ((uintptr_t) b & (PAGE_SIZE - 1));
+
+    return ka < kb ? ka : kb;
+}
+
+// Compare up to n bytes one at a time, returns 1 with the result in *result when the strings ended or differ there
+static inline int compareBytes(const char *a, const char *b, size_t n, int *result) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (a[i] != b[i] || a[i] == '\0') {
+            *result = (unsigned char) a[i] - (unsigned char) b[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Keep GCC from turning the loop into a call to strlen
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+size_t mystrlen_byte(const char *s) {
+    size_t i = 0;
+
+    while (s[i] != '\0') {
+        i++;
+    }
+    return i;
+}
+
+int mystrcmp_byte(const char *a, const char *b) {
+    size_t i = 0;
+
+    while (a[i] == b[i] && a[i] != '\0') {
+        i++;
+    }
+    return (unsigned char) a[i] - (unsigned char) b[i];
+}
+
+// High bit set in every byte of v that is zero, exactly: no carries from one byte into the next
+static inline uint64_t zeroBytes(uint64_t v) {
+    return ~(((v & LOWS) + LOWS) | v) & HIGHS;
+}
+
+// Eight bytes at a time, from the aligned word holding s. The bytes before s are made non-zero so they can't end it
+size_t mystrlen_word(const char *s) {
+    const word_t *w = (const word_t *) ((uintptr_t) s & ~(uintptr_t) 7);
+    unsigned int skip = (uintptr_t) s & 7;
+    uint64_t v, zeros;
+
+    v = *w | (skip ? (1ULL << (8 * skip)) - 1 : 0);
+    while ((zeros = (v - ONES) & ~v & HIGHS) == 0) {
+        v = *++w;
+    }
+    // The quick test above can flag bytes after the first zero, but never before it
+    return (const char *) w + __builtin_ctzll(zeros) / 8 - s;
+}
+
+int mystrcmp_word(const char *a, const char *b) {
+    uint64_t va, vb, stop;
+    size_t n;
+    int result;
+
+    while (1) {
+        n = toPageEnd(a, b);
+        if (n < 8) {
+            if (compareBytes(a, b, n, &result)) {
+                return result;
+            }
+            a += n;
+            b += n;
+            continue;
+        }
+        // Every load up to the nearer page end is safe
+        for (; n >= 8; n -= 8) {
+            memcpy(&va, a, 8);
+            memcpy(&vb, b, 8);
+            // The first byte that differs or ends a
+            stop = zeroBytes(va ^ vb) ^ HIGHS;
+            stop |= zeroBytes(va);
+            if (stop != 0) {
+                stop = __builtin_ctzll(stop) / 8;
+                return (unsigned char) a[stop] - (unsigned char) b[stop];
+            }
+            a += 8;
+            b += 8;
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+size_t mystrlen_sse2(const char *s) {
+    const __m128i zero = _mm_setzero_si128();
+    const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 15);
+    unsigned int mask;
+
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *) p), zero)) >> (s - p);
+    if (mask != 0) {
+        return __builtin_ctz(mask);
+    }
+    do {
+        p += 16;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *) p), zero));
+    } while (mask == 0);
+    return p + __builtin_ctz(mask) - s;
+}
+
+__attribute__((target("sse2")))
+int mystrcmp_sse2(const char *a, const char *b) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i va, vb;
+    unsigned int same, i;
+    size_t n;
+    int result;
+
+    while (1) {
+        n = toPageEnd(a, b);
+        if (n < 16) {
+            if (compareBytes(a, b, n, &result)) {
+                return result;
+            }
+            a += n;
+            b += n;
+            continue;
+        }
+        for (; n >= 16; n -= 16) {
+            va = _mm_loadu_si128((const __m128i *) a);
+            vb = _mm_loadu_si128((const __m128i *) b);
+            // Bytes that are equal and not the end of the strings
+            same = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, zero));
+            if (same != 0xffff) {
+                i = __builtin_ctz(~same);
+                return (unsigned char) a[i] - (unsigned char) b[i];
+            }
+            a += 16;
+            b += 16;
+        }
+    }
+}
+
+// After the first vector, four aligned vectors are checked at once: their minimum has a zero byte when any of them does
+__attribute__((target("avx2")))
+size_t mystrlen_avx2(const char *s) {
+    const __m256i zero = _mm256_setzero_si256();
+    const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 31);
+    __m256i v0, v1, v2, v3;
+    unsigned int mask;
+    uint64_t wide;
+
+    mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *) p), zero)) >> (s - p);
+    if (mask != 0) {
+        return __builtin_ctz(mask);
+    }
+    p += 32;
+    // Single vectors up to a 128-byte boundary
+    while ((uintptr_t) p & 127) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *) p), zero));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask) - s;
+        }
+        p += 32;
+    }
+    while (1) {
+        v0 = _mm256_load_si256((const __m256i *) p);
+        v1 = _mm256_load_si256((const __m256i *) (p + 32));
+        v2 = _mm256_load_si256((const __m256i *) (p + 64));
+        v3 = _mm256_load_si256((const __m256i *) (p + 96));
+        if (!_mm256_testz_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_min_epu8(v0, v1), _mm256_min_epu8(v2, v3)), zero),
+                                _mm256_set1_epi8(-1))) {
+            break;
+        }
+        p += 128;
+    }
+    wide = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero)) |
+           (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, zero)) << 32;
+    if (wide != 0) {
+        return p + __builtin_ctzll(wide) - s;
+    }
+    wide = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v2, zero)) |
+           (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v3, zero)) << 32;
+    return p + 64 + __builtin_ctzll(wide) - s;
+}
+
+__attribute__((target("avx2")))
+int mystrcmp_avx2(const char *a, const char *b) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i v0, v1, v2, v3;
+    unsigned int stop, i;
+    size_t n;
+    int result;
+
+    while (1) {
+        n = toPageEnd(a, b);
+        if (n < 32) {
+            if (compareBytes(a, b, n, &result)) {
+                return result;
+            }
+            a += n;
+            b += n;
+            continue;
+        }
+        // A byte of min(a, a == b) is zero where the strings differ or a ends, so one test covers four vectors
+        for (; n >= 128; n -= 128) {
+            v0 = _mm256_loadu_si256((const __m256i *) a);
+            v1 = _mm256_loadu_si256((const __m256i *) (a + 32));
+            v2 = _mm256_loadu_si256((const __m256i *) (a + 64));
+            v3 = _mm256_loadu_si256((const __m256i *) (a + 96));
+            v0 = _mm256_min_epu8(v0, _mm256_cmpeq_epi8(v0, _mm256_loadu_si256((const __m256i *) b)));
+            v1 = _mm256_min_epu8(v1, _mm256_cmpeq_epi8(v1, _mm256_loadu_si256((const __m256i *) (b + 32))));
+            v2 = _mm256_min_epu8(v2, _mm256_cmpeq_epi8(v2, _mm256_loadu_si256((const __m256i *) (b + 64))));
+            v3 = _mm256_min_epu8(v3, _mm256_cmpeq_epi8(v3, _mm256_loadu_si256((const __m256i *) (b + 96))));
+            if (!_mm256_testz_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_min_epu8(v0, v1), _mm256_min_epu8(v2, v3)), zero),
+                                    _mm256_set1_epi8(-1))) {
+                break;
+            }
+            a += 128;
+            b += 128;
+        }
+        // What is left before the page end, or the four vectors holding the difference
+        for (; n >= 32; n -= 32) {
+            v0 = _mm256_loadu_si256((const __m256i *) a);
+            v0 = _mm256_min_epu8(v0, _mm256_cmpeq_epi8(v0, _mm256_loadu_si256((const __m256i *) b)));
+            stop = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero));
+            if (stop != 0) {
+                i = __builtin_ctz(stop);
+                return (unsigned char) a[i] - (unsigned char) b[i];
+            }
+            a += 32;
+            b += 32;
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+size_t mystrlen_avx512(const char *s) {
+    const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 63);
+    __m512i v0, v1;
+    uint64_t mask;
+
+    mask = _mm512_testn_epi8_mask(_mm512_load_si512(p), _mm512_load_si512(p)) >> (s - p);
+    if (mask != 0) {
+        return __builtin_ctzll(mask);
+    }
+    p += 64;
+    if ((uintptr_t) p & 127) {
+        v0 = _mm512_load_si512(p);
+        mask = _mm512_testn_epi8_mask(v0, v0);
+        if (mask != 0) {
+            return p + __builtin_ctzll(mask) - s;
+        }
+        p += 64;
+    }
+    while (1) {
+        v0 = _mm512_load_si512(p);
+        v1 = _mm512_load_si512(p + 64);
+        if (_mm512_testn_epi8_mask(_mm512_min_epu8(v0, v1), _mm512_min_epu8(v0, v1)) != 0) {
+            break;
+        }
+        p += 128;
+    }
+    mask = _mm512_testn_epi8_mask(v0, v0);
+    if (mask != 0) {
+        return p + __builtin_ctzll(mask) - s;
+    }
+    return p + 64 + __builtin_ctzll(_mm512_testn_epi8_mask(v1, v1)) - s;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+int mystrcmp_avx512(const char *a, const char *b) {
+    uint64_t stop, mask, i;
+    __m512i va, vb;
+    size_t n;
+
+    while (1) {
+        n = toPageEnd(a, b);
+        // Bytes that differ, or end a
+        for (; n >= 64; n -= 64) {
+            va = _mm512_loadu_si512(a);
+            stop = _mm512_cmpneq_epi8_mask(va, _mm512_loadu_si512(b)) | _mm512_testn_epi8_mask(va, va);
+            if (stop != 0) {
+                i = __builtin_ctzll(stop);
+                return (unsigned char) a[i] - (unsigned char) b[i];
+            }
+            a += 64;
+            b += 64;
+        }
+        // Only the bytes before the nearer page end are loaded
+        mask = (1ULL << n) - 1;
+        va = _mm512_maskz_loadu_epi8(mask, a);
+        vb = _mm512_maskz_loadu_epi8(mask, b);
+        stop = (_mm512_cmpneq_epi8_mask(va, vb) | _mm512_testn_epi8_mask(va, va)) & mask;
+        if (stop != 0) {
+            i = __builtin_ctzll(stop);
+            return (unsigned char) a[i] - (unsigned char) b[i];
+        }
+        a += n;
+        b += n;
+    }
+}
+
+const struct mystring_variant mystring_variants[MYSTRING_VARIANTS] = {
+    { "byte", "", mystrlen_byte, mystrcmp_byte },
+    { "word", "", mystrlen_word, mystrcmp_word },
+    { "sse2", "sse2", mystrlen_sse2, mystrcmp_sse2 },
+    { "avx2", "avx2", mystrlen_avx2, mystrcmp_avx2 },
+    { "avx512", "avx512bw", mystrlen_avx512, mystrcmp_avx512 },
+};
+
+// ifunc resolvers, run by the dynamic loader when it binds mystrlen and mystrcmp
+static size_t (*resolveStrlen(void))(const char *) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        return mystrlen_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return mystrlen_avx2;
+    }
+    return mystrlen_sse2;
+}
+
+static int (*resolveStrcmp(void))(const char *, const char *) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        return mystrcmp_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return mystrcmp_avx2;
+    }
+    return mystrcmp_sse2;
+}
+
+size_t mystrlen(const char *s) __attribute__((ifunc("resolveStrlen")));
+int mystrcmp(const char *a, const char *b) __attribute__((ifunc("resolveStrcmp")));
@@ -0,0 +1,36 @@
+// mystring.h
+//
+// String kernels behind mystrlen and mystrcmp. mystrlen() and mystrcmp() are picked once, when the library is loaded,
+// from the variants below by what the CPU supports. The variants are exported as well, for benchmarks and tests.
+// No variant reads past the page holding the terminating NUL, so strings ending right before an unmapped page are fine.
+
+#include <stddef.h>
+
+// Length of s, without the terminating NUL
+size_t mystrlen(const char *s);
+
+// <0, 0 or >0 when a sorts before, equal to or after b, comparing bytes as unsigned char like strcmp
+int mystrcmp(const char *a, const char *b);
+
+size_t mystrlen_byte(const char *s);
+size_t mystrlen_word(const char *s);
+size_t mystrlen_sse2(const char *s);
+size_t mystrlen_avx2(const char *s);
+size_t mystrlen_avx512(const char *s);
+
+int mystrcmp_byte(const char *a, const char *b);
+int mystrcmp_word(const char *a, const char *b);
+int mystrcmp_sse2(const char *a, const char *b);
+int mystrcmp_avx2(const char *a, const char *b);
+int mystrcmp_avx512(const char *a, const char *b);
+
+// The variants in order of width, with the CPU features each needs ("" for none)
+struct mystring_variant {
+    const char *name;
+    const char *feature;
+    size_t (*strlen)(const char *s);
+    int (*strcmp)(const char *a, const char *b);
+};
+
+#define MYSTRING_VARIANTS 5
+extern const struct mystring_variant mystring_variants[MYSTRING_VARIANTS];
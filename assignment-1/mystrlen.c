@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mystring.h"
+#include "linestat.h"
+
+// With -f, measures every line of a file instead: the first line of output is the longest length and the file name,
+// like wc -L, followed by the distribution of the lengths. Lengths are in bytes; unlike wc -L, tabs and multibyte
+// characters are not widened to their display columns
+
+int fileLengths(int argc, char ** argv) {
+    struct linestat stat;
+    struct stat st;
+    size_t threshold = 0;
+    const char *data = NULL;
+    char range[48];
+    int opt, threads = 0, fd, b, last, overGiven = 0;
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "j:t:")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 't':
+            threshold = strtoull(optarg, NULL, 10);
+            overGiven = 1;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc != optind + 1) {
+        puts("Usage: strlen -f [-j threads] [-t threshold] <file_to_measure>");
+        return 1;
+    }
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "ERROR: Could not open %s\n", argv[optind]);
+        return 1;
+    }
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Could not map %s\n", argv[optind]);
+            return 1;
+        }
+        madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    mylinestat(data, st.st_size, threshold, threads, &stat);
+
+    printf("%zu %s\n", stat.longest, argv[optind]);
+    if (stat.lines == 0) {
+        return 0;
+    }
+    printf("%zu lines, mean length %.1f, the longest is line %zu\n", stat.lines, (double) stat.bytes / stat.lines,
+           stat.longestLine);
+    for (last = LINESTAT_BUCKETS - 1; stat.histogram[last] == 0; last--) {
+    }
+    printf("%21s %12s\n", "length", "lines");
+    for (b = 0; b <= last; b++) {
+        if (b < 2) {
+            snprintf(range, sizeof(range), "%d", b);
+        } else {
+            snprintf(range, sizeof(range), "%zu-%zu", (size_t) 1 << (b - 1), ((size_t) 1 << (b - 1)) * 2 - 1);
+        }
+        printf("%21s %12zu\n", range, stat.histogram[b]);
+    }
+    if (overGiven) {
+        printf("%zu lines longer than %zu\n", stat.over, threshold);
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    if (argc >= 2 && strcmp(argv[1], "-f") == 0) {
+        return fileLengths(argc, argv);
+    }
+    if (argc != 2) {
+        puts("Usage: strlen <input_string_with_no_space_inside_it>");
+        puts("       strlen -f [-j threads] [-t threshold] <file_to_measure>");
+        return 1;
+    }
+
+    printf("The length is: %zu characters.\n", mystrlen(argv[1]));
+    return 0;
+}
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mystring.h"
+#include "strsort.h"
+
+// Compares every mystring variant with glibc, first for correctness, then for speed, across string lengths and alignments.
+// Timings are nanoseconds per call on strings that are in cache; strcmp compares two equal strings, its worst case
+
+static size_t LENGTHS[] = { 1, 7, 16, 31, 64, 100, 256, 1000, 4096, 65536 };
+static size_t ALIGNS[] = { 0, 1, 15, 33, 63 };
+#define NLENGTHS (sizeof(LENGTHS) / sizeof(LENGTHS[0]))
+#define NALIGNS (sizeof(ALIGNS) / sizeof(ALIGNS[0]))
+#define BYTES_PER_RUN (64 << 20)        // every measurement works through about this many bytes
+
+// The calls go through these so the compiler can't hoist them out of the timing loops
+static size_t (*volatile strlen_call)(const char *s);
+static int (*volatile strcmp_call)(const char *a, const char *b);
+
+double getTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1E9;
+}
+
+int sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+// Strings that end right before an unmapped page, at every offset from it up to 200 bytes, with a difference at every
+// position. Any variant reading past the page would crash here
+int checkVariant(const struct mystring_variant *v) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *a, *b, *pa, *pb;
+    size_t len, diff, shift;
+    int errors = 0;
+
+    a = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    b = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (a == MAP_FAILED || b == MAP_FAILED || mprotect(a + page, page, PROT_NONE) || mprotect(b + page, page, PROT_NONE)) {
+        fprintf(stderr, "ERROR: Could not set up the guard pages\n");
+        exit(1);
+    }
+
+    for (len = 0; len < 200; len++) {
+        pa = a + page - len - 1;
+        memset(pa, 'x', len);
+        pa[len] = '\0';
+        if (v->strlen(pa) != len) {
+            fprintf(stderr, "%s strlen: %zu instead of %zu\n", v->name, v->strlen(pa), len);
+            errors++;
+        }
+
+        // b ends at a different distance from its page end, so the two strings cross pages at different points
+        for (shift = 0; shift < 70; shift += 23) {
+            pb = b + page - len - 1 - shift;
+            memcpy(pb, pa, len + 1);
+            if (v->strcmp(pa, pb) != 0 || v->strcmp(pb, pa) != 0) {
+                fprintf(stderr, "%s strcmp: equal strings of length %zu differ\n", v->name, len);
+                errors++;
+            }
+            for (diff = 0; diff < len; diff++) {
+                pb[diff] = diff & 1 ? '\xf0' : 'a';
+                if (sign(v->strcmp(pa, pb)) != sign(strcmp(pa, pb)) || sign(v->strcmp(pb, pa)) != sign(strcmp(pb, pa))) {
+                    fprintf(stderr, "%s strcmp: wrong order for a difference at %zu of %zu\n", v->name, diff, len);
+                    errors++;
+                }
+                pb[diff] = 'x';
+            }
+            // a prefix of the other
+            if (len > 0) {
+                pb[len - 1] = '\0';
+                if (v->strcmp(pa, pb) <= 0 || v->strcmp(pb, pa) >= 0) {
+                    fprintf(stderr, "%s strcmp: wrong order for a prefix of length %zu\n", v->name, len - 1);
+                    errors++;
+                }
+            }
+        }
+    }
+
+    munmap(a, 2 * page);
+    munmap(b, 2 * page);
+    return errors;
+}
+
+int compareStrings(const void *a, const void *b) {
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+// mystrsort against qsort on lines that share long prefixes, and on many long duplicates, which once took a stack
+// frame per shared byte
+int checkSort(void) {
+    static const size_t lengths[] = { 2000, 3000, 5000 };
+    const char **lines, **sorted;
+    char *text, *p;
+    size_t n = 20000, i, len;
+    int errors = 0, threads, l;
+
+    text = malloc(n * 5001);
+    lines = malloc(n * sizeof(char *));
+    sorted = malloc(n * sizeof(char *));
+    if (text == NULL || lines == NULL || sorted == NULL) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(1);
+    }
+    srand(1);
+    for (l = 0; l < 3; l++) {
+        for (i = 0, p = text; i < n; i++, p += len + 1) {
+            len = lengths[l];
+            memset(p, 'x', len);
+            // all duplicates first, then none, then one in three; the others differ somewhere past the shared prefix
+            if (l == 1 || (l == 2 && rand() % 3 != 0)) {
+                len -= rand() % 1000;
+                p[len - 1 - rand() % 64] = 'a' + rand() % 3;
+            }
+            p[len] = '\0';
+            lines[i] = p;
+        }
+        for (threads = 1; threads <= 4; threads += 3) {
+            memcpy(sorted, lines, n * sizeof(char *));
+            mystrsort(sorted, n, threads);
+            qsort(lines, n, sizeof(char *), compareStrings);
+            for (i = 0; i < n; i++) {
+                if (strcmp(sorted[i], lines[i]) != 0) {
+                    fprintf(stderr, "mystrsort: wrong order at %zu of %zu lines of up to %zu bytes, %d threads\n", i,
+                            n, lengths[l], threads);
+                    errors++;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(text);
+    free(lines);
+    free(sorted);
+    return errors;
+}
+
+double timeStrlen(size_t (*fn)(const char *), const char *s, size_t len) {
+    long i, calls = BYTES_PER_RUN / (len + 16);
+    double start;
+
+    strlen_call = fn;
+    start = getTime();
+    for (i = 0; i < calls; i++) {
+        if (strlen_call(s) != len) {
+            fprintf(stderr, "ERROR: Wrong length while timing\n");
+            exit(1);
+        }
+    }
+    return (getTime() - start) / calls * 1E9;
+}
+
+double timeStrcmp(int (*fn)(const char *, const char *), const char *a, const char *b) {
+    long i, calls = BYTES_PER_RUN / (strlen(a) + 16);
+    double start;
+
+    strcmp_call = fn;
+    start = getTime();
+    for (i = 0; i < calls; i++) {
+        if (strcmp_call(a, b) != 0) {
+            fprintf(stderr, "ERROR: Wrong comparison while timing\n");
+            exit(1);
+        }
+    }
+    return (getTime() - start) / calls * 1E9;
+}
+
+int supported(const struct mystring_variant *v) {
+    __builtin_cpu_init();
+    return v->feature[0] == '\0' || (strcmp(v->feature, "sse2") == 0 && __builtin_cpu_supports("sse2")) ||
+           (strcmp(v->feature, "avx2") == 0 && __builtin_cpu_supports("avx2")) ||
+           (strcmp(v->feature, "avx512bw") == 0 && __builtin_cpu_supports("avx512bw"));
+}
+
+void printHeader(const char *what) {
+    int i;
+
+    printf("\n%s, ns per call\n%8s %5s %9s", what, "length", "align", "glibc");
+    for (i = 0; i < MYSTRING_VARIANTS; i++) {
+        printf(" %9s", mystring_variants[i].name);
+    }
+    printf("\n");
+}
+
+int main(int argc, char ** argv) {
+    char *a, *b;
+    size_t l, al, len, align;
+    int i, errors = 0;
+
+    if (argc != 1) {
+        fprintf(stderr, "Usage: strbench\n");
+        return 1;
+    }
+
+    for (i = 0; i < MYSTRING_VARIANTS; i++) {
+        if (supported(&mystring_variants[i])) {
+            errors += checkVariant(&mystring_variants[i]);
+        }
+    }
+    errors += checkSort();
+    if (errors > 0) {
+        fprintf(stderr, "%d errors, not timing\n", errors);
+        return 1;
+    }
+    printf("All variants agree with glibc, and mystrsort with qsort.\n");
+
+    // b is misaligned against a by 5 bytes more, so strcmp never sees two equally aligned strings
+    a = aligned_alloc(64, 65536 + 128);
+    b = aligned_alloc(64, 65536 + 128);
+    if (a == NULL || b == NULL) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        return 1;
+    }
+
+    printHeader("strlen");
+    for (l = 0; l < NLENGTHS; l++) {
+        for (al = 0; al < NALIGNS; al++) {
+            len = LENGTHS[l];
+            align = ALIGNS[al];
+            memset(a + align, 'x', len);
+            a[align + len] = '\0';
+            printf("%8zu %5zu %9.1f", len, align, timeStrlen(strlen, a + align, len));
+            for (i = 0; i < MYSTRING_VARIANTS; i++) {
+                if (supported(&mystring_variants[i])) {
+                    printf(" %9.1f", timeStrlen(mystring_variants[i].strlen, a + align, len));
+                } else {
+                    printf(" %9s", "-");
+                }
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+
+    printHeader("strcmp");
+    for (l = 0; l < NLENGTHS; l++) {
+        for (al = 0; al < NALIGNS; al++) {
+            len = LENGTHS[l];
+            align = ALIGNS[al];
+            memset(a + align, 'x', len);
+            a[align + len] = '\0';
+            memcpy(b + (align + 5) % 64, a + align, len + 1);
+            printf("%8zu %5zu %9.1f", len, align, timeStrcmp(strcmp, a + align, b + (align + 5) % 64));
+            for (i = 0; i < MYSTRING_VARIANTS; i++) {
+                if (supported(&mystring_variants[i])) {
+                    printf(" %9.1f", timeStrcmp(mystring_variants[i].strcmp, a + align, b + (align + 5) % 64));
+                } else {
+                    printf(" %9s", "-");
+                }
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+
+    free(a);
+    free(b);
+    return 0;
+}
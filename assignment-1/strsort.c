@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mystring.h"
+#include "strsort.h"
+
+// MSD radix sort on cached key prefixes. Every string is paired with the next 8 of its bytes from the current depth,
+// big-endian so that comparing prefixes as integers orders them like the bytes. The radix passes and the small-bucket
+// insertion sorts only touch this array; the strings themselves are read again only when 8 more bytes are needed
+
+#define INSERTION 32                    // buckets smaller than this are insertion sorted
+#define DEPTH_LIMIT 1024                // buckets sharing this many bytes are sorted by comparison
+
+struct key {
+    uint64_t prefix;                    // bytes depth .. depth + 7 of s, zero past the NUL
+    const char *s;
+};
+
+// A stretch of keys that share their first depth + byte bytes, to be split on byte number byte of the prefix
+struct bucket {
+    size_t offset, n, depth;
+    int byte;
+};
+
+struct job {
+    struct key *keys, *tmp;
+    size_t n, m;                        // a merge joins keys[0 .. n) with keys[n .. m) into tmp
+    int reload;
+};
+
+// Bytes depth .. depth + 7 of s as a big-endian integer. The caller knows s is at least depth bytes long
+static inline uint64_t loadPrefix(const char *s, size_t depth) {
+    uint64_t prefix = 0;
+    int i;
+
+    s += depth;
+    for (i = 0; i < 8 && s[i] != '\0'; i++) {
+        prefix |= (uint64_t)(unsigned char)s[i] << (56 - 8 * i);
+    }
+    return prefix;
+}
+
+// Orders two keys whose strings share their first depth bytes
+static inline int compareKeys(const struct key *a, const struct key *b, size_t depth) {
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+    // a NUL in the prefix means both strings end there, equal
+    if ((a->prefix & 0xff) == 0) {
+        return 0;
+    }
+    return mystrcmp(a->s + depth + 8, b->s + depth + 8);
+}
+
+static void insertionSort(struct key *keys, size_t n, size_t depth) {
+    struct key k;
+    size_t i, j;
+
+    for (i = 1; i < n; i++) {
+        k = keys[i];
+        for (j = i; j > 0 && compareKeys(&k, &keys[j - 1], depth) < 0; j--) {
+            keys[j] = keys[j - 1];
+        }
+        keys[j] = k;
+    }
+}
+
+static int compareSuffixes(const void *a, const void *b, void *depth) {
+    return compareKeys(a, b, *(size_t *) depth);
+}
+
+// Moves a bucket on to the next byte, loading the next 8 bytes of its strings when the prefix is used up
+static void nextByte(struct key *keys, struct bucket *b) {
+    size_t i;
+
+    if (++b->byte == 8) {
+        b->depth += 8;
+        b->byte = 0;
+        for (i = 0; i < b->n; i++) {
+            keys[i].prefix = loadPrefix(keys[i].s, b->depth);
+        }
+    }
+}
+
+// Sorts keys with an explicit stack of buckets still to split rather than recursion, since long shared prefixes would
+// need a frame per byte. Buckets that get past DEPTH_LIMIT shared bytes are sorted by comparison instead.
+// tmp is scratch space as long as keys
+static void radixSort(struct key *keys, struct key *tmp, size_t n) {
+    size_t count[256], start[256], i, pos, top = 0, size = 64;
+    struct bucket *stack, *grown, b, next;
+    struct key *k;
+    int shift, c;
+
+    stack = malloc(size * sizeof(struct bucket));
+    if (stack == NULL) {
+        pos = 0;
+        qsort_r(keys, n, sizeof(struct key), compareSuffixes, &pos);
+        return;
+    }
+    stack[top++] = (struct bucket) { 0, n, 0, 0 };
+
+    while (top > 0) {
+        b = stack[--top];
+        k = keys + b.offset;
+        if (b.n < INSERTION) {
+            insertionSort(k, b.n, b.depth);
+            continue;
+        }
+        if (b.depth >= DEPTH_LIMIT) {
+            qsort_r(k, b.n, sizeof(struct key), compareSuffixes, &b.depth);
+            continue;
+        }
+        // duplicates share whole prefixes; skip 8 bytes at a time over them
+        if (b.byte == 0) {
+            for (i = 1; i < b.n && k[i].prefix == k[0].prefix; i++) {
+            }
+            if (i == b.n) {
+                if ((k[0].prefix & 0xff) == 0) {
+                    continue;
+                }
+                b.byte = 7;
+                nextByte(k, &b);
+                stack[top++] = b;
+                continue;
+            }
+        }
+
+        shift = 56 - 8 * b.byte;
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < b.n; i++) {
+            count[k[i].prefix >> shift & 0xff]++;
+        }
+        c = k[0].prefix >> shift & 0xff;
+        if (count[c] == b.n) {
+            // bucket 0 holds the strings that end here, all equal
+            if (c != 0) {
+                nextByte(k, &b);
+                stack[top++] = b;
+            }
+            continue;
+        }
+        for (pos = 0, c = 0; c < 256; c++) {
+            start[c] = pos;
+            pos += count[c];
+        }
+        for (i = 0; i < b.n; i++) {
+            tmp[start[k[i].prefix >> shift & 0xff]++] = k[i];
+        }
+        memcpy(k, tmp, b.n * sizeof(struct key));
+
+        for (pos = count[0], c = 1; c < 256; pos += count[c], c++) {
+            if (count[c] < 2) {
+                continue;
+            }
+            next = (struct bucket) { b.offset + pos, count[c], b.depth, b.byte };
+            nextByte(keys + next.offset, &next);
+            if (top == size) {
+                grown = realloc(stack, 2 * size * sizeof(struct bucket));
+                if (grown == NULL) {
+                    qsort_r(keys + next.offset, next.n, sizeof(struct key), compareSuffixes, &next.depth);
+                    continue;
+                }
+                stack = grown;
+                size *= 2;
+            }
+            stack[top++] = next;
+        }
+    }
+    free(stack);
+}
+
+static void *sortRun(void *arg) {
+    struct job *job = arg;
+    size_t i;
+
+    radixSort(job->keys, job->tmp, job->n);
+    // the merges compare from the start of the strings again
+    if (job->reload) {
+        for (i = 0; i < job->n; i++) {
+            job->keys[i].prefix = loadPrefix(job->keys[i].s, 0);
+        }
+    }
+    return NULL;
+}
+
+static void *mergeRuns(void *arg) {
+    struct job *job = arg;
+    struct key *a = job->keys, *b = job->keys + job->n, *end = job->keys + job->m, *out = job->tmp;
+
+    while (a < job->keys + job->n && b < end) {
+        // ties take from the first run, so equal strings keep their order
+        if (compareKeys(b, a, 0) < 0) {
+            *out++ = *b++;
+        } else {
+            *out++ = *a++;
+        }
+    }
+    memcpy(out, a, (job->keys + job->n - a) * sizeof(struct key));
+    out += job->keys + job->n - a;
+    memcpy(out, b, (end - b) * sizeof(struct key));
+    return NULL;
+}
+
+static int compareStrings(const void *a, const void *b) {
+    return mystrcmp(*(const char **)a, *(const char **)b);
+}
+
+// Runs fn on each job, in its own thread but for the last, which runs on the caller
+static void runJobs(void *(*fn)(void *), struct job *jobs, pthread_t *tids, int n) {
+    int i;
+
+    for (i = 0; i < n - 1; i++) {
+        if (pthread_create(&tids[i], NULL, fn, &jobs[i])) {
+            fn(&jobs[i]);
+            tids[i] = 0;
+        }
+    }
+    fn(&jobs[n - 1]);
+    for (i = 0; i < n - 1; i++) {
+        if (tids[i]) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+}
+
+void mystrsort(const char **strings, size_t n, int threads) {
+    struct key *keys, *tmp, *swap;
+    struct job *jobs;
+    pthread_t *tids;
+    size_t i, width, *bounds;
+    int runs, pairs, r;
+
+    if (n < 2) {
+        return;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    // tiny runs are not worth a thread
+    if ((size_t)threads > n / INSERTION + 1) {
+        threads = n / INSERTION + 1;
+    }
+
+    keys = malloc(n * sizeof(struct key));
+    tmp = malloc(n * sizeof(struct key));
+    jobs = malloc(threads * sizeof(struct job));
+    tids = malloc(threads * sizeof(pthread_t));
+    bounds = malloc((threads + 1) * sizeof(size_t));
+    if (keys == NULL || tmp == NULL || jobs == NULL || tids == NULL || bounds == NULL) {
+        // no memory to spare, so sort in place with no cached prefixes at all
+        free(keys);
+        free(tmp);
+        free(jobs);
+        free(tids);
+        free(bounds);
+        qsort(strings, n, sizeof(char *), compareStrings);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        keys[i].s = strings[i];
+        keys[i].prefix = loadPrefix(strings[i], 0);
+    }
+
+    // one run per thread, sorted side by side
+    for (r = 0; r <= threads; r++) {
+        bounds[r] = n * r / threads;
+    }
+    for (r = 0; r < threads; r++) {
+        jobs[r].keys = keys + bounds[r];
+        jobs[r].tmp = tmp + bounds[r];
+        jobs[r].n = bounds[r + 1] - bounds[r];
+        jobs[r].reload = threads > 1;
+    }
+    runJobs(sortRun, jobs, tids, threads);
+
+    // then merged pairwise, all pairs of a round at once, until one run is left
+    for (runs = threads, width = 1; runs > 1; runs = (runs + 1) / 2, width *= 2) {
+        pairs = runs / 2;
+        for (r = 0; r < pairs; r++) {
+            jobs[r].keys = keys + bounds[2 * r * width];
+            jobs[r].tmp = tmp + bounds[2 * r * width];
+            jobs[r].n = bounds[(2 * r + 1) * width] - bounds[2 * r * width];
+            jobs[r].m = bounds[(2 * r + 2) * width < (size_t)threads ? (2 * r + 2) * width : (size_t)threads] -
+                        bounds[2 * r * width];
+        }
+        runJobs(mergeRuns, jobs, tids, pairs);
+        // an odd run out has no partner this round
+        if (runs & 1) {
+            i = bounds[2 * pairs * width];
+            memcpy(tmp + i, keys + i, (n - i) * sizeof(struct key));
+        }
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+
+    for (i = 0; i < n; i++) {
+        strings[i] = keys[i].s;
+    }
+    free(keys);
+    free(tmp);
+    free(jobs);
+    free(tids);
+    free(bounds);
+}
@@ -0,0 +1,9 @@
+// strsort.h
+//
+// Bulk string sorting on top of mystrcmp.
+
+#include <stddef.h>
+
+// Sort n NUL-terminated strings in place in byte order, the order of mystrcmp and LC_ALL=C sort.
+// Each of threads workers sorts a share of the strings, and the sorted shares are merged pairwise in parallel
+void mystrsort(const char **strings, size_t n, int threads);
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <linux/ptrace.h>
+
+// Runs every reverse strategy on generated inputs of several sizes, in several directories (say tmpfs and disk),
+// and prints one CSV line per run: throughput and peak RSS from a plain run, syscalls and main stack size from a traced one.
+// Every strategy writes its output to a file next to the input, so they all pay for the same kind of writes.
+// Inputs are read from the page cache, the generator has just written them
+
+static char *SIZES = "1K,64K,1M,16M,256M";
+static char *DIRS = "/dev/shm,.";
+static char *STRATEGIES = "legacy,buffered,mmap-simd,parallel,streaming";
+static long long LEGACY_LIMIT = 16 << 20;       // legacy recurses per KB and prints per byte, it takes minutes beyond this
+static int RUNS = 3;                            // the fastest run is reported
+
+struct strategy {
+	const char *name;
+	char *argv[6];          // INPUT is replaced with the input file
+	const char *kernel;     // REVERSE_KERNEL to run with, NULL for the default
+	int piped;              // the input comes through a pipe instead of as a file
+};
+
+static struct strategy strategies[] = {
+	{ "legacy", { "./reverse-legacy", "INPUT", NULL }, NULL, 0 },
+	{ "buffered", { "./reverse", "INPUT", NULL }, "scalar", 0 },
+	{ "mmap-simd", { "./reverse", "INPUT", NULL }, NULL, 0 },
+	{ "parallel", { "./reverse", "-j", "0", "INPUT", NULL }, NULL, 0 },
+	{ "streaming", { "./reverse", "-m", "64", "-", NULL }, NULL, 1 },
+};
+#define NSTRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+struct result {
+	double seconds;
+	long max_rss_kb;
+	long syscalls;
+	long stack_kb;
+};
+
+double getTime() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1E9;
+}
+
+long long parseSize(const char *text) {
+	char *end;
+	long long size = strtoll(text, &end, 10);
+
+	switch (*end) {
+		case 'G':
+			size <<= 10;
+			// fall through
+		case 'M':
+			size <<= 10;
+			// fall through
+		case 'K':
+			size <<= 10;
+			end++;
+	}
+	if (*end != '\0' || size < 0) {
+		fprintf(stderr, "ERROR: Invalid size %s\n", text);
+		exit(1);
+	}
+	return size;
+}
+
+// Text-like input: random printable lines, a megabyte of them repeated
+void generateInput(const char *path, long long size) {
+	static char pattern[1 << 20];
+	long long done;
+	ssize_t result;
+	size_t i, n;
+	int fd;
+
+	srand(1);
+	for (i = 0; i < sizeof(pattern); i++) {
+		pattern[i] = rand() % 64 == 0 ? '\n' : ' ' + rand() % 95;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "ERROR: Input %s could not be created\n", path);
+		exit(1);
+	}
+	for (done = 0; done < size; done += result) {
+		n = size - done < (long long) sizeof(pattern) ? (size_t) (size - done) : sizeof(pattern);
+		result = write(fd, pattern, n);
+		if (result <= 0) {
+			fprintf(stderr, "ERROR: Input %s could not be written\n", path);
+			exit(1);
+		}
+	}
+	close(fd);
+}
+
+// Feed the input into a pipe from a child of our own, for the strategies that read a stream
+pid_t startFeeder(const char *input, int *readend) {
+	int fds[2], fd;
+	pid_t pid;
+
+	if (pipe(fds) == -1) {
+		fprintf(stderr, "ERROR: Pipe could not be created\n");
+		exit(1);
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		fd = open(input, O_RDONLY);
+		while (fd != -1 && splice(fd, NULL, fds[1], NULL, 1 << 20, 0) > 0);
+		_exit(0);
+	}
+	close(fds[1]);
+	*readend = fds[0];
+	return pid;
+}
+
+// Start the strategy on input, writing to output, stopped for the tracer first when traced
+pid_t startStrategy(struct strategy *st, const char *input, const char *output, int traced, pid_t *feeder) {
+	char *argv[6];
+	int i, in = -1, out;
+	pid_t pid;
+
+	*feeder = -1;
+	if (st->piped) {
+		*feeder = startFeeder(input, &in);
+	}
+	for (i = 0; i < 6; i++) {
+		argv[i] = st->argv[i] != NULL && strcmp(st->argv[i], "INPUT") == 0 ? (char *) input : st->argv[i];
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "ERROR: Could not start %s\n", st->name);
+		exit(1);
+	}
+	if (pid == 0) {
+		out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out == -1 || dup2(out, 1) == -1 || (in != -1 && dup2(in, 0) == -1)) {
+			_exit(127);
+		}
+		if (st->kernel != NULL) {
+			setenv("REVERSE_KERNEL", st->kernel, 1);
+		}
+		if (traced) {
+			ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+			raise(SIGSTOP);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	if (in != -1) {
+		close(in);
+	}
+	return pid;
+}
+
+void checkExit(struct strategy *st, int status) {
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "ERROR: %s failed, status %d\n", st->name, status);
+		exit(1);
+	}
+}
+
+// Wall time and peak RSS of an untraced run
+void timeRun(struct strategy *st, const char *input, const char *output, struct result *res) {
+	struct rusage usage;
+	double start;
+	pid_t pid, feeder;
+	int status;
+
+	start = getTime();
+	pid = startStrategy(st, input, output, 0, &feeder);
+	if (wait4(pid, &status, 0, &usage) == -1) {
+		fprintf(stderr, "ERROR: Could not wait for %s\n", st->name);
+		exit(1);
+	}
+	res->seconds = getTime() - start;
+	res->max_rss_kb = usage.ru_maxrss;
+	checkExit(st, status);
+	if (feeder != -1) {
+		waitpid(feeder, NULL, 0);
+	}
+}
+
+// VmStk of a process, the size its main stack has grown to
+long readStack(pid_t pid) {
+	char path[64], line[256];
+	long kb = -1;
+	FILE *file;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "VmStk: %ld", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(file);
+	return kb;
+}
+
+// Count the syscalls of every thread with ptrace, and read the stack size just before the process exits
+void traceRun(struct strategy *st, const char *input, const char *output, struct result *res) {
+	struct ptrace_syscall_info info;
+	pid_t pid, feeder, tid;
+	int status, sig, event;
+
+	res->syscalls = 0;
+	res->stack_kb = -1;
+	pid = startStrategy(st, input, output, 1, &feeder);
+	if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+		fprintf(stderr, "ERROR: Could not trace %s\n", st->name);
+		exit(1);
+	}
+	ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC |
+	       PTRACE_O_TRACEEXIT | PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, pid, NULL, 0);
+
+	while (1) {
+		tid = waitpid(-1, &status, __WALL);
+		if (tid == -1) {
+			fprintf(stderr, "ERROR: Lost track of %s\n", st->name);
+			exit(1);
+		}
+		if (tid == feeder && (WIFEXITED(status) || WIFSIGNALED(status))) {
+			feeder = -1;
+			continue;
+		}
+		if (!WIFSTOPPED(status)) {
+			if (tid == pid) {
+				break;
+			}
+			continue;
+		}
+
+		sig = WSTOPSIG(status);
+		event = status >> 16;
+		if (sig == (SIGTRAP | 0x80)) {
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				res->syscalls++;
+			}
+			sig = 0;
+		} else if (event == PTRACE_EVENT_EXIT) {
+			if (tid == pid) {
+				res->stack_kb = readStack(pid);
+			}
+			sig = 0;
+		} else if (event != 0 || sig == SIGSTOP) {
+			// Clones, the exec and new threads starting up stop without a signal to pass on
+			sig = 0;
+		}
+		ptrace(PTRACE_SYSCALL, tid, NULL, sig);
+	}
+	checkExit(st, status);
+	if (feeder != -1) {
+		waitpid(feeder, NULL, 0);
+	}
+}
+
+// Run every selected strategy on one input
+void benchInput(const char *label, const char *dir, const char *input, long long size, const char *selected) {
+	char output[4096], names[256], *name, *save;
+	struct result best, res;
+	struct strategy *st;
+	unsigned int s;
+	int run;
+
+	snprintf(output, sizeof(output), "%s/revbench.out", dir);
+	for (s = 0; s < NSTRATEGIES; s++) {
+		st = &strategies[s];
+		snprintf(names, sizeof(names), "%s", selected);
+		for (name = strtok_r(names, ",", &save); name != NULL && strcmp(name, st->name) != 0; name = strtok_r(NULL, ",", &save));
+		if (name == NULL || (strcmp(st->name, "legacy") == 0 && size > LEGACY_LIMIT)) {
+			continue;
+		}
+
+		best.seconds = -1;
+		for (run = 0; run < RUNS; run++) {
+			timeRun(st, input, output, &res);
+			if (best.seconds < 0 || res.seconds < best.seconds) {
+				best = res;
+			}
+		}
+		traceRun(st, input, output, &best);
+
+		printf("%s,%s,%s,%lld,%.6f,%.1f,%ld,%ld,%ld\n", label, st->name, dir, size, best.seconds,
+		       size / best.seconds / (1 << 20), best.max_rss_kb, best.syscalls, best.stack_kb);
+		fflush(stdout);
+	}
+	unlink(output);
+}
+
+int main(int argc, char ** argv) {
+	char *label = "", input[4096], *dirs, *dir, *sizes, *dsave, *ssave, *sizetext;
+	long long size;
+	int opt;
+
+	// -s <sizes>, -d <directories> and -r <strategies> as comma separated lists, -n <runs> per measurement,
+	// -L <size> up to which legacy is run, -l <label> for the first column, e.g. the commit
+	while ((opt = getopt(argc, argv, "s:d:r:n:L:l:")) != -1) {
+		switch (opt) {
+			case 's':
+				SIZES = optarg;
+				break;
+			case 'd':
+				DIRS = optarg;
+				break;
+			case 'r':
+				STRATEGIES = optarg;
+				break;
+			case 'n':
+				RUNS = atoi(optarg);
+				break;
+			case 'L':
+				LEGACY_LIMIT = parseSize(optarg);
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			default:
+				argc = 0;
+		}
+	}
+	if (argc == 0 || optind != argc || RUNS < 1) {
+		fprintf(stderr, "Usage: revbench [-s <sizes>] [-d <directories>] [-r <strategies>] [-n <runs>] [-L <legacy-limit>] [-l <label>]\n"
+		                "       sizes like 1K,1M,16G, strategies out of %s\n", "legacy,buffered,mmap-simd,parallel,streaming");
+		return 1;
+	}
+
+	printf("label,strategy,directory,bytes,seconds,mb_per_s,max_rss_kb,syscalls,stack_kb\n");
+	dirs = strdup(DIRS);
+	for (dir = strtok_r(dirs, ",", &dsave); dir != NULL; dir = strtok_r(NULL, ",", &dsave)) {
+		sizes = strdup(SIZES);
+		for (sizetext = strtok_r(sizes, ",", &ssave); sizetext != NULL; sizetext = strtok_r(NULL, ",", &ssave)) {
+			size = parseSize(sizetext);
+			snprintf(input, sizeof(input), "%s/revbench.in", dir);
+			generateInput(input, size);
+			benchInput(label, dir, input, size, STRATEGIES);
+			unlink(input);
+		}
+		free(sizes);
+	}
+	free(dirs);
+	return 0;
+}
@@ -1,53 +1,668 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
-static int size = 1024;
+// Regular files are mapped and reversed this many bytes at a time, into one buffer that is written out whole.
+// Streams are kept in segments of the same size
+static size_t block = 1 << 20;
 
-void reverse(int fd) {
-	char *input = malloc(size);
+// Streams are held in memory up to this size, their oldest segments go to a temporary file beyond it
+static size_t memory_limit = 64 << 20;
+
+// Parallel reversal hands out blocks of this size to the workers, a multiple of any O_DIRECT alignment
+static size_t parallel_block = 8 << 20;
+#define DIRECT_ALIGN 4096
+
+typedef void (*reverse_fn)(char *dst, const char *src, size_t n);
+// Records up to this long are copied together before they are written in line mode
+#define LINE_COPY 512
+
+typedef const char *(*scan_fn)(const char *buf, size_t n, char sep);
+
+// dst[i] = src[n - 1 - i] for every i below n, the vector versions leave the last n % width bytes to this one
+static void reverseScalar(char *dst, const char *src, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		dst[i] = src[n - 1 - i];
+	}
+}
+
+__attribute__((target("ssse3")))
+static void reverseSsse3(char *dst, const char *src, size_t n) {
+	const __m128i mask = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + n - i - 16));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(v, mask));
+	}
+	reverseScalar(dst + i, src, n - i);
+}
+
+// pshufb only shuffles within 128-bit lanes, so the lanes are swapped afterwards
+__attribute__((target("avx2")))
+static void reverseAvx2(char *dst, const char *src, size_t n) {
+	const __m256i mask = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	                                      15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	size_t i;
 
-	int result = read(fd, input, size);
+	for (i = 0; i + 64 <= n; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (src + n - i - 32));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (src + n - i - 64));
+		a = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(a, mask), 0x4e);
+		b = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(b, mask), 0x4e);
+		_mm256_storeu_si256((__m256i *) (dst + i), a);
+		_mm256_storeu_si256((__m256i *) (dst + i + 32), b);
+	}
+	reverseSsse3(dst + i, src, n - i);
+}
 
-	// Recursive calls until entire file is read
-	if (result > 0) {
-		reverse(fd);
+// vpermb reverses a whole 64-byte register in one instruction
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void reverseAvx512(char *dst, const char *src, size_t n) {
+	static const char order[64] = {
+		63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49, 48,
+		47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 32,
+		31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16,
+		15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+	};
+	const __m512i idx = _mm512_loadu_si512(order);
+	size_t i;
 
-		// Print this chunk in reverse order
-		result--;
-		while (result >= 0) {
-			printf("%c", input[result]);
-			result--;
+	for (i = 0; i + 128 <= n; i += 128) {
+		__m512i a = _mm512_loadu_si512(src + n - i - 64);
+		__m512i b = _mm512_loadu_si512(src + n - i - 128);
+		_mm512_storeu_si512(dst + i, _mm512_permutexvar_epi8(idx, a));
+		_mm512_storeu_si512(dst + i + 64, _mm512_permutexvar_epi8(idx, b));
+	}
+	reverseAvx2(dst + i, src, n - i);
+}
+
+// The widest kernel this CPU runs, or the one named in REVERSE_KERNEL (scalar, ssse3, avx2 or avx512) for benchmarks
+static reverse_fn pickKernel() {
+	const char *name = getenv("REVERSE_KERNEL");
+
+	if (name != NULL && strcmp(name, "scalar") == 0) {
+		return reverseScalar;
+	}
+	__builtin_cpu_init();
+	if (name != NULL && strcmp(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3")) {
+		return reverseSsse3;
+	}
+	if (name != NULL && strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		return reverseAvx2;
+	}
+	if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw")) {
+		return reverseAvx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return reverseAvx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return reverseSsse3;
+	}
+	return reverseScalar;
+}
+
+void writeAll(int fd, const char *buf, size_t len) {
+	ssize_t result;
+
+	while (len > 0) {
+		result = write(fd, buf, len);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "ERROR: Output could not be written\n");
+			exit(1);
 		}
+		buf += result;
+		len -= result;
+	}
+}
 
-		free(input);
-		return;
-	} else if (result == 0) {
-		free(input);
+// Reverse a regular file through a mapping of it, block by block from its end.
+// The output goes into outfile through a mapping as well when there is one, or else to stdout in block-sized writes
+void reverseMapped(int fd, size_t length, const char *outfile) {
+	reverse_fn kernel = pickKernel();
+	char *input, *output, *buf = NULL;
+	size_t done, n;
+	int out = -1;
+
+	// An empty file can't be mapped, and has nothing to reverse
+	if (length == 0) {
+		if (outfile != NULL && ((out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || close(out) == -1)) {
+			fprintf(stderr, "ERROR: Output file could not be created\n");
+			exit(1);
+		}
 		return;
+	}
+
+	input = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (input == MAP_FAILED) {
+		fprintf(stderr, "ERROR: File could not be mapped\n");
+		exit(1);
+	}
+
+	if (outfile != NULL) {
+		out = open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (out == -1 || ftruncate(out, length) == -1) {
+			fprintf(stderr, "ERROR: Output file could not be created\n");
+			exit(1);
+		}
+		// Populating the whole mapping up front saves a page fault for every page of the output
+		output = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, out, 0);
+		if (output == MAP_FAILED) {
+			fprintf(stderr, "ERROR: Output file could not be mapped\n");
+			exit(1);
+		}
+	} else {
+		buf = malloc(block);
+		if (buf == NULL) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			exit(1);
+		}
+	}
+
+	for (done = 0; done < length; done += n) {
+		n = length - done < block ? length - done : block;
+
+		// The input is read backwards, which readahead doesn't pick up, so ask for the block after this one ourselves
+		if (length - done > n) {
+			size_t ahead = length - done - n < block ? length - done - n : block;
+			size_t start = (length - done - n - ahead) & ~(size_t) (sysconf(_SC_PAGESIZE) - 1);
+			madvise(input + start, length - done - n - start, MADV_WILLNEED);
+		}
+
+		if (out != -1) {
+			kernel(output + done, input + length - done - n, n);
+		} else {
+			kernel(buf, input + length - done - n, n);
+			writeAll(1, buf, n);
+		}
+	}
+
+	if (out != -1) {
+		munmap(output, length);
+		if (close(out) == -1) {
+			fprintf(stderr, "ERROR: Output file could not be written\n");
+			exit(1);
+		}
+	}
+	free(buf);
+	munmap(input, length);
+}
+
+struct parallel {
+	reverse_fn kernel;
+	const char *input;
+	size_t length, nblocks;
+	size_t next;                    // next output block to hand out, taken atomically
+	int out, direct;                // direct is an O_DIRECT descriptor of the output, or -1
+};
+
+// Output block j holds input bytes [length - (j + 1) * block, length - j * block) reversed,
+// so it starts on a block boundary of the output, where O_DIRECT wants its writes
+void * reverseBlocks(void *arg) {
+	struct parallel *job = arg;
+	size_t j, n, offset, aligned;
+	ssize_t result;
+	char *buf;
+
+	if (posix_memalign((void **) &buf, DIRECT_ALIGN, parallel_block) != 0) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		exit(1);
+	}
+	// Huge pages spare the kernel most of the page table walks when it copies the buffer out
+	madvise(buf, parallel_block, MADV_HUGEPAGE);
+
+	while ((j = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nblocks) {
+		offset = j * parallel_block;
+		n = job->length - offset < parallel_block ? job->length - offset : parallel_block;
+		// The block is read backwards, so readahead won't fetch it
+		madvise((void *) ((size_t) (job->input + job->length - offset - n) & ~(size_t) (sysconf(_SC_PAGESIZE) - 1)), n, MADV_WILLNEED);
+		job->kernel(buf, job->input + job->length - offset - n, n);
+
+		// Only the last block can be short, its unaligned tail goes through the page cache
+		aligned = job->direct != -1 ? n & ~(size_t) (DIRECT_ALIGN - 1) : 0;
+		if (aligned > 0) {
+			result = pwrite(job->direct, buf, aligned, offset);
+			if (result != (ssize_t) aligned) {
+				fprintf(stderr, "ERROR: Output could not be written\n");
+				exit(1);
+			}
+		}
+		if (n > aligned) {
+			result = pwrite(job->out, buf + aligned, n - aligned, offset + aligned);
+			if (result != (ssize_t) (n - aligned)) {
+				fprintf(stderr, "ERROR: Output could not be written\n");
+				exit(1);
+			}
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+// Reverse a regular file with threads workers, each writing its blocks to their mirrored offset in the output.
+// The output is outfile, or stdout when that is a regular file not opened for appending (>>), where every write
+// would go to the end whatever its offset
+void reverseParallel(int fd, size_t length, const char *outfile, int threads, int direct) {
+	struct parallel job;
+	pthread_t *workers;
+	struct stat st;
+	int i;
+
+	memset(&job, 0, sizeof(job));
+	job.kernel = pickKernel();
+	job.length = length;
+	job.nblocks = (length + parallel_block - 1) / parallel_block;
+	job.direct = -1;
+
+	if (outfile != NULL) {
+		job.out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	} else if (fstat(1, &st) == 0 && S_ISREG(st.st_mode) && (fcntl(1, F_GETFL) & O_APPEND) == 0) {
+		job.out = 1;
 	} else {
-		fprintf(stderr, "ERROR: File could not be read\n");
-		free(input);
+		fprintf(stderr, "ERROR: -j writes at offsets of the output, it needs -o or stdout redirected to a file with >, not >>\n");
 		exit(1);
 	}
-	
+	if (job.out == -1 || ftruncate(job.out, length) == -1) {
+		fprintf(stderr, "ERROR: Output file could not be created\n");
+		exit(1);
+	}
+	if (direct && outfile != NULL) {
+		job.direct = open(outfile, O_WRONLY | O_DIRECT);
+		if (job.direct == -1) {
+			fprintf(stderr, "ERROR: Output file can't be written with O_DIRECT\n");
+			exit(1);
+		}
+	}
+	if (length == 0) {
+		return;
+	}
+
+	job.input = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (job.input == MAP_FAILED) {
+		fprintf(stderr, "ERROR: File could not be mapped\n");
+		exit(1);
+	}
+
+	workers = calloc(threads, sizeof(pthread_t));
+	if (workers == NULL) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, reverseBlocks, &job) != 0) {
+			fprintf(stderr, "ERROR: Could not start a worker\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	if ((job.direct != -1 && close(job.direct) == -1) || (job.out != 1 && close(job.out) == -1)) {
+		fprintf(stderr, "ERROR: Output file could not be written\n");
+		exit(1);
+	}
+	free(workers);
+	munmap((void *) job.input, length);
+}
+
+void readSegment(int fd, char *buf, size_t len, off_t offset) {
+	ssize_t result;
+
+	while (len > 0) {
+		result = pread(fd, buf, len, offset);
+		if (result <= 0) {
+			fprintf(stderr, "ERROR: Spilled input could not be read back\n");
+			exit(1);
+		}
+		buf += result;
+		len -= result;
+		offset += result;
+	}
+}
+
+// A temporary file that is gone as soon as it's closed, in $TMPDIR or else /tmp
+int createSpill() {
+	const char *dir = getenv("TMPDIR");
+	int fd;
+
+	fd = open(dir != NULL ? dir : "/tmp", O_TMPFILE | O_RDWR, 0600);
+	if (fd == -1) {
+		fprintf(stderr, "ERROR: Temporary file for the input could not be created\n");
+		exit(1);
+	}
+	return fd;
+}
+
+// Reverse a stream of unknown length, like a pipe, in segments of block bytes.
+// Only the newest memory_limit bytes stay in memory: once they are all in use, the oldest segment is appended to a
+// temporary file. The segments in memory are output first, then the spilled ones are read back from the last to the first
+void reverse(int fd) {
+	reverse_fn kernel = pickKernel();
+	size_t nsegments, oldest = 0, used = 0, spilled = 0, fill = 0, i;
+	char **segments, *out;
+	ssize_t result;
+	int spill = -1;
+
+	nsegments = memory_limit / block > 1 ? memory_limit / block : 1;
+	segments = calloc(nsegments, sizeof(char *));
+	out = malloc(block);
+	if (segments == NULL || out == NULL) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		exit(1);
+	}
+
+	// segments[(oldest + k) % nsegments] holds the k-th segment in memory, the last of them is filling up
+	while (1) {
+		if (used == 0 || fill == block) {
+			if (used == nsegments) {
+				if (spill == -1) {
+					spill = createSpill();
+				}
+				writeAll(spill, segments[oldest], block);
+				spilled++;
+				oldest = (oldest + 1) % nsegments;
+				used--;
+			}
+			i = (oldest + used) % nsegments;
+			if (segments[i] == NULL && (segments[i] = malloc(block)) == NULL) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				exit(1);
+			}
+			used++;
+			fill = 0;
+		}
+
+		result = read(fd, segments[(oldest + used - 1) % nsegments] + fill, block - fill);
+		if (result == 0) {
+			break;
+		}
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "ERROR: File could not be read\n");
+			exit(1);
+		}
+		fill += result;
+	}
+
+	// The newest segment may be partly filled, every other one is full
+	for (i = used; i > 0; i--) {
+		kernel(out, segments[(oldest + i - 1) % nsegments], i == used ? fill : block);
+		writeAll(1, out, i == used ? fill : block);
+	}
+	for (i = spilled; i > 0; i--) {
+		readSegment(spill, segments[oldest], block, (off_t) (i - 1) * block);
+		kernel(out, segments[oldest], block);
+		writeAll(1, out, block);
+	}
+
+	if (spill != -1) {
+		close(spill);
+	}
+	for (i = 0; i < nsegments; i++) {
+		free(segments[i]);
+	}
+	free(segments);
+	free(out);
+}
+
+// The last sep in buf[0, n), or NULL when there is none
+static const char *scanScalar(const char *buf, size_t n, char sep) {
+	return memrchr(buf, sep, n);
+}
+
+// Compares 64 bytes at a time from the end, and only looks for the match within them once there is one
+__attribute__((target("avx2,bmi")))
+static const char *scanAvx2(const char *buf, size_t n, char sep) {
+	const __m256i needle = _mm256_set1_epi8(sep);
+	uint64_t mask;
+
+	while (n >= 64) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *) (buf + n - 64));
+		__m256i hi = _mm256_loadu_si256((const __m256i *) (buf + n - 32));
+		mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle)) |
+		       (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)) << 32;
+		if (mask != 0) {
+			return buf + n - 64 + 63 - __builtin_clzll(mask);
+		}
+		n -= 64;
+	}
+	return scanScalar(buf, n, sep);
+}
+
+static scan_fn pickScanner() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")) {
+		return scanAvx2;
+	}
+	return scanScalar;
+}
+
+// Write out the iovecs, taking up again where a short write stopped
+void writevAll(int fd, struct iovec *iov, int count) {
+	ssize_t result;
+
+	while (count > 0) {
+		result = writev(fd, iov, count);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "ERROR: Output could not be written\n");
+			exit(1);
+		}
+		while (count > 0 && (size_t) result >= iov->iov_len) {
+			result -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + result;
+			iov->iov_len -= result;
+		}
+	}
+}
+
+// Output the records of a file, each ended by sep, from the last to the first, like tac.
+// The records are left as they are, so a last record without sep runs into the one printed after it, as with tac.
+// A stream is copied into a temporary file first, so it can be mapped like a regular file
+void reverseLines(int fd, char sep, const char *outfile) {
+	scan_fn scan = pickScanner();
+	struct iovec iov[IOV_MAX];
+	const char *input, *found;
+	size_t length, end, start, n, staged = 0;
+	char *stage, *buf;
+	struct stat st;
+	ssize_t result;
+	int out = 1, count = 0, spill;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		buf = malloc(block);
+		if (buf == NULL) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			exit(1);
+		}
+		spill = createSpill();
+		while ((result = read(fd, buf, block)) != 0) {
+			if (result < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				fprintf(stderr, "ERROR: File could not be read\n");
+				exit(1);
+			}
+			writeAll(spill, buf, result);
+		}
+		free(buf);
+		fd = spill;
+		fstat(fd, &st);
+	}
+
+	if (outfile != NULL) {
+		out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out == -1) {
+			fprintf(stderr, "ERROR: Output file could not be created\n");
+			exit(1);
+		}
+	}
+	length = st.st_size;
+	if (length == 0) {
+		return;
+	}
+
+	input = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (input == MAP_FAILED) {
+		fprintf(stderr, "ERROR: File could not be mapped\n");
+		exit(1);
+	}
+	stage = malloc(block);
+	if (stage == NULL) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		exit(1);
+	}
+
+	// The record ending at end starts after the last sep before its own. Short records are gathered into stage,
+	// since the kernel copies many small iovecs more slowly than we do, long ones are written from the mapping
+	for (end = length; end > 0; end = start) {
+		found = scan(input, end - 1, sep);
+		start = found != NULL ? found - input + 1 : 0;
+		n = end - start;
+
+		if (n <= LINE_COPY && staged + n > block) {
+			writevAll(out, iov, count);
+			count = 0;
+			staged = 0;
+		}
+		if (n <= LINE_COPY) {
+			memcpy(stage + staged, input + start, n);
+			// Consecutive short records become one iovec
+			if (staged > 0 && count > 0 && iov[count - 1].iov_base == stage + staged - iov[count - 1].iov_len) {
+				iov[count - 1].iov_len += n;
+				staged += n;
+				continue;
+			}
+			iov[count].iov_base = stage + staged;
+			staged += n;
+		} else {
+			iov[count].iov_base = (void *) (input + start);
+		}
+		iov[count].iov_len = n;
+		if (++count == IOV_MAX) {
+			writevAll(out, iov, count);
+			count = 0;
+			staged = 0;
+		}
+	}
+	writevAll(out, iov, count);
+
+	if (out != 1 && close(out) == -1) {
+		fprintf(stderr, "ERROR: Output file could not be written\n");
+		exit(1);
+	}
+	free(stage);
+	munmap((void *) input, length);
 }
 
 int main(int argc, char ** argv) {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: reverse <file_name_to_reverse>\n");
+	char *outfile = NULL;
+	struct stat st;
+	int opt, threads = -1, direct = 0, lines = 0;
+	char sep = '\n';
+
+	// -o <file> writes the reversed file there instead of to stdout,
+	// -j <threads> reverses with that many workers (0 for one per CPU), -d writes their output with O_DIRECT,
+	// -m <megabytes> of a stream are held in memory before it spills to a temporary file,
+	// -l reverses the order of lines instead of bytes, -z of NUL-terminated records and -s <char> of records ending in char
+	while ((opt = getopt(argc, argv, "o:j:dm:lzs:")) != -1) {
+		switch (opt) {
+			case 'l':
+				lines = 1;
+				break;
+			case 'z':
+				lines = 1;
+				sep = '\0';
+				break;
+			case 's':
+				lines = 1;
+				sep = optarg[0];
+				if (optarg[0] == '\0' || optarg[1] != '\0') {
+					argc = 0;
+				}
+				break;
+			case 'm':
+				memory_limit = (size_t) atol(optarg) << 20;
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'd':
+				direct = 1;
+				break;
+			default:
+				argc = 0;
+		}
+	}
+	if (argc == 0 || optind < argc - 1 || (direct && (threads < 0 || outfile == NULL)) || memory_limit == 0 ||
+			(lines && threads >= 0)) {
+		fprintf(stderr, "Usage: reverse [-o <output_file>] [-j <threads> [-d]] [-m <megabytes>] [<file_name_to_reverse> | -]\n"
+		                "       reverse -l | -z | -s <separator> [-o <output_file>] [<file_name_to_reverse> | -]\n");
 		return 1;
 	}
-	
-	int fd = open(argv[1], O_RDONLY);
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	// Without a file, or with -, stdin is reversed
+	int fd = optind == argc || strcmp(argv[optind], "-") == 0 ? 0 : open(argv[optind], O_RDONLY);
 
 	if (fd == -1) {
 		fprintf(stderr, "ERROR: File could not be opened\n");
 		return 1;
 	}
 
+	if (lines) {
+		reverseLines(fd, sep, outfile);
+		return 0;
+	}
+
+	// Regular files can be mapped, anything else is read as a stream
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (threads > 0) {
+			reverseParallel(fd, st.st_size, outfile, threads, direct);
+		} else {
+			reverseMapped(fd, st.st_size, outfile);
+		}
+		return 0;
+	}
+	if (outfile != NULL || threads > 0) {
+		fprintf(stderr, "ERROR: -o and -j need a regular file to reverse\n");
+		return 1;
+	}
+
 	reverse(fd);
 	
 	return 0;
-}
\ No newline at end of file
+}
@@ -5,17 +5,24 @@
 #include <time.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include "error.h"
+#include "evloop.h"
 
 static int PORT_SERVER = 1234;
 static int SIZE = 64;
 
+// Software timestamps the kernel takes when the ping passes the network stack, so the RTT can be split
+// into the time on the network and the time in the host. Hardware timestamps are left to pingclient3
+static int TIMESTAMPING = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+                        | SOF_TIMESTAMPING_OPT_TSONLY;
+
 int createSocket() {
     int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-
-    if (fd < 0) {
-        fprintf(stderr, "ERROR: Socket could not be acquired\n");
-        exit(1);
-    }
+    errorHandler(fd, "Socket could not be acquired");
     return fd;
 }
 
@@ -30,28 +37,59 @@ void sendMessage(int fd, in_addr_t s_addr) {
     dest.sin_addr.s_addr = s_addr;
 
     errsend = sendto(fd, msg, SIZE, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
+    errorHandler(errsend, "Message was not sent");
+}
 
-    if (errsend < 0) {
-        fprintf(stderr, "ERROR: Message was not sent\n");
-        exit(1);
+// Reads the software timestamp of a datagram, if the kernel attached one
+void readStamp(struct msghdr *msg, struct timespec *stamp) {
+    struct cmsghdr *cmsg;
+    struct scm_timestamping *ts;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            ts = (struct scm_timestamping *) CMSG_DATA(cmsg);
+            *stamp = ts->ts[0];
+        }
     }
 }
 
+// Reads the transmit timestamp of the ping from the error queue, if it is there. Only one datagram is ever sent
+void recvTxStamp(int fd, struct timespec *tx) {
+    char control[256];
+    struct msghdr msg;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        readStamp(&msg, tx);
+    }
+}
 
-
-void recvMessage(int fd) {
-    char resmsg[64];
+// Receives the reply, with its kernel timestamp
+void recvMessage(int fd, struct timespec *rx) {
+    char resmsg[64], control[256];
     int errrecv;
-    socklen_t fromlen;
     struct sockaddr_in from;
-    fromlen = sizeof(struct sockaddr_in);
-
-    errrecv = recvfrom(fd, resmsg, SIZE, 0, (struct sockaddr*) &from, &fromlen);
-
-    if (errrecv < 0) {
-        fprintf(stderr, "ERROR: Something went wrong when receiving the message\n");
-        exit(1);
-    }
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = resmsg;
+    iov.iov_len = SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    errrecv = recvmsg(fd, &msg, 0);
+    errorHandler(errrecv, "Something went wrong when receiving the message");
+    readStamp(&msg, rx);
 }
 
 struct in_addr * resolveHostName(const char *name) {
@@ -70,11 +108,8 @@ struct in_addr * resolveHostName(const char *name) {
 
 struct timespec getCurrentTime() {
     struct timespec starttime;
-    int starterr = clock_gettime(CLOCK_REALTIME, &starttime);
-    if (starterr < 0) {
-        fprintf(stderr, "ERROR: Something went wrong when reading the system clock\n");
-        exit(1);
-    }
+    int starterr = clock_gettime(CLOCK_MONOTONIC, &starttime);
+    errorHandler(starterr, "Something went wrong when reading the system clock");
     return starttime;
 }
 
@@ -94,37 +129,52 @@ int main(int argc, char ** argv) {
     }
 
     int fd, err;
+    EvLoop *loop;
     struct in_addr *addrp;
-    double rtt;
-    struct timespec starttime, endtime;
-    
+    double rtt, krtt;
+    struct timespec starttime, endtime, tx = {0}, rx = {0};
+
     // DNS (resolving hostname)
     addrp = resolveHostName(argv[1]);
 
     // Create socket
     fd = createSocket();
 
-    // Send message to the server & get start time for transmission
-    sendMessage(fd, addrp->s_addr);
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+
+    // Ask for kernel timestamps, the RTT measured in userspace remains if the kernel can't provide them
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &TIMESTAMPING, sizeof(TIMESTAMPING));
+
+    // Get start time for transmission before the send, like the kernel takes its timestamp during it,
+    // and send message to the server
     starttime = getCurrentTime();
+    sendMessage(fd, addrp->s_addr);
 
     // Wait to receive message from server, then get the receiving/end time
-    recvMessage(fd);
+    // The transmit timestamp makes the socket readable too, the receive blocks until the reply itself is there
+    err = ev_wait(loop, fd, EV_READ, -1);
+    errorHandler(err, "Something went wrong when waiting for the reply");
+    recvMessage(fd, &rx);
     endtime = getCurrentTime();
+    recvTxStamp(fd, &tx);
 
     // Cast sec and nsec to a single double for printing
     rtt = calcRTT(starttime, endtime);
 
-    err = printf("The RTT was: %f seconds.\n", rtt);
-    if (err < 0) {
-        exit(1);
+    // With both kernel timestamps, the kernel RTT is the time on the network, the rest was spent in the host
+    if ((tx.tv_sec || tx.tv_nsec) && (rx.tv_sec || rx.tv_nsec)) {
+        krtt = calcRTT(tx, rx);
+        err = printf("The RTT was: %f seconds (kernel %f seconds, %f seconds in the host).\n", rtt, krtt, rtt - krtt);
+    } else {
+        err = printf("The RTT was: %f seconds.\n", rtt);
     }
+    errorHandler(err, "Something went wrong when printing to stdout");
 
+    ev_free(loop);
     err = close(fd);
-    if (err < 0) {
-        fprintf(stderr, "ERROR: Socket couldn't be closed");
-        exit(1);
-    }
+    errorHandler(err, "Socket couldn't be closed");
 
     return 0;
 }
\ No newline at end of file
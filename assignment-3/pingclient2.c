@@ -3,20 +3,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-#include <sys/select.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include "error.h"
+#include "evloop.h"
 
 static int PORT_SERVER = 1234;
 static int SIZE = 64;
 
+// Software timestamps the kernel takes when the ping passes the network stack, so the RTT can be split
+// into the time on the network and the time in the host. Hardware timestamps are left to pingclient3
+static int TIMESTAMPING = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+                        | SOF_TIMESTAMPING_OPT_TSONLY;
+
 int createSocket() {
     int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-
-    if (fd < 0) {
-        fprintf(stderr, "ERROR: Socket could not be acquired\n");
-        exit(1);
-    }
+    errorHandler(fd, "Socket could not be acquired");
     return fd;
 }
 
@@ -31,26 +37,63 @@ void sendMessage(int fd, in_addr_t s_addr) {
     dest.sin_addr.s_addr = s_addr;
 
     errsend = sendto(fd, msg, SIZE, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
+    errorHandler(errsend, "Message was not sent");
+}
 
-    if (errsend < 0) {
-        fprintf(stderr, "ERROR: Message was not sent\n");
-        exit(1);
+// Reads the software timestamp of a datagram, if the kernel attached one
+void readStamp(struct msghdr *msg, struct timespec *stamp) {
+    struct cmsghdr *cmsg;
+    struct scm_timestamping *ts;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            ts = (struct scm_timestamping *) CMSG_DATA(cmsg);
+            *stamp = ts->ts[0];
+        }
     }
 }
 
-void recvMessage(int fd) {
-    char resmsg[64];
+// Reads the transmit timestamp of the ping from the error queue, if it is there. Only one datagram is ever sent
+void recvTxStamp(int fd, struct timespec *tx) {
+    char control[256];
+    struct msghdr msg;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        readStamp(&msg, tx);
+    }
+}
+
+// Receives the reply if there is one, with its kernel timestamp. Returns 0 when nothing was waiting
+int recvMessage(int fd, struct timespec *rx) {
+    char resmsg[64], control[256];
     int errrecv;
-    socklen_t fromlen;
     struct sockaddr_in from;
-    fromlen = sizeof(struct sockaddr_in);
-
-    errrecv = recvfrom(fd, resmsg, SIZE, 0, (struct sockaddr*) &from, &fromlen);
-
-    if (errrecv < 0) {
-        fprintf(stderr, "ERROR: Something went wrong when receiving the message\n");
-        exit(1);
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = resmsg;
+    iov.iov_len = SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    errrecv = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (errrecv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
     }
+    errorHandler(errrecv, "Something went wrong when receiving the message");
+    readStamp(&msg, rx);
+    return 1;
 }
 
 struct in_addr * resolveHostName(const char *name) {
@@ -69,11 +112,8 @@ struct in_addr * resolveHostName(const char *name) {
 
 struct timespec getCurrentTime() {
     struct timespec starttime;
-    int starterr = clock_gettime(CLOCK_REALTIME, &starttime);
-    if (starterr < 0) {
-        fprintf(stderr, "ERROR: Something went wrong when reading the system clock\n");
-        exit(1);
-    }
+    int starterr = clock_gettime(CLOCK_MONOTONIC, &starttime);
+    errorHandler(starterr, "Something went wrong when reading the system clock");
     return starttime;
 }
 
@@ -92,12 +132,11 @@ int main(int argc, char ** argv) {
         exit(1);
     }
 
-    int fd, nb, err;
+    int fd, nb, err, received = 0;
+    EvLoop *loop;
     struct in_addr *addrp;
-    struct timeval timeout;
-    struct timespec starttime, endtime;
-    double rtt = 0;
-    fd_set read_set;
+    struct timespec starttime, endtime, tx = {0}, rx = {0};
+    double rtt = 0, krtt, left;
 
     // DNS (resolving hostname)
     addrp = resolveHostName(argv[1]);
@@ -105,49 +144,54 @@ int main(int argc, char ** argv) {
     // Create socket
     fd = createSocket();
 
-    // Send message to the server & get start time for transmission
-    sendMessage(fd, addrp->s_addr);
-    starttime = getCurrentTime();
-    
-    // Specify to monitor our fd
-    FD_ZERO(&read_set);
-    FD_SET(fd, &read_set);
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
 
-    // Set timeout to 1 second
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+    // Ask for kernel timestamps, the RTT measured in userspace remains if the kernel can't provide them
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &TIMESTAMPING, sizeof(TIMESTAMPING));
 
-    // Block until interrupt
-    nb = select(fd+1, &read_set, NULL, NULL, &timeout);
+    // Get start time for transmission before the send, like the kernel takes its timestamp during it,
+    // and send message to the server
+    starttime = getCurrentTime();
+    sendMessage(fd, addrp->s_addr);
 
-    if (nb < 0) {
-        fprintf(stderr, "ERROR: Something went wrong with the timeout\n");
-        exit(1);
+    // Wait for 1 second at most. The transmit timestamp makes the socket readable too,
+    // so keep waiting with what is left of the timeout until the reply itself is there
+    while (!received && (left = 1 - calcRTT(starttime, getCurrentTime())) > 0) {
+        nb = ev_wait(loop, fd, EV_READ, left);
+        errorHandler(nb, "Something went wrong with the timeout");
+        if (nb == 0) {
+            break;
+        }
+        recvTxStamp(fd, &tx);
+        received = recvMessage(fd, &rx);
     }
+    endtime = getCurrentTime();
+
     // If timeout occurs before packet arrives
-    if (nb == 0) {
+    if (!received) {
         err = printf("The packet was lost.\n");
-        if (err < 0) {
-            exit(1);
-        }
+        errorHandler(err, "Something went wrong when printing to stdout");
     }
     // Print RTT if packet arrived
-    if (FD_ISSET(fd, &read_set)) {
-        recvMessage(fd);
-        endtime = getCurrentTime();
+    if (received) {
+        recvTxStamp(fd, &tx);
         rtt = calcRTT(starttime, endtime);
 
-        err = printf("The RTT was: %f seconds.\n", rtt);
-        if (err < 0) {
-            exit(1);
+        // With both kernel timestamps, the kernel RTT is the time on the network, the rest was spent in the host
+        if ((tx.tv_sec || tx.tv_nsec) && (rx.tv_sec || rx.tv_nsec)) {
+            krtt = calcRTT(tx, rx);
+            err = printf("The RTT was: %f seconds (kernel %f seconds, %f seconds in the host).\n", rtt, krtt, rtt - krtt);
+        } else {
+            err = printf("The RTT was: %f seconds.\n", rtt);
         }
+        errorHandler(err, "Something went wrong when printing to stdout");
     }
 
+    ev_free(loop);
     err = close(fd);
-    if (err < 0) {
-        fprintf(stderr, "ERROR: Socket couldn't be closed");
-        exit(1);
-    }
+    errorHandler(err, "Socket couldn't be closed");
 
     return 0;
 }
\ No newline at end of file
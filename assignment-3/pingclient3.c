@@ -1,22 +1,115 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-#include <sys/select.h>
 #include <netdb.h>
 #include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <endian.h>
+#include "error.h"
+#include "evloop.h"
+#include "twamp.h"
 
 static int PORT_SERVER = 1234;
 static int SIZE = 64;
 
+// Kernel timestamps of the probes. Software ones are taken when a datagram passes the network stack,
+// hardware ones by the NIC if it has been set up to take them. Without either, only the userspace RTT is known
+static int TIMESTAMPING = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+                        | SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+                        | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+// Kernel timestamp of a datagram, zero where the kernel or NIC didn't take one
+struct kstamp {
+    struct timespec sw, hw;
+};
+
+// Sweep mode: every target of a list is probed once per interval, all from one socket
+// Probes carry "<target> <seq>" so replies can be matched even when targets share an address
+static long TICK_NS = 1000000;          // period of the timer that paces the staggered sends
+static int SWEEP_SOCKBUF = 4*1024*1024;  // absorbs the replies of a whole sweep arriving together
+
+struct target {
+    char *name;
+    struct sockaddr_in addr;
+    uint32_t seq;                       // sequence number of the last probe sent
+    uint64_t answered;                  // bit i set when probe seq - i got its reply
+    uint32_t sent, received, lost, late, duplicates;
+    double rtt_min, rtt_max, rtt_sum;
+};
+
+// Probe waiting for its reply. Probes are kept in an open addressing hash table keyed by (target, seq)
+struct probe {
+    uint32_t target;                    // index in the target list plus one, 0 marks a free slot
+    uint32_t seq;
+    struct timespec sent;
+};
+
+// Replies per sweep, for the two sweeps that can have probes in flight at the same time
+struct sweep {
+    uint32_t replies;
+    double rtt_sum;
+};
+
+static struct probe *probes;
+static uint32_t probe_mask;
+static volatile sig_atomic_t interrupted = 0;
+
+// Load mode: probes are sent at a fixed rate and carry their sequence number and send time
+// Probes still unanswered after LOSS_TIMEOUT seconds count as lost, replies after that as late
+static double LOSS_TIMEOUT = 1;
+#define LOAD_BATCH 64                   // datagrams per sendmmsg and recvmmsg call
+static int MAX_PAYLOAD = 65507;
+
+struct load_payload {
+    uint64_t seq;
+    int64_t sent;                       // CLOCK_MONOTONIC in nanoseconds
+};
+
+// Probe of the load mode that may still be answered, kept in a ring indexed by sequence number
+struct load_slot {
+    int64_t sent;
+    int received;
+};
+
+struct load_stats {
+    uint64_t sent, received, lost, late, reordered, duplicates;
+};
+
+// Log-linear histogram of RTTs in nanoseconds, in the layout of an HDR histogram: every power of two
+// is split into HDR_SUB linear steps, so each value is recorded with 3 significant digits.
+// The values below 2*HDR_SUB take two rows of HDR_SUB, each power of two above them up to 2^40 one more
+#define HDR_SHIFT 10
+#define HDR_SUB (1 << HDR_SHIFT)
+#define HDR_COUNTS ((40 - HDR_SHIFT + 1) * HDR_SUB)   // up to 2^40 ns, some 18 minutes
+
+// Two-way mode: the clock offset to the reflector is taken from the probe with the lowest RTT among the last
+// OFFSET_WINDOW replies, the one least delayed by queues, which are what makes the two directions differ
+#define OFFSET_WINDOW 32
+
+struct offset_sample {
+    int64_t rtt, offset;
+};
+
+struct histogram {
+    uint64_t counts[HDR_COUNTS];
+    uint64_t total;
+    int64_t max;
+};
+
 int createSocket() {
     int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
-    if (fd < 0) {
-        fprintf(stderr, "ERROR: Socket could not be acquired\n");
-        exit(1);
-    }
+    errorHandler(fd, "Socket could not be acquired");
     return fd;
 }
 
@@ -27,10 +120,7 @@ void sendMessage(int fd, int message, in_addr_t s_addr) {
 
     // Convert package number to string
     errprint = snprintf(msg, 10, "%d", message);
-    if (errprint < 0) {
-        fprintf(stderr, "ERROR: Something went wrong with converting message to string\n");
-        exit(1);
-    }
+    errorHandler(errprint, "Something went wrong with converting message to string");
 
     dest.sin_family = AF_INET;
     dest.sin_port = htons(PORT_SERVER);
@@ -38,35 +128,98 @@ void sendMessage(int fd, int message, in_addr_t s_addr) {
 
     errsend = sendto(fd, msg, SIZE, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
 
-    if (errsend < 0) {
-        fprintf(stderr, "ERROR: Message was not sent\n");
-        exit(1);
+    errorHandler(errsend, "Message was not sent");
+}
+
+void readStamp(struct msghdr *msg, struct kstamp *stamp) {
+    struct cmsghdr *cmsg;
+    struct scm_timestamping *ts;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            ts = (struct scm_timestamping *) CMSG_DATA(cmsg);
+            stamp->sw = ts->ts[0];
+            stamp->hw = ts->ts[2];
+        }
     }
 }
 
-int recvMessage(int fd) {
-    char resmsg[64];
+// Receive a reply if there is one, with its kernel timestamp. Returns 0 when nothing was waiting
+int recvMessage(int fd, int *packetnum, struct kstamp *rx) {
+    char resmsg[65], control[256];
     int errrecv;
-    socklen_t fromlen;
     struct sockaddr_in from;
-    fromlen = sizeof(struct sockaddr_in);
+    struct iovec iov;
+    struct msghdr msg;
 
-    errrecv = recvfrom(fd, resmsg, SIZE, 0, (struct sockaddr*) &from, &fromlen);
+    iov.iov_base = resmsg;
+    iov.iov_len = SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
 
-    if (errrecv < 0) {
-        fprintf(stderr, "ERROR: Something went wrong when receiving the message\n");
-        exit(1);
+    errrecv = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (errrecv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
     }
+    errorHandler(errrecv, "Something went wrong when receiving the message");
+    resmsg[errrecv] = '\0';
+    memset(rx, 0, sizeof(struct kstamp));
+    readStamp(&msg, rx);
+
     errno = 0;
-    int packetnum = 0;
-    packetnum = strtol(resmsg, NULL, 10);
+    *packetnum = strtol(resmsg, NULL, 10);
 
     if (errno != 0) {
         fprintf(stderr, "ERROR: Something went wrong when reading the packet number");
         exit(1);
     }
 
-    return packetnum;
+    return 1;
+}
+
+// Drain the transmit timestamps from the error queue, keeping the one of the id-th datagram sent
+void recvTxStamp(int fd, uint32_t id, struct kstamp *tx) {
+    char control[256];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *err;
+    struct kstamp stamp;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+
+        memset(&stamp, 0, sizeof(stamp));
+        readStamp(&msg, &stamp);
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && err->ee_data == id) {
+                // Software and hardware stamps of one datagram may come in separate messages
+                if (stamp.sw.tv_sec || stamp.sw.tv_nsec) {
+                    tx->sw = stamp.sw;
+                }
+                if (stamp.hw.tv_sec || stamp.hw.tv_nsec) {
+                    tx->hw = stamp.hw;
+                }
+            }
+        }
+    }
+}
+
+int hasStamp(struct timespec ts) {
+    return ts.tv_sec != 0 || ts.tv_nsec != 0;
 }
 
 struct in_addr * resolveHostName(const char *name) {
@@ -85,11 +238,8 @@ struct in_addr * resolveHostName(const char *name) {
 
 struct timespec getCurrentTime() {
     struct timespec starttime;
-    int starterr = clock_gettime(CLOCK_REALTIME, &starttime);
-    if (starterr < 0) {
-        fprintf(stderr, "ERROR: Something went wrong when reading the system clock\n");
-        exit(1);
-    }
+    int starterr = clock_gettime(CLOCK_MONOTONIC, &starttime);
+    errorHandler(starterr, "Something went wrong when reading the system clock");
     return starttime;
 }
 
@@ -101,93 +251,878 @@ double calcRTT(struct timespec starttime, struct timespec endtime) {
     return ((double) sec) + ((double) ns*1E-9);
 }
 
+uint32_t probeSlot(uint32_t key, uint32_t seq) {
+    // Fibonacci hashing spreads the consecutive sequence numbers of a target over the table
+    uint64_t k = ((uint64_t) key << 32) | seq;
+    return (uint32_t) ((k * 0x9E3779B97F4A7C15ULL) >> 32) & probe_mask;
+}
+
+void addProbe(uint32_t target, uint32_t seq, struct timespec sent) {
+    uint32_t i = probeSlot(target + 1, seq);
+
+    while (probes[i].target != 0) {
+        i = (i + 1) & probe_mask;
+    }
+    probes[i].target = target + 1;
+    probes[i].seq = seq;
+    probes[i].sent = sent;
+}
+
+int findProbe(uint32_t target, uint32_t seq) {
+    uint32_t i = probeSlot(target + 1, seq);
+
+    while (probes[i].target != 0) {
+        if (probes[i].target == target + 1 && probes[i].seq == seq) {
+            return i;
+        }
+        i = (i + 1) & probe_mask;
+    }
+    return -1;
+}
+
+void removeProbe(uint32_t i) {
+    uint32_t j = i, home;
+
+    // Move the probes after the hole back into it where they may go, so no lookup stops at the hole
+    probes[i].target = 0;
+    while (1) {
+        j = (j + 1) & probe_mask;
+        if (probes[j].target == 0) {
+            return;
+        }
+        home = probeSlot(probes[j].target, probes[j].seq);
+        // The probe at j can fill the hole unless its home slot lies between the hole and j
+        if (((j - home) & probe_mask) >= ((j - i) & probe_mask)) {
+            probes[i] = probes[j];
+            probes[j].target = 0;
+            i = j;
+        }
+    }
+}
+
+// Read "host" or "host:port" per line, skipping empty lines and # comments
+int readTargets(const char *path, struct target **targetsp) {
+    FILE *file;
+    char line[256], *host, *port, *end;
+    struct target *targets = NULL, *tg;
+    struct hostent *resolv;
+    int count = 0, capacity = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Could not open target list %s\n", path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        host = line + strspn(line, " \t");
+        host[strcspn(host, " \t\r\n#")] = '\0';
+        if (host[0] == '\0') {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            targets = realloc(targets, capacity * sizeof(struct target));
+            errorHandler(targets == NULL ? -1 : 0, "Out of memory reading the target list");
+        }
+        tg = &targets[count];
+        memset(tg, 0, sizeof(struct target));
+        tg->addr.sin_family = AF_INET;
+        tg->addr.sin_port = htons(PORT_SERVER);
+
+        port = strchr(host, ':');
+        if (port != NULL) {
+            *port++ = '\0';
+            tg->addr.sin_port = htons(strtol(port, &end, 10));
+            if (*end != '\0' || tg->addr.sin_port == 0) {
+                fprintf(stderr, "Invalid port for %s, skipped\n", host);
+                continue;
+            }
+        }
+
+        // Addresses are taken as they are, only names go through DNS
+        if (inet_aton(host, &tg->addr.sin_addr) == 0) {
+            resolv = gethostbyname(host);
+            if (resolv == NULL) {
+                fprintf(stderr, "Address not found for %s, skipped\n", host);
+                continue;
+            }
+            tg->addr.sin_addr = *(struct in_addr*) resolv->h_addr_list[0];
+        }
+
+        tg->name = strdup(host);
+        errorHandler(tg->name == NULL ? -1 : 0, "Out of memory reading the target list");
+        count++;
+    }
+    fclose(file);
+
+    *targetsp = targets;
+    return count;
+}
+
+void sendProbe(int fd, struct target *targets, uint32_t t) {
+    struct target *tg = &targets[t];
+    char msg[64];
+    int i;
+
+    // The previous probe is lost if it's still unanswered when the next one is due
+    i = findProbe(t, tg->seq);
+    if (i >= 0) {
+        tg->lost++;
+        removeProbe(i);
+    }
+
+    tg->seq++;
+    tg->answered <<= 1;
+    tg->sent++;
+    memset(msg, 0, sizeof(msg));
+    snprintf(msg, sizeof(msg), "%u %u", t, tg->seq);
+
+    // Unreachable targets and a full send buffer cost one probe, not the whole sweep
+    if (sendto(fd, msg, SIZE, 0, (struct sockaddr*) &tg->addr, sizeof(struct sockaddr_in)) < 0) {
+        tg->lost++;
+        return;
+    }
+    addProbe(t, tg->seq, getCurrentTime());
+}
+
+void recvReplies(int fd, struct target *targets, uint32_t ntargets, struct sweep *sweeps) {
+    char resmsg[65];
+    int errrecv, i;
+    unsigned int t, seq;
+    double rtt;
+    socklen_t fromlen;
+    struct sockaddr_in from;
+    struct target *tg;
+
+    while (1) {
+        fromlen = sizeof(struct sockaddr_in);
+        errrecv = recvfrom(fd, resmsg, SIZE, 0, (struct sockaddr*) &from, &fromlen);
+        if (errrecv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        errorHandler(errrecv, "Something went wrong when receiving the message");
+        resmsg[errrecv] = '\0';
+
+        // Ignore anything that isn't the reply of one of our targets
+        if (sscanf(resmsg, "%u %u", &t, &seq) != 2 || t >= ntargets) {
+            continue;
+        }
+        tg = &targets[t];
+        if (from.sin_addr.s_addr != tg->addr.sin_addr.s_addr || from.sin_port != tg->addr.sin_port) {
+            continue;
+        }
+
+        // Answered already, or too late and counted as lost. Probes too old to tell are taken as late
+        i = findProbe(t, seq);
+        if (i < 0) {
+            if (seq > tg->seq || seq == 0) {
+                continue;
+            }
+            if (tg->seq - seq < 64 && (tg->answered >> (tg->seq - seq) & 1)) {
+                tg->duplicates++;
+            } else {
+                tg->late++;
+            }
+            if (tg->seq - seq < 64) {
+                tg->answered |= (uint64_t) 1 << (tg->seq - seq);
+            }
+            continue;
+        }
+        rtt = calcRTT(probes[i].sent, getCurrentTime());
+        removeProbe(i);
+        // Only the last probe of a target is ever in flight
+        tg->answered |= 1;
+
+        if (tg->received == 0 || rtt < tg->rtt_min) {
+            tg->rtt_min = rtt;
+        }
+        if (rtt > tg->rtt_max) {
+            tg->rtt_max = rtt;
+        }
+        tg->rtt_sum += rtt;
+        tg->received++;
+        sweeps[seq & 1].replies++;
+        sweeps[seq & 1].rtt_sum += rtt;
+    }
+}
+
+void printSweep(uint32_t number, struct sweep *sweep, uint32_t ntargets) {
+    int printerr;
+
+    printerr = printf("Sweep %u: %u of %u targets replied, average RTT %f seconds.\n", number, sweep->replies, ntargets,
+                      sweep->replies ? sweep->rtt_sum / sweep->replies : 0.0);
+    errorHandler(printerr, "Something went wrong when printing to stdout");
+    fflush(stdout);
+}
+
+void stopProbing(int sig) {
+    (void) sig;
+    interrupted = 1;
+}
+
+// State of the sweep mode, shared by the callbacks of its event loop
+struct sweeper {
+    int fd;
+    struct target *targets;
+    uint32_t ntargets;
+    struct sweep sweeps[2];
+    uint64_t next, total;               // probes sent, and to send in all
+    double interval, step, end;
+    struct timespec starttime;
+};
+
+void onReplies(EvLoop *loop, int fd, int events, void *arg) {
+    struct sweeper *sw = arg;
+
+    (void) loop;
+    (void) events;
+    recvReplies(fd, sw->targets, sw->ntargets, sw->sweeps);
+}
+
+// Sends the probes that are due and waits for the next tick
+// Ticks can come late, the schedule catches up on any missed ones by itself
+void onTick(EvLoop *loop, void *arg) {
+    struct sweeper *sw = arg;
+    double elapsed;
+    uint32_t t;
+    int err;
+
+    elapsed = calcRTT(sw->starttime, getCurrentTime());
+    while (sw->next < sw->total && sw->next * sw->step <= elapsed) {
+        t = sw->next % sw->ntargets;
+        if (t == 0) {
+            memset(&sw->sweeps[(sw->next / sw->ntargets + 1) & 1], 0, sizeof(struct sweep));
+        }
+        sendProbe(sw->fd, sw->targets, t);
+        sw->next++;
+
+        // Sending the last probe of a sweep expired every probe of the sweep before it
+        if (sw->next % sw->ntargets == 0 && sw->next / sw->ntargets >= 2) {
+            printSweep(sw->next / sw->ntargets - 1, &sw->sweeps[(sw->next / sw->ntargets - 1) & 1], sw->ntargets);
+        }
+    }
+
+    // After the last sweep, give its probes one interval to be answered
+    if (sw->next == sw->total) {
+        if (sw->end == 0) {
+            sw->end = elapsed + sw->interval;
+        }
+        if (elapsed >= sw->end) {
+            interrupted = 1;
+        }
+    }
+
+    if (interrupted) {
+        ev_stop(loop);
+        return;
+    }
+    err = ev_timer(loop, TICK_NS / 1E9, onTick, sw);
+    errorHandler(err, "Could not start the send timer");
+}
+
+// Probe every target of the list once per interval, for count sweeps or until interrupted when count is 0
+int sweepTargets(const char *path, double interval, uint32_t count) {
+    int fd, flags, err, printerr;
+    uint32_t ntargets, size, t, i;
+    uint64_t next;
+    struct target *targets, *tg;
+    struct sweep *sweeps;
+    struct sweeper sw;
+    EvLoop *loop;
+
+    ntargets = readTargets(path, &targets);
+    if (ntargets == 0) {
+        fprintf(stderr, "No targets to ping in %s\n", path);
+        return 1;
+    }
+
+    // Every target has at most one probe in flight, so the table never gets more than half full
+    for (size = 2; size < 2 * ntargets; size *= 2);
+    probes = calloc(size, sizeof(struct probe));
+    errorHandler(probes == NULL ? -1 : 0, "Out of memory for the probe table");
+    probe_mask = size - 1;
+
+    fd = createSocket();
+    flags = fcntl(fd, F_GETFL);
+    errorHandler(flags < 0 ? flags : fcntl(fd, F_SETFL, flags | O_NONBLOCK), "Could not make the socket non-blocking");
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &SWEEP_SOCKBUF, sizeof(SWEEP_SOCKBUF));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SWEEP_SOCKBUF, sizeof(SWEEP_SOCKBUF));
+
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+
+    signal(SIGINT, stopProbing);
+    memset(&sw, 0, sizeof(sw));
+    sw.fd = fd;
+    sw.targets = targets;
+    sw.ntargets = ntargets;
+    sw.interval = interval;
+
+    // Probe k is due k steps after the start, spreading every sweep evenly over the interval instead of sending it in one burst
+    sw.step = interval / ntargets;
+    sw.total = count ? (uint64_t) count * ntargets : UINT64_MAX;
+    sw.starttime = getCurrentTime();
+
+    // Sends are paced by a timer rather than the replies, so a silent target never holds up the others
+    err = ev_add(loop, fd, EV_READ, onReplies, &sw);
+    errorHandler(err, "Could not watch the socket");
+    err = ev_timer(loop, TICK_NS / 1E9, onTick, &sw);
+    errorHandler(err, "Could not start the send timer");
+    err = ev_run(loop);
+    errorHandler(err, "Something went wrong waiting for events");
+    ev_free(loop);
+
+    next = sw.next;
+    sweeps = sw.sweeps;
+
+    // Whatever is still in flight now is lost
+    for (i = 0; i <= probe_mask; i++) {
+        if (probes[i].target != 0) {
+            targets[probes[i].target - 1].lost++;
+        }
+    }
+    // Only the sweeps before the last complete one were printed, an interrupted sweep comes after that
+    if (next >= ntargets) {
+        printSweep(next / ntargets, &sweeps[(next / ntargets) & 1], ntargets);
+    }
+    if (next % ntargets != 0) {
+        printSweep(next / ntargets + 1, &sweeps[(next / ntargets + 1) & 1], ntargets);
+    }
+
+    for (t = 0; t < ntargets; t++) {
+        tg = &targets[t];
+        printerr = printf("%s: %u sent, %u received, %.1f%% lost, %u late, %u duplicates, RTT min/avg/max %f/%f/%f seconds.\n",
+                          tg->name, tg->sent, tg->received, tg->sent ? 100.0 * tg->lost / tg->sent : 0.0, tg->late,
+                          tg->duplicates,
+                          tg->rtt_min, tg->received ? tg->rtt_sum / tg->received : 0.0, tg->rtt_max);
+        errorHandler(printerr, "Something went wrong when printing to stdout");
+    }
+
+    return 0;
+}
+
+int64_t getMonotonicNs() {
+    struct timespec now;
+    errorHandler(clock_gettime(CLOCK_MONOTONIC, &now), "Something went wrong when reading the system clock");
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int hdrIndex(int64_t value) {
+    int bucket = 0, index;
+
+    // Values below 2*HDR_SUB are stored exactly, every power of two above that in HDR_SUB steps
+    while ((value >> bucket) >= 2 * HDR_SUB) {
+        bucket++;
+    }
+    index = (bucket + 1) * HDR_SUB + (int) (value >> bucket) - HDR_SUB;
+    return index < HDR_COUNTS ? index : HDR_COUNTS - 1;
+}
+
+// Highest value that is recorded at index
+int64_t hdrValue(int index) {
+    int bucket = index / HDR_SUB - 1;
+
+    if (bucket <= 0) {
+        return index;
+    }
+    return ((int64_t) (index % HDR_SUB + HDR_SUB + 1) << bucket) - 1;
+}
+
+void hdrRecord(struct histogram *h, int64_t value) {
+    if (value < 0) {
+        value = 0;
+    }
+    h->counts[hdrIndex(value)]++;
+    h->total++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+int64_t hdrPercentile(struct histogram *h, double percentile) {
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (h->total == 0) {
+        return 0;
+    }
+    rank = (uint64_t) (percentile / 100 * h->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i = 0; i < HDR_COUNTS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            return hdrValue(i) < h->max ? hdrValue(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+void printLoad(const char *label, struct load_stats *stats, struct histogram *h) {
+    int printerr;
+
+    printerr = printf("%s: %lu sent, %lu received, %lu lost, %lu late, %lu reordered, %lu duplicates, "
+                      "RTT p50/p99/p99.9/max %.1f/%.1f/%.1f/%.1f us.\n", label,
+                      stats->sent, stats->received, stats->lost, stats->late, stats->reordered, stats->duplicates,
+                      hdrPercentile(h, 50) / 1E3, hdrPercentile(h, 99) / 1E3, hdrPercentile(h, 99.9) / 1E3, h->max / 1E3);
+    errorHandler(printerr, "Something went wrong when printing to stdout");
+    fflush(stdout);
+}
+
+// Send rate probes per second of size bytes to host, for duration seconds or until interrupted when it's 0
+int loadTest(const char *host, double rate, int size, double duration) {
+    int fd, i, n, interval_no = 0;
+    uint64_t next = 0, expired = 0, highest = 0, window, mask, due, seq;
+    int64_t start, now, wake, report, stop, timeout_ns, rtt;
+    char *sendbufs, *recvbufs, label[32];
+    struct sockaddr_in dest;
+    struct load_slot *slots;
+    struct load_payload payload;
+    struct load_stats total, interval;
+    struct histogram *total_hist, *interval_hist;
+    struct mmsghdr sendmsgs[LOAD_BATCH], recvmsgs[LOAD_BATCH];
+    struct iovec sendiov[LOAD_BATCH], recviov[LOAD_BATCH];
+    EvLoop *loop;
+
+    // The ring covers every probe that can be waiting for its reply, plus a second of slack
+    for (window = 1024; window < rate * (LOSS_TIMEOUT + 1); window *= 2);
+    mask = window - 1;
+    slots = calloc(window, sizeof(struct load_slot));
+    sendbufs = calloc(LOAD_BATCH, size);
+    recvbufs = calloc(LOAD_BATCH, size);
+    total_hist = calloc(1, sizeof(struct histogram));
+    interval_hist = calloc(1, sizeof(struct histogram));
+    errorHandler(slots == NULL || sendbufs == NULL || recvbufs == NULL || total_hist == NULL || interval_hist == NULL ? -1 : 0,
+                 "Out of memory for the load test");
+    memset(&total, 0, sizeof(total));
+    memset(&interval, 0, sizeof(interval));
+
+    // A connected socket only hands us the replies of this server
+    fd = createSocket();
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(PORT_SERVER);
+    dest.sin_addr = *resolveHostName(host);
+    if (connect(fd, (struct sockaddr*) &dest, sizeof(struct sockaddr_in)) < 0) {
+        fprintf(stderr, "ERROR: Could not connect the socket to %s\n", host);
+        return 1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &SWEEP_SOCKBUF, sizeof(SWEEP_SOCKBUF));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SWEEP_SOCKBUF, sizeof(SWEEP_SOCKBUF));
+
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+
+    memset(sendmsgs, 0, sizeof(sendmsgs));
+    memset(recvmsgs, 0, sizeof(recvmsgs));
+    for (i = 0; i < LOAD_BATCH; i++) {
+        sendiov[i].iov_base = sendbufs + i * size;
+        sendiov[i].iov_len = size;
+        sendmsgs[i].msg_hdr.msg_iov = &sendiov[i];
+        sendmsgs[i].msg_hdr.msg_iovlen = 1;
+        recviov[i].iov_base = recvbufs + i * size;
+        recviov[i].iov_len = size;
+        recvmsgs[i].msg_hdr.msg_iov = &recviov[i];
+        recvmsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    signal(SIGINT, stopProbing);
+    timeout_ns = LOSS_TIMEOUT * 1E9;
+    start = getMonotonicNs();
+    report = start + 1000000000;
+    stop = duration > 0 ? start + (int64_t) (duration * 1E9) : INT64_MAX;
+
+    while (1) {
+        now = getMonotonicNs();
+        if (interrupted && stop > now) {
+            stop = now;
+        }
+        // Done once every probe has been answered or timed out
+        if (now >= stop && (expired == next || now >= stop + timeout_ns)) {
+            break;
+        }
+
+        // Probe k is due k/rate seconds after the start. Catch up in batches if we fell behind
+        due = now < stop ? (uint64_t) ((now - start) * rate / 1E9) + 1 : next;
+        n = 0;
+        while (next + n < due && n < LOAD_BATCH) {
+            // A probe can only reuse the slot of one that has been decided
+            if (next + n - expired >= window) {
+                break;
+            }
+            payload.seq = next + n;
+            payload.sent = now;
+            memcpy(sendbufs + n * size, &payload, sizeof(payload));
+            n++;
+        }
+        if (n > 0) {
+            n = sendmmsg(fd, sendmsgs, n, MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != ENOBUFS && errno != ECONNREFUSED) {
+                fprintf(stderr, "ERROR: Message was not sent\n");
+                return 1;
+            }
+            for (i = 0; i < n; i++) {
+                slots[(next + i) & mask].sent = now;
+                slots[(next + i) & mask].received = 0;
+            }
+            if (n > 0) {
+                next += n;
+                total.sent += n;
+                interval.sent += n;
+            }
+        }
+
+        n = recvmmsg(fd, recvmsgs, LOAD_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0 && errno != EAGAIN && errno != ECONNREFUSED) {
+            fprintf(stderr, "ERROR: Something went wrong when receiving the message\n");
+            return 1;
+        }
+        if (n > 0) {
+            now = getMonotonicNs();
+        }
+        for (i = 0; i < n; i++) {
+            // Replies are matched by the sequence number, the RTT is taken from the send time they carry
+            if (recvmsgs[i].msg_len < sizeof(payload)) {
+                continue;
+            }
+            memcpy(&payload, recvbufs + i * size, sizeof(payload));
+            seq = payload.seq;
+            if (seq >= next) {
+                continue;
+            }
+            if (seq < expired) {
+                total.late++;
+                interval.late++;
+                continue;
+            }
+            if (slots[seq & mask].received) {
+                total.duplicates++;
+                interval.duplicates++;
+                continue;
+            }
+            slots[seq & mask].received = 1;
+            total.received++;
+            interval.received++;
+            if (seq < highest) {
+                total.reordered++;
+                interval.reordered++;
+            } else {
+                highest = seq;
+            }
+            rtt = now - payload.sent;
+            hdrRecord(total_hist, rtt);
+            hdrRecord(interval_hist, rtt);
+        }
+
+        // Decide the probes that have had their time, or that must make room for new ones
+        while (expired < next && (now - slots[expired & mask].sent >= timeout_ns || next - expired >= window)) {
+            if (!slots[expired & mask].received) {
+                total.lost++;
+                interval.lost++;
+            }
+            expired++;
+        }
+
+        if (now >= report) {
+            snprintf(label, sizeof(label), "Interval %d", ++interval_no);
+            printLoad(label, &interval, interval_hist);
+            memset(&interval, 0, sizeof(interval));
+            memset(interval_hist, 0, sizeof(struct histogram));
+            report += 1000000000;
+        }
+
+        // Sleep until the next probe is due, a reply arrives or the next report is up
+        if (n == 0 && next >= due) {
+            wake = now < stop ? start + (int64_t) (next * 1E9 / rate) : now + 1000000;
+            if (wake > report) {
+                wake = report;
+            }
+            if (wake > now) {
+                errorHandler(ev_wait(loop, fd, EV_READ, (wake - now) / 1E9), "Something went wrong waiting for replies");
+            }
+        }
+    }
+
+    printLoad("Total", &total, total_hist);
+    ev_free(loop);
+    return 0;
+}
+
+uint64_t getRealtimeNs() {
+    struct timespec now;
+    errorHandler(clock_gettime(CLOCK_REALTIME, &now), "Something went wrong when reading the system clock");
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// RFC 3550 interarrival jitter: the mean deviation of the difference in transit time of consecutive packets
+void updateJitter(double *jitter, int64_t transit, int64_t last_transit) {
+    int64_t d = transit - last_transit;
+
+    if (d < 0) {
+        d = -d;
+    }
+    *jitter += ((double) d - *jitter) / 16;
+}
+
+// Send a two-way probe every interval to host, count of them or until interrupted when count is 0.
+// The reflector's receive and send times give NTP's four timestamps t1..t4 for every probe
+int twampTest(const char *host, double interval, uint32_t count) {
+    int fd, nb, printerr, received, filled = 0, i, have_last = 0;
+    uint32_t seq;
+    uint64_t t1, t2, t3, t4;
+    int64_t rtt, offset, forward, back, last_forward = 0, last_back = 0, deadline, left;
+    double jitter_forward = 0, jitter_back = 0;
+    char msg[64];
+    struct twamp_packet probe;
+    struct offset_sample window[OFFSET_WINDOW], *best;
+    struct sockaddr_in dest;
+    struct timespec wait;
+    EvLoop *loop;
+
+    fd = createSocket();
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(PORT_SERVER);
+    dest.sin_addr = *resolveHostName(host);
+    if (connect(fd, (struct sockaddr*) &dest, sizeof(struct sockaddr_in)) < 0) {
+        fprintf(stderr, "ERROR: Could not connect the socket to %s\n", host);
+        return 1;
+    }
+    signal(SIGINT, stopProbing);
+
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+
+    for (seq = 1; !interrupted && (count == 0 || seq <= count); seq++) {
+        memset(msg, 0, sizeof(msg));
+        memset(&probe, 0, sizeof(probe));
+        memcpy(probe.tag, TWAMP_TAG, sizeof(probe.tag));
+        probe.seq = htonl(seq);
+        t1 = getRealtimeNs();
+        probe.t1 = htobe64(t1);
+        memcpy(msg, &probe, sizeof(probe));
+        if (send(fd, msg, SIZE, 0) < 0 && errno != ECONNREFUSED) {
+            fprintf(stderr, "ERROR: Message was not sent\n");
+            return 1;
+        }
+
+        // Wait for the reply to this probe until the next one is due, late replies to earlier ones are skipped
+        received = 0;
+        deadline = getMonotonicNs() + (int64_t) (interval * 1E9);
+        while (!received && !interrupted && (left = deadline - getMonotonicNs()) > 0) {
+            nb = ev_wait(loop, fd, EV_READ, left / 1E9);
+            if (nb <= 0) {
+                continue;
+            }
+            nb = recv(fd, msg, SIZE, MSG_DONTWAIT);
+            t4 = getRealtimeNs();
+            if (nb < (int) sizeof(probe)) {
+                continue;
+            }
+            memcpy(&probe, msg, sizeof(probe));
+            received = memcmp(probe.tag, TWAMP_TAG, sizeof(probe.tag)) == 0 && ntohl(probe.seq) == seq && probe.t2 != 0;
+        }
+        if (interrupted) {
+            break;
+        }
+
+        if (!received) {
+            have_last = 0;
+            printerr = printf("Packet %u: lost.\n", seq);
+        } else {
+            t2 = be64toh(probe.t2);
+            t3 = be64toh(probe.t3);
+
+            // The time on the network excludes the time the probe spent in the reflector.
+            // A sample's offset is what makes both directions take equally long
+            rtt = (int64_t) (t4 - t1) - (int64_t) (t3 - t2);
+            // Samples go in by reply, not by probe, so that lost probes leave no stale slots behind
+            window[filled % OFFSET_WINDOW].rtt = rtt;
+            window[filled % OFFSET_WINDOW].offset = ((int64_t) (t2 - t1) + (int64_t) (t3 - t4)) / 2;
+            best = NULL;
+            for (i = 0; i < OFFSET_WINDOW && i <= filled; i++) {
+                if (window[i].rtt > 0 && (best == NULL || window[i].rtt < best->rtt)) {
+                    best = &window[i];
+                }
+            }
+            offset = best != NULL ? best->offset : window[filled % OFFSET_WINDOW].offset;
+            filled++;
+
+            // The offset cancels out of the jitter, which only compares transit times of the same direction
+            forward = (int64_t) (t2 - t1) - offset;
+            back = (int64_t) (t4 - t3) + offset;
+            if (have_last) {
+                updateJitter(&jitter_forward, (int64_t) (t2 - t1), last_forward);
+                updateJitter(&jitter_back, (int64_t) (t4 - t3), last_back);
+            }
+            last_forward = (int64_t) (t2 - t1);
+            last_back = (int64_t) (t4 - t3);
+            have_last = 1;
+
+            printerr = printf("Packet %u: RTT %f, forward %f, back %f, reflector %f seconds, jitter forward %f, back %f seconds, clock offset %f seconds.\n",
+                              seq, rtt / 1E9, forward / 1E9, back / 1E9, (int64_t) (t3 - t2) / 1E9,
+                              jitter_forward / 1E9, jitter_back / 1E9, offset / 1E9);
+        }
+        errorHandler(printerr, "Something went wrong when printing to stdout");
+        fflush(stdout);
+
+        // Sleep for what is left of the interval
+        while (!interrupted && (left = deadline - getMonotonicNs()) > 0) {
+            wait.tv_sec = left / 1000000000;
+            wait.tv_nsec = left % 1000000000;
+            nanosleep(&wait, NULL);
+        }
+    }
+
+    ev_free(loop);
+    return 0;
+}
+
 int main(int argc, char ** argv) {
-    // Check if there is an argument given
-    if (argc != 2) {
-        fprintf(stderr, "Usage: pingclient1 <domain-name-to-ping>\n");
+    int opt, badopt = 0, twamp = 0;
+    char *targetfile = NULL;
+    double interval = 1, rate = 0, duration = 0;
+    long sweeps = 0, size = SIZE;
+
+    while ((opt = getopt(argc, argv, "f:i:c:r:s:t:T")) != -1) {
+        switch (opt) {
+        case 'T':
+            twamp = 1;
+            break;
+        case 'f':
+            targetfile = optarg;
+            break;
+        case 'i':
+            interval = strtod(optarg, NULL);
+            break;
+        case 'c':
+            sweeps = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+        case 's':
+            size = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            duration = strtod(optarg, NULL);
+            break;
+        default:
+            badopt = 1;
+        }
+    }
+
+    // Sweep mode with a target list, load mode with a rate, two-way mode,
+    // or one probe per second to the host given as the argument
+    if (!badopt && twamp && targetfile == NULL && rate == 0 && optind == argc - 1 && interval > 0 && sweeps >= 0) {
+        return twampTest(argv[optind], interval, sweeps);
+    }
+    if (!badopt && !twamp && targetfile != NULL && rate == 0 && optind == argc && interval > 0 && sweeps >= 0) {
+        return sweepTargets(targetfile, interval, sweeps);
+    }
+    if (!badopt && !twamp && targetfile == NULL && rate > 0 && optind == argc - 1
+            && size >= (long) sizeof(struct load_payload) && size <= MAX_PAYLOAD && duration >= 0) {
+        return loadTest(argv[optind], rate, size, duration);
+    }
+    if (badopt || twamp || targetfile != NULL || rate != 0 || optind != argc - 1) {
+        fprintf(stderr, "Usage: pingclient3 <domain-name-to-ping>\n"
+                        "       pingclient3 -f <target-list> [-i <interval>] [-c <sweeps>]\n"
+                        "       pingclient3 -r <packets-per-second> [-s <payload-size>] [-t <seconds>] <domain-name-to-ping>\n"
+                        "       pingclient3 -T [-i <interval>] [-c <count>] <domain-name-to-ping>\n");
         return 1;
     }
 
-    int fd, nb, packetnumber, nsleeperrno, printerr, count = 1;
-    double rtt;
+    int fd, nb, packetnumber, nsleeperrno, printerr, received, stamped, count = 1;
+    double rtt, krtt, left;
     struct in_addr *addrp;
-    struct timeval timeout;
     struct timespec extratimeout, starttime, endtime;
-    fd_set read_set;
+    struct kstamp tx, rx;
+    EvLoop *loop;
 
     // DNS (resolving hostname)
-    addrp = resolveHostName(argv[1]);
+    addrp = resolveHostName(argv[optind]);
 
     // Create socket
     fd = createSocket();
 
-    FD_ZERO(&read_set);
+    // Ask for kernel timestamps, the RTT measured in userspace remains if the kernel can't provide them
+    stamped = setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &TIMESTAMPING, sizeof(TIMESTAMPING)) == 0;
+
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
 
     // Send a packet every second to the server
     while(1) {
-        // Set our socket to be monitored when it's ready to be read
-        FD_SET(fd, &read_set);
-        // Set our timeout to 1 second
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        // Send message with the count as the content to check for packet order, and get start time for transmission
-        sendMessage(fd, count, addrp->s_addr);
+        // Get start time for transmission before the send, like the kernel takes its timestamp during it,
+        // and send message with the count as the content to check for packet order
         starttime = getCurrentTime();
+        sendMessage(fd, count, addrp->s_addr);
+        memset(&tx, 0, sizeof(tx));
 
-        
-        // Block program until message arrives
-        nb = select(fd+1, &read_set, NULL, NULL, &timeout);
-
-        if (nb < 0) {
-            fprintf(stderr, "ERROR: Something went wrong with the timeout\n");
-            return 1;
+        // Wait for the message for 1 second at most. The transmit timestamp makes the socket readable too,
+        // so keep waiting with what is left of the timeout until the reply itself is there
+        received = 0;
+        while (!received && (left = 1 - calcRTT(starttime, getCurrentTime())) > 0) {
+            nb = ev_wait(loop, fd, EV_READ, left);
+            errorHandler(nb, "Something went wrong with the timeout");
+            if (nb == 0) {
+                break;
+            }
+            // Timestamp ids count the datagrams sent on the socket from 0
+            if (stamped) {
+                recvTxStamp(fd, count - 1, &tx);
+            }
+            received = recvMessage(fd, &packetnumber, &rx);
         }
+        endtime = getCurrentTime();
+
         // Packet did not arrive within 1 second
-        if (nb == 0) {
+        if (!received) {
             printerr = printf("Packet %u: lost.\n", count);
-            if (printerr < 0) {
-                fprintf(stderr, "ERROR: Something went wrong when printing to stdout\n");
-                return 1;
-            }
+            errorHandler(printerr, "Something went wrong when printing to stdout");
         }
         // A packet arrived
-        if (FD_ISSET(fd, &read_set)) {
-            // Get the content of the packet as an int
-            packetnumber = recvMessage(fd);
-            endtime = getCurrentTime();
+        if (received) {
             rtt = calcRTT(starttime, endtime);
 
             // If packet number is different from expected packet number
             if (packetnumber != count) {
                 printerr = printf("Packet %u: wrong counter! Received %u instead of %u.\n", count, packetnumber, count);
             }
-            // If packet number is the same as expected packet number
-            if (packetnumber == count) {
+            // If packet number is the same as expected packet number, with the kernel RTT when both timestamps are there.
+            // Hardware timestamps are only compared with hardware ones, they run on the clock of the NIC
+            else if (hasStamp(tx.hw) && hasStamp(rx.hw)) {
+                krtt = calcRTT(tx.hw, rx.hw);
+                printerr = printf("Packet %u: %f seconds (hardware %f seconds, %f seconds in the host).\n", count, rtt, krtt, rtt - krtt);
+            }
+            else if (hasStamp(tx.sw) && hasStamp(rx.sw)) {
+                krtt = calcRTT(tx.sw, rx.sw);
+                printerr = printf("Packet %u: %f seconds (kernel %f seconds, %f seconds in the host).\n", count, rtt, krtt, rtt - krtt);
+            }
+            else {
                 printerr = printf("Packet %u: %f seconds.\n", count, rtt);
             }
 
             // In case either print statements fail
-            if (printerr < 0) {
-                fprintf(stderr, "Something went wrong when printing to stdout\n");
-                return 1;
-            }
+            errorHandler(printerr, "Something went wrong when printing to stdout");
         }
         // Increment packet counter for the next message
         count++;
 
         // Sleep until the full second has passed
-        // timeout value is adjusted to how much time the program DID NOT sleep
-        // timeval struct uses microseconds instead of nanoseconds, hence *1E3
-        extratimeout.tv_sec = timeout.tv_sec;
-        extratimeout.tv_nsec = (timeout.tv_usec)* 1E3;
+        left = 1 - calcRTT(starttime, getCurrentTime());
+        if (left > 0) {
+            extratimeout.tv_sec = 0;
+            extratimeout.tv_nsec = left * 1E9;
 
-        // Use nanosleep from time.h to sleep for the remainder of the second left
-        nsleeperrno = nanosleep(&extratimeout, NULL);
-
-        if (nsleeperrno < 0) {
-            fprintf(stderr, "ERROR: Something went wrong whith nanosleep\n");
-            return 1;
+            // Use nanosleep from time.h to sleep for the remainder of the second left
+            nsleeperrno = nanosleep(&extratimeout, NULL);
+            errorHandler(nsleeperrno, "Something went wrong whith nanosleep");
         }
     }
 
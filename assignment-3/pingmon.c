@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "error.h"
+#include "evloop.h"
+#include "pingmon.h"
+
+// Latency monitor: probes every target of a list without end and publishes its loss and RTT per second in shared memory,
+// see pingmon.h. pingstat prints what it publishes
+
+static int PORT_SERVER = 1234;
+static int SIZE = 64;
+static int LOSS_TIMEOUT = 1;            // seconds a probe may take before it counts as lost
+static long TICK_NS = 1000000;          // period of the timer that paces the staggered sends
+static int MONITOR_SOCKBUF = 4*1024*1024;
+
+// Seconds with probes that may still be answered: the current one and those within LOSS_TIMEOUT before it
+#define OPEN_SECONDS 4
+
+// A second of probes to one target that isn't published yet
+struct open_bucket {
+    int64_t second;
+    uint32_t sent, received;
+    uint32_t rtt_min, rtt_max;
+    uint64_t rtt_sum;
+    uint32_t *rtts;
+};
+
+struct inflight {
+    uint32_t seq;
+    int64_t sent;                       // CLOCK_MONOTONIC ns, 0 once answered
+    int64_t second;                     // second of CLOCK_REALTIME the probe belongs to
+};
+
+struct target {
+    struct sockaddr_in addr;
+    uint32_t seq;
+    struct inflight *inflight;          // indexed by seq & inflight_mask
+    struct open_bucket open[OPEN_SECONDS];
+    struct pingmon_target *shm;
+};
+
+static uint32_t inflight_mask;
+static uint32_t rtts_per_second;        // room for the RTTs of one second, twice the probes due so catching up fits
+static volatile sig_atomic_t interrupted = 0;
+
+int createSocket() {
+    int fd;
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    errorHandler(fd, "Socket could not be acquired");
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &MONITOR_SOCKBUF, sizeof(MONITOR_SOCKBUF));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &MONITOR_SOCKBUF, sizeof(MONITOR_SOCKBUF));
+    return fd;
+}
+
+int64_t getClockNs(clockid_t clock) {
+    struct timespec now;
+    errorHandler(clock_gettime(clock, &now), "Something went wrong when reading the system clock");
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Read "host" or "host:port" per line, skipping empty lines and # comments
+int readTargets(const char *path, struct target **targetsp, char (**namesp)[PINGMON_NAMELEN]) {
+    FILE *file;
+    char line[256], *host, *port, *end;
+    char (*names)[PINGMON_NAMELEN] = NULL;
+    struct target *targets = NULL, *tg;
+    struct hostent *resolv;
+    int count = 0, capacity = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Could not open target list %s\n", path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        host = line + strspn(line, " \t");
+        host[strcspn(host, " \t\r\n#")] = '\0';
+        if (host[0] == '\0') {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            targets = realloc(targets, capacity * sizeof(struct target));
+            names = realloc(names, capacity * PINGMON_NAMELEN);
+            if (targets == NULL || names == NULL) {
+                fprintf(stderr, "ERROR: Out of memory reading the target list\n");
+                exit(1);
+            }
+        }
+        tg = &targets[count];
+        memset(tg, 0, sizeof(struct target));
+        tg->addr.sin_family = AF_INET;
+        tg->addr.sin_port = htons(PORT_SERVER);
+        snprintf(names[count], PINGMON_NAMELEN, "%s", host);
+
+        port = strchr(host, ':');
+        if (port != NULL) {
+            *port++ = '\0';
+            tg->addr.sin_port = htons(strtol(port, &end, 10));
+            if (*end != '\0' || tg->addr.sin_port == 0) {
+                fprintf(stderr, "Invalid port for %s, skipped\n", host);
+                continue;
+            }
+        }
+
+        // Addresses are taken as they are, only names go through DNS
+        if (inet_aton(host, &tg->addr.sin_addr) == 0) {
+            resolv = gethostbyname(host);
+            if (resolv == NULL) {
+                fprintf(stderr, "Address not found for %s, skipped\n", host);
+                continue;
+            }
+            tg->addr.sin_addr = *(struct in_addr*) resolv->h_addr_list[0];
+        }
+        count++;
+    }
+    fclose(file);
+
+    *targetsp = targets;
+    *namesp = names;
+    return count;
+}
+
+// Create the shared memory segment, replacing the one of a monitor that didn't get to remove it
+struct pingmon_header * createShm(const char *name, char (*names)[PINGMON_NAMELEN], uint32_t ntargets, uint32_t nbuckets,
+                                  double interval, size_t *sizep) {
+    struct pingmon_header *header;
+    uint64_t target_size;
+    size_t size;
+    uint32_t t;
+    int fd;
+
+    // Every target starts on its own cache line, so pingstat readers of one don't share lines with the writes to another
+    target_size = sizeof(struct pingmon_target) + (uint64_t) nbuckets * sizeof(struct pingmon_bucket);
+    target_size = (target_size + 63) & ~(uint64_t) 63;
+    size = PINGMON_TARGETS_OFFSET + ntargets * target_size;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not create shared memory %s\n", name);
+        exit(1);
+    }
+    if (ftruncate(fd, size) < 0) {
+        fprintf(stderr, "ERROR: Could not size shared memory %s\n", name);
+        exit(1);
+    }
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map shared memory %s\n", name);
+        exit(1);
+    }
+    close(fd);
+
+    header->ntargets = ntargets;
+    header->nbuckets = nbuckets;
+    header->pid = getpid();
+    header->heartbeat = time(NULL);
+    header->interval = interval;
+    header->target_size = target_size;
+    for (t = 0; t < ntargets; t++) {
+        memcpy(pingmonTarget(header, t)->name, names[t], PINGMON_NAMELEN);
+    }
+    // Readers wait for the magic number, which says the rest of the header is there
+    __atomic_store_n(&header->magic, PINGMON_MAGIC, __ATOMIC_RELEASE);
+
+    *sizep = size;
+    return header;
+}
+
+int compareRtt(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Write the bucket into the target's ring, bracketed by the seqlock so readers never use half of it
+void publishBucket(struct pingmon_header *header, struct target *tg, struct open_bucket *ob) {
+    struct pingmon_bucket *bucket;
+    uint64_t published;
+    uint32_t version;
+
+    published = tg->shm->published;
+    bucket = &tg->shm->buckets[published % header->nbuckets];
+    version = bucket->version;
+    __atomic_store_n(&bucket->version, version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    bucket->second = ob->second;
+    bucket->sent = ob->sent;
+    bucket->received = ob->received;
+    bucket->rtt_min = ob->rtt_min;
+    bucket->rtt_max = ob->rtt_max;
+    bucket->rtt_avg = ob->received ? ob->rtt_sum / ob->received : 0;
+    bucket->rtt_p99 = 0;
+    if (ob->received > 0) {
+        qsort(ob->rtts, ob->received, sizeof(uint32_t), compareRtt);
+        bucket->rtt_p99 = ob->rtts[(ob->received * 99 + 99) / 100 - 1];
+    }
+
+    __atomic_store_n(&bucket->version, version + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&tg->shm->published, published + 1, __ATOMIC_RELEASE);
+}
+
+void sendProbe(int fd, struct target *tg, uint32_t t, int64_t now, int64_t second) {
+    struct open_bucket *ob = &tg->open[second % OPEN_SECONDS];
+    struct inflight *probe;
+    char msg[64];
+
+    if (ob->second != second) {
+        memset(ob, 0, offsetof(struct open_bucket, rtts));
+        ob->second = second;
+    }
+
+    tg->seq++;
+    ob->sent++;
+    memset(msg, 0, sizeof(msg));
+    snprintf(msg, sizeof(msg), "%u %u", t, tg->seq);
+
+    // Unreachable targets and a full send buffer cost one probe, the slot stays empty and it counts as lost
+    probe = &tg->inflight[tg->seq & inflight_mask];
+    probe->sent = 0;
+    if (sendto(fd, msg, SIZE, 0, (struct sockaddr*) &tg->addr, sizeof(struct sockaddr_in)) < 0) {
+        return;
+    }
+    probe->seq = tg->seq;
+    probe->sent = now;
+    probe->second = second;
+}
+
+void recvReplies(int fd, struct target *targets, uint32_t ntargets) {
+    char resmsg[65];
+    int errrecv;
+    unsigned int t, seq;
+    int64_t rtt;
+    socklen_t fromlen;
+    struct sockaddr_in from;
+    struct target *tg;
+    struct inflight *probe;
+    struct open_bucket *ob;
+
+    while (1) {
+        fromlen = sizeof(struct sockaddr_in);
+        errrecv = recvfrom(fd, resmsg, SIZE, 0, (struct sockaddr*) &from, &fromlen);
+        if (errrecv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED)) {
+            return;
+        }
+        errorHandler(errrecv, "Something went wrong when receiving the message");
+        resmsg[errrecv] = '\0';
+
+        // Ignore anything that isn't the reply of one of our targets
+        if (sscanf(resmsg, "%u %u", &t, &seq) != 2 || t >= ntargets) {
+            continue;
+        }
+        tg = &targets[t];
+        if (from.sin_addr.s_addr != tg->addr.sin_addr.s_addr || from.sin_port != tg->addr.sin_port) {
+            continue;
+        }
+
+        // Duplicates find their slot answered, and replies after the timeout find their second published already
+        probe = &tg->inflight[seq & inflight_mask];
+        if (probe->seq != seq || probe->sent == 0) {
+            continue;
+        }
+        rtt = getClockNs(CLOCK_MONOTONIC) - probe->sent;
+        probe->sent = 0;
+        ob = &tg->open[probe->second % OPEN_SECONDS];
+        if (ob->second != probe->second || rtt > (int64_t) LOSS_TIMEOUT * 1000000000 || ob->received == rtts_per_second) {
+            continue;
+        }
+
+        if (ob->received == 0 || rtt < ob->rtt_min) {
+            ob->rtt_min = rtt;
+        }
+        if (rtt > ob->rtt_max) {
+            ob->rtt_max = rtt;
+        }
+        ob->rtt_sum += rtt;
+        ob->rtts[ob->received++] = rtt;
+    }
+}
+
+void stopMonitor(int sig) {
+    interrupted = 1;
+}
+
+// State of the monitor, shared by the callbacks of its event loop
+struct monitor {
+    int fd;
+    struct target *targets;
+    uint32_t ntargets;
+    struct pingmon_header *header;
+    uint64_t next;                      // probes sent
+    int64_t start, closing;             // CLOCK_MONOTONIC ns of the start, and the CLOCK_REALTIME second to publish next
+    double step;
+};
+
+void onReplies(EvLoop *loop, int fd, int events, void *arg) {
+    struct monitor *mon = arg;
+
+    recvReplies(fd, mon->targets, mon->ntargets);
+}
+
+// Publishes the seconds that are done, sends the probes that are due and waits for the next tick
+// Ticks can come late, the schedule catches up on any missed ones by itself
+void onTick(EvLoop *loop, void *arg) {
+    struct monitor *mon = arg;
+    struct target *tg;
+    int64_t now, real, second;
+    uint32_t t;
+    int err;
+
+    if (interrupted) {
+        ev_stop(loop);
+        return;
+    }
+    now = getClockNs(CLOCK_MONOTONIC);
+    real = getClockNs(CLOCK_REALTIME);
+
+    // A second is done when the last probe sent in it timed out
+    while ((mon->closing + 1 + LOSS_TIMEOUT) * 1000000000 <= real) {
+        for (t = 0; t < mon->ntargets; t++) {
+            tg = &mon->targets[t];
+            if (tg->open[mon->closing % OPEN_SECONDS].second == mon->closing) {
+                publishBucket(mon->header, tg, &tg->open[mon->closing % OPEN_SECONDS]);
+                tg->open[mon->closing % OPEN_SECONDS].second = -1;
+            }
+        }
+        __atomic_store_n(&mon->header->heartbeat, mon->closing, __ATOMIC_RELEASE);
+        mon->closing++;
+    }
+
+    second = real / 1000000000;
+    while (mon->next * mon->step <= now - mon->start) {
+        t = mon->next % mon->ntargets;
+        sendProbe(mon->fd, &mon->targets[t], t, now, second);
+        mon->next++;
+    }
+
+    err = ev_timer(loop, TICK_NS / 1E9, onTick, mon);
+    errorHandler(err, "Could not start the send timer");
+}
+
+// Probe every target of the list once per interval until stopped, publishing each second once its probes timed out
+int monitorTargets(const char *path, double interval, uint32_t nbuckets, const char *shmname, int detach) {
+    int fd, err, j;
+    uint32_t ntargets, size, t;
+    size_t shmsize;
+    char (*names)[PINGMON_NAMELEN];
+    struct target *targets, *tg;
+    struct pingmon_header *header;
+    struct monitor mon;
+    EvLoop *loop;
+
+    ntargets = readTargets(path, &targets, &names);
+    if (ntargets == 0) {
+        fprintf(stderr, "No targets to monitor in %s\n", path);
+        return 1;
+    }
+
+    // A target has a second's worth of probes in flight for every second of the timeout, and one more second being sent
+    rtts_per_second = 2 * ((uint32_t) (1 / interval) + 1);
+    for (size = 2; size < rtts_per_second * (LOSS_TIMEOUT + 2); size *= 2);
+    inflight_mask = size - 1;
+
+    header = createShm(shmname, names, ntargets, nbuckets, interval, &shmsize);
+    for (t = 0; t < ntargets; t++) {
+        tg = &targets[t];
+        tg->shm = pingmonTarget(header, t);
+        tg->inflight = calloc(size, sizeof(struct inflight));
+        errorHandler(tg->inflight == NULL ? -1 : 0, "Out of memory for the probes in flight");
+        for (j = 0; j < OPEN_SECONDS; j++) {
+            tg->open[j].second = -1;
+            tg->open[j].rtts = malloc(rtts_per_second * sizeof(uint32_t));
+            errorHandler(tg->open[j].rtts == NULL ? -1 : 0, "Out of memory for the open buckets");
+        }
+    }
+    free(names);
+
+    if (detach) {
+        errorHandler(daemon(0, 0), "Could not detach from the terminal");
+        header->pid = getpid();
+    }
+
+    fd = createSocket();
+
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+
+    signal(SIGINT, stopMonitor);
+    signal(SIGTERM, stopMonitor);
+
+    // Probe k is due k steps after the start, spreading every round evenly over the interval instead of sending it in one burst
+    memset(&mon, 0, sizeof(mon));
+    mon.fd = fd;
+    mon.targets = targets;
+    mon.ntargets = ntargets;
+    mon.header = header;
+    mon.step = interval / ntargets * 1E9;
+    mon.start = getClockNs(CLOCK_MONOTONIC);
+    mon.closing = getClockNs(CLOCK_REALTIME) / 1000000000;
+
+    // Sends are paced by a timer rather than the replies, so a silent target never holds up the others
+    err = ev_add(loop, fd, EV_READ, onReplies, &mon);
+    errorHandler(err, "Could not watch the socket");
+    err = ev_timer(loop, TICK_NS / 1E9, onTick, &mon);
+    errorHandler(err, "Could not start the send timer");
+    err = ev_run(loop);
+    errorHandler(err, "Something went wrong waiting for events");
+    ev_free(loop);
+
+    // Readers that have the segment mapped keep the last seconds, new ones find no monitor
+    shm_unlink(shmname);
+    munmap(header, shmsize);
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    int opt, badopt = 0, detach = 0;
+    char *targetfile = NULL, *shmname = PINGMON_SHM;
+    double interval = 0.1;
+    long keep = 3600;
+
+    // -f <list> of targets, probed every -i <interval> seconds, the last -k <seconds> kept in shared memory -m <name>,
+    // -d to run in the background
+    while ((opt = getopt(argc, argv, "f:i:k:m:d")) != -1) {
+        switch (opt) {
+        case 'f':
+            targetfile = optarg;
+            break;
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'k':
+            keep = atol(optarg);
+            break;
+        case 'm':
+            shmname = optarg;
+            break;
+        case 'd':
+            detach = 1;
+            break;
+        default:
+            badopt = 1;
+        }
+    }
+
+    // More than 10000 probes a second to one target would make its buckets and reply table needlessly large
+    if (badopt || targetfile == NULL || optind != argc || interval < 0.0001 || keep < 1 || shmname[0] != '/') {
+        fprintf(stderr, "Usage: pingmon -f <target-list> [-i <interval>] [-k <seconds-kept>] [-m /<shm-name>] [-d]\n");
+        return 1;
+    }
+
+    return monitorTargets(targetfile, interval, keep, shmname, detach);
+}
@@ -0,0 +1,64 @@
+// pingmon.h
+//
+// Shared memory published by pingmon and read by pingstat.
+// pingmon keeps probing its targets and writes one bucket per target and second into a ring per target,
+// readers map the segment read-only and never make a system call or take a lock to get at the data.
+
+#include <stdint.h>
+
+#define PINGMON_SHM "/pingmon"
+#define PINGMON_MAGIC 0x4e4d4750        // "PGMN"
+#define PINGMON_NAMELEN 64
+
+// Results of the probes a target was sent during one second of CLOCK_REALTIME.
+// The bucket is published once its probes were answered or timed out, RTTs are in nanoseconds and 0 when nothing came back.
+// version is a seqlock: odd while pingmon rewrites the bucket, a reader that sees it change while copying the bucket tries again
+struct pingmon_bucket {
+    uint32_t version;
+    uint32_t sent;
+    uint32_t received;
+    uint32_t rtt_min;
+    uint32_t rtt_avg;
+    uint32_t rtt_p99;
+    uint32_t rtt_max;
+    uint32_t pad;
+    int64_t second;
+};
+
+// published counts the buckets written so far, the latest is buckets[(published - 1) % nbuckets]
+struct pingmon_target {
+    char name[PINGMON_NAMELEN];
+    uint64_t published __attribute__((aligned(64)));
+    struct pingmon_bucket buckets[] __attribute__((aligned(64)));
+};
+
+// heartbeat is the last second pingmon published, readers can tell a daemon that stopped from it
+struct pingmon_header {
+    uint32_t magic;
+    uint32_t ntargets;
+    uint32_t nbuckets;
+    int32_t pid;
+    int64_t heartbeat;
+    double interval;
+    uint64_t target_size;   // bytes from one target to the next, buckets included
+};
+
+#define PINGMON_TARGETS_OFFSET 64
+
+static inline struct pingmon_target *pingmonTarget(struct pingmon_header *header, uint32_t i) {
+    return (struct pingmon_target *) ((char *) header + PINGMON_TARGETS_OFFSET + i * header->target_size);
+}
+
+// Copy bucket i of target into out, returns 0 when it was being rewritten and should be read again
+static inline int pingmonReadBucket(struct pingmon_target *target, uint32_t i, struct pingmon_bucket *out) {
+    uint32_t before, after;
+
+    before = __atomic_load_n(&target->buckets[i].version, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+        return 0;
+    }
+    *out = target->buckets[i];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&target->buckets[i].version, __ATOMIC_RELAXED);
+    return before == after;
+}
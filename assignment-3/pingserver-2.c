@@ -1,82 +1,519 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/prctl.h>
+#include "error.h"
+#include "evloop.h"
 
-int fd;
-static int size = 64;
+// Impairment proxy: datagrams from clients are forwarded to a server and its replies back to the clients,
+// with loss, delay, reordering, duplication and a rate limit applied to both directions.
+// Without a server it echoes the datagrams back to the clients instead, like pingserver does.
+// pingserver-2 dropping every other packet is Gilbert-Elliott loss with -L 1,1
 
-void createSocket() {
-    fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+static int PORT = 1234;
+static int PORT_SERVER = 1234;
 
-    if (fd < 0) {
-        fprintf(stderr, "ERROR: Socket could not be acquired");
-        exit(1);
-    }
-}
+#define MAX_DATAGRAM 65507
+#define MAX_SESSIONS 256
+#define MAX_QUEUE (1 << 20)             // packets held at most, more are dropped
+static int SESSION_TIMEOUT = 60;        // seconds without traffic before a session's upstream socket is closed
 
-// void listen() {
-//     char msg[size];
-//     int err = 0;
-//     socklen_t fromlen;
-//     struct sockaddr_in from;
+// Impairments, the same for both directions
+static double ge_p = 0, ge_r = 1;       // Gilbert-Elliott: chance to go from the good to the bad state, and back
+static double loss_good = 0, loss_bad = 1;
+static double delay = 0, jitter = 0;    // seconds, jitter is spread evenly over delay +- jitter
+static double reorder = 0;              // chance that a packet skips the delay and overtakes the ones held
+static double duplicate = 0;
+static double rate = 0;                 // bytes per second, 0 for no limit
+static double burst = 0;                // bytes the bucket holds
+static double queue_limit = 0.1;        // seconds a packet may wait for the rate limit before it's dropped
 
-//     err = recvfrom(fd, msg, size, 0, (struct sockaddr*) &from, &fromlen);
+// One direction of a session
+struct link {
+    int bad;                            // Gilbert-Elliott state
+    double tokens;                      // bytes, negative while packets wait for the rate limit
+    int64_t refilled;
+};
 
-//     if (err < 0) {
-//         fprintf(stderr, "Error: Failed to receive message from client");
-//     }
+// A client, with the socket its datagrams are forwarded to the server from
+struct session {
+    int used;
+    struct sockaddr_in client;
+    int fd;
+    int64_t last_active;
+    long queued;                        // packets held for this session, it isn't closed before they're out
+    struct link up, down;
+};
 
-//     // TODO: read message and send it back
-// }
+// Packet held until its release time
+struct packet {
+    int64_t release;
+    uint64_t order;                     // keeps packets with the same release time in arrival order
+    int session;
+    int to_server;
+    int len;
+    char data[];
+};
 
-int main(int argc, char ** argv) {
-    createSocket();
+struct counters {
+    unsigned long received, forwarded, lost, rate_dropped, duplicated, reordered;
+};
+
+static struct session sessions[MAX_SESSIONS];
+static struct packet **queue;           // binary min-heap on release time
+static long queued = 0, queue_size = 0;
+static uint64_t arrivals = 0;
+static struct counters counters;
+static struct sockaddr_in server;
+static int forwarding = 0;
+static volatile sig_atomic_t interrupted = 0;
+static int listen_fd;
+static int release_timer = -1;          // the pending release timer, <0 if nothing is held
+
+int createSocket() {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+
+    errorHandler(fd, "Socket could not be acquired");
+    return fd;
+}
+
+void bindSocket(int fd) {
     struct sockaddr_in addr;
+    int err;
 
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(1234);
+    addr.sin_port = htons(PORT);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    int err = bind(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
-    if (err < 0) {
-        fprintf(stderr, "ERROR: Could not bind socket");
+    err = bind(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
+    errorHandler(err, "Could not bind socket");
+}
+
+int64_t getMonotonicNs() {
+    struct timespec now;
+    errorHandler(clock_gettime(CLOCK_MONOTONIC, &now), "Something went wrong when reading the system clock");
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+double chance() {
+    return drand48();
+}
+
+int earlier(struct packet *a, struct packet *b) {
+    return a->release < b->release || (a->release == b->release && a->order < b->order);
+}
+
+void pushPacket(struct packet *p) {
+    long i = queued++, parent;
+
+    if (queued > queue_size) {
+        queue_size = queue_size ? queue_size * 2 : 1024;
+        queue = realloc(queue, queue_size * sizeof(struct packet *));
+        errorHandler(queue == NULL ? -1 : 0, "Out of memory for the release queue");
+    }
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!earlier(p, queue[parent])) {
+            break;
+        }
+        queue[i] = queue[parent];
+        i = parent;
+    }
+    queue[i] = p;
+}
+
+struct packet * popPacket() {
+    struct packet *top = queue[0], *last = queue[--queued];
+    long i = 0, child;
+
+    while ((child = 2 * i + 1) < queued) {
+        if (child + 1 < queued && earlier(queue[child + 1], queue[child])) {
+            child++;
+        }
+        if (!earlier(queue[child], last)) {
+            break;
+        }
+        queue[i] = queue[child];
+        i = child;
+    }
+    queue[i] = last;
+    return top;
+}
+
+// Queue a copy of the datagram to be sent at release
+void holdPacket(int s, int to_server, char *data, int len, int64_t release) {
+    struct packet *p;
+
+    if (queued >= MAX_QUEUE) {
+        counters.rate_dropped++;
+        return;
+    }
+    p = malloc(sizeof(struct packet) + len);
+    errorHandler(p == NULL ? -1 : 0, "Out of memory for held packets");
+    p->release = release;
+    p->order = arrivals++;
+    p->session = s;
+    p->to_server = to_server;
+    p->len = len;
+    memcpy(p->data, data, len);
+    sessions[s].queued++;
+    pushPacket(p);
+}
+
+// Decide what happens to a datagram crossing link, and hold what survives until it's due
+void impair(int s, struct link *link, int to_server, char *data, int len, int64_t now) {
+    int64_t wait = 0, release;
+    int copies, i;
+
+    // Gilbert-Elliott: take a step in the state machine, then lose the packet with the loss of the state it's in
+    if (link->bad) {
+        link->bad = !(chance() < ge_r);
+    } else {
+        link->bad = chance() < ge_p;
+    }
+    if (chance() < (link->bad ? loss_bad : loss_good)) {
+        counters.lost++;
+        return;
+    }
+
+    // Token bucket. Tokens may go into debt: the debt is how long the packet waits for its share of the rate
+    if (rate > 0) {
+        link->tokens += (now - link->refilled) * rate / 1E9;
+        if (link->tokens > burst) {
+            link->tokens = burst;
+        }
+        link->refilled = now;
+        if (link->tokens - len < -queue_limit * rate) {
+            counters.rate_dropped++;
+            return;
+        }
+        link->tokens -= len;
+        if (link->tokens < 0) {
+            wait = -link->tokens / rate * 1E9;
+        }
+    }
+
+    copies = chance() < duplicate ? 2 : 1;
+    counters.duplicated += copies - 1;
+    for (i = 0; i < copies; i++) {
+        release = now + wait;
+        if (reorder > 0 && chance() < reorder) {
+            counters.reordered++;
+        } else {
+            release += (int64_t) ((delay + jitter * (2 * chance() - 1)) * 1E9);
+            if (release < now + wait) {
+                release = now + wait;
+            }
+        }
+        holdPacket(s, to_server, data, len, release);
+    }
+}
+
+void onServerPackets(EvLoop *loop, int fd, int events, void *arg);
+
+int findSession(struct sockaddr_in *client, EvLoop *loop, int64_t now) {
+    int s, free_slot = -1, err;
+
+    for (s = 0; s < MAX_SESSIONS; s++) {
+        if (!sessions[s].used) {
+            if (free_slot < 0) {
+                free_slot = s;
+            }
+            continue;
+        }
+        if (sessions[s].client.sin_addr.s_addr == client->sin_addr.s_addr && sessions[s].client.sin_port == client->sin_port) {
+            return s;
+        }
+    }
+    if (free_slot < 0) {
+        return -1;
+    }
+
+    s = free_slot;
+    memset(&sessions[s], 0, sizeof(struct session));
+    sessions[s].used = 1;
+    sessions[s].client = *client;
+    sessions[s].fd = -1;
+    sessions[s].up.tokens = sessions[s].down.tokens = burst;
+    sessions[s].up.refilled = sessions[s].down.refilled = now;
+
+    // Every client gets a socket of its own towards the server, so the replies can be told apart
+    if (forwarding) {
+        sessions[s].fd = createSocket();
+        err = ev_add(loop, sessions[s].fd, EV_READ, onServerPackets, &sessions[s]);
+        errorHandler(err, "Could not watch the socket of a new session");
+    }
+    return s;
+}
+
+void expireSessions(EvLoop *loop, int64_t now) {
+    int s;
+
+    for (s = 0; s < MAX_SESSIONS; s++) {
+        if (sessions[s].used && sessions[s].queued == 0 && now - sessions[s].last_active > SESSION_TIMEOUT * 1000000000LL) {
+            if (sessions[s].fd >= 0) {
+                ev_del(loop, sessions[s].fd);
+                close(sessions[s].fd);
+            }
+            sessions[s].used = 0;
+        }
     }
+}
 
-    int alternator = 0;
+// Read every datagram waiting on fd. s is the session of an upstream socket, -1 for the client side
+void receivePackets(int fd, int s, EvLoop *loop) {
+    static char msg[MAX_DATAGRAM];
+    int errrcv;
+    int64_t now;
+    socklen_t fromlen;
+    struct sockaddr_in from;
 
     while (1) {
-        char msg[64];
-        int err = 0;
-        socklen_t fromlen;
-        struct sockaddr_in from;
         fromlen = sizeof(struct sockaddr_in);
+        errrcv = recvfrom(fd, msg, MAX_DATAGRAM, 0, (struct sockaddr*) &from, &fromlen);
+        if (errrcv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (errrcv < 0 && (errno == ECONNREFUSED || errno == EINTR)) {
+            continue;
+        }
+        errorHandler(errrcv, "Something went wrong when receiving message");
+        counters.received++;
+        now = getMonotonicNs();
 
-        err = recvfrom(fd, msg, 64, 0, (struct sockaddr*) &from, &fromlen);
-        if (err < 0) {
-            fprintf(stderr, "ERROR: Something went wrong when receiving message from client");
+        if (s >= 0) {
+            // Only the server may answer on an upstream socket
+            if (from.sin_addr.s_addr != server.sin_addr.s_addr || from.sin_port != server.sin_port) {
+                continue;
+            }
+            sessions[s].last_active = now;
+            impair(s, &sessions[s].down, 0, msg, errrcv, now);
+            continue;
         }
 
-        printf("Received %d bytes from host %s port %d: %s", err, inet_ntoa(from.sin_addr), ntohs(from.sin_port), msg);
+        s = findSession(&from, loop, now);
+        if (s < 0) {
+            fprintf(stderr, "Too many clients, dropped a packet from %s port %d\n", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+            continue;
+        }
+        sessions[s].last_active = now;
+        impair(s, &sessions[s].up, forwarding, msg, errrcv, now);
+        s = -1;
+    }
+}
 
-        if (alternator == 0) {
-            int errsend;
+// Send every held packet that's due, and return the release time of the next one or 0
+int64_t releasePackets(int listen_fd) {
+    int64_t now = getMonotonicNs();
+    struct packet *p;
+    struct session *session;
+    int errsend;
+
+    while (queued > 0 && queue[0]->release <= now) {
+        p = popPacket();
+        session = &sessions[p->session];
+        if (p->to_server) {
+            errsend = sendto(session->fd, p->data, p->len, 0, (struct sockaddr*) &server, sizeof(struct sockaddr_in));
+        } else {
+            errsend = sendto(listen_fd, p->data, p->len, 0, (struct sockaddr*) &session->client, sizeof(struct sockaddr_in));
+        }
+        // A full socket buffer loses the packet, like a full queue on a router would
+        if (errsend < 0 && errno != EAGAIN && errno != ENOBUFS && errno != ECONNREFUSED) {
+            fprintf(stderr, "ERROR: Message was not sent\n");
+            exit(1);
+        }
+        if (errsend >= 0) {
+            counters.forwarded++;
+        }
+        session->queued--;
+        free(p);
+    }
+    return queued > 0 ? queue[0]->release : 0;
+}
+
+void onRelease(EvLoop *loop, void *arg);
+
+// Held packets are released by a timer set to the first of them, not by polling
+// It is set again after every batch of arrivals, since a packet that skips the delay may now be first
+void armRelease(EvLoop *loop) {
+    int64_t now;
+
+    if (release_timer >= 0) {
+        ev_cancel(loop, release_timer);
+        release_timer = -1;
+    }
+    if (queued > 0) {
+        now = getMonotonicNs();
+        release_timer = ev_timer(loop, queue[0]->release > now ? (queue[0]->release - now) / 1E9 : 0, onRelease, NULL);
+        errorHandler(release_timer, "Could not arm the release timer");
+    }
+}
+
+void onRelease(EvLoop *loop, void *arg) {
+    release_timer = -1;
+    releasePackets(listen_fd);
+    armRelease(loop);
+}
+
+void onClientPackets(EvLoop *loop, int fd, int events, void *arg) {
+    receivePackets(fd, -1, loop);
+    releasePackets(listen_fd);
+    armRelease(loop);
+}
 
-            // TODO: Check if casting is necessary
-            errsend = sendto(fd, msg, 64, 0, (struct sockaddr*) &from, sizeof(struct sockaddr_in));
+void onServerPackets(EvLoop *loop, int fd, int events, void *arg) {
+    struct session *session = arg;
 
-            if (errsend < 0) {
-                fprintf(stderr, "ERROR: Message was not sent");
-                exit(1);
+    receivePackets(fd, session - sessions, loop);
+    releasePackets(listen_fd);
+    armRelease(loop);
+}
+
+// Once a second: close idle sessions, and stop when interrupted
+void onHousekeeping(EvLoop *loop, void *arg) {
+    int err;
+
+    if (interrupted) {
+        ev_stop(loop);
+        return;
+    }
+    expireSessions(loop, getMonotonicNs());
+    err = ev_timer(loop, 1, onHousekeeping, NULL);
+    errorHandler(err, "Could not start the session timer");
+}
+
+void stopProxy(int sig) {
+    interrupted = 1;
+}
+
+// Parse up to count comma separated numbers, returns how many there were
+int parseList(char *arg, double *values, int count) {
+    int n = 0;
+    char *end;
+
+    while (n < count) {
+        values[n++] = strtod(arg, &end);
+        if (end == arg || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "ERROR: Invalid number in %s\n", arg);
+            exit(1);
+        }
+        if (*end == '\0') {
+            break;
+        }
+        arg = end + 1;
+    }
+    return n;
+}
+
+void usage() {
+    fprintf(stderr, "Usage: pingserver-2 [-l <listen-port>] [-L <p>,<r>[,<loss-good>,<loss-bad>]] [-d <delay-ms>[,<jitter-ms>]]\n"
+                    "                    [-o <reorder-chance>] [-u <duplicate-chance>] [-b <kbit/s>[,<burst-bytes>[,<queue-ms>]]]\n"
+                    "                    [<server>[:<port>]]\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv) {
+    int n, opt, err;
+    double values[4];
+    char *port;
+    struct hostent *resolv;
+    EvLoop *loop;
+
+    while ((opt = getopt(argc, argv, "l:L:d:o:u:b:")) != -1) {
+        switch (opt) {
+        case 'l':
+            PORT = strtol(optarg, NULL, 10);
+            break;
+        case 'L':
+            n = parseList(optarg, values, 4);
+            if (n != 2 && n != 4) {
+                usage();
             }
-            alternator++;
-        } else {
-            alternator--;
+            ge_p = values[0];
+            ge_r = values[1];
+            if (n == 4) {
+                loss_good = values[2];
+                loss_bad = values[3];
+            }
+            break;
+        case 'd':
+            values[1] = 0;
+            parseList(optarg, values, 2);
+            delay = values[0] / 1E3;
+            jitter = values[1] / 1E3;
+            break;
+        case 'o':
+            reorder = strtod(optarg, NULL);
+            break;
+        case 'u':
+            duplicate = strtod(optarg, NULL);
+            break;
+        case 'b':
+            values[1] = 0;
+            values[2] = queue_limit * 1E3;
+            parseList(optarg, values, 3);
+            rate = values[0] * 1000 / 8;
+            // A bucket of at least one large datagram, so any packet can pass
+            burst = values[1] > MAX_DATAGRAM ? values[1] : MAX_DATAGRAM;
+            queue_limit = values[2] / 1E3;
+            break;
+        default:
+            usage();
         }
+    }
+    if (optind < argc - 1 || PORT <= 0 || delay < 0 || jitter < 0 || rate < 0) {
+        usage();
+    }
 
+    if (optind == argc - 1) {
+        port = strchr(argv[optind], ':');
+        if (port != NULL) {
+            *port++ = '\0';
+            PORT_SERVER = strtol(port, NULL, 10);
+        }
+        resolv = gethostbyname(argv[optind]);
+        if (resolv == NULL) {
+            fprintf(stderr, "Address not found for %s\n", argv[optind]);
+            exit(1);
+        }
+        server.sin_family = AF_INET;
+        server.sin_port = htons(PORT_SERVER);
+        server.sin_addr = *(struct in_addr*) resolv->h_addr_list[0];
+        forwarding = 1;
     }
 
+    srand48(time(NULL) ^ getpid());
+    // Default timer slack would let releases run up to 50 us late
+    prctl(PR_SET_TIMERSLACK, 1);
+    signal(SIGINT, stopProxy);
+
+    // Create socket and bind
+    listen_fd = createSocket();
+    bindSocket(listen_fd);
+
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+    err = ev_add(loop, listen_fd, EV_READ, onClientPackets, NULL);
+    errorHandler(err, "Could not watch the socket");
+    err = ev_timer(loop, 1, onHousekeeping, NULL);
+    errorHandler(err, "Could not start the session timer");
+    err = ev_run(loop);
+    errorHandler(err, "Something went wrong waiting for packets");
+    ev_free(loop);
+
+    printf("Received %lu, forwarded %lu, lost %lu, dropped by the rate limit %lu, duplicated %lu, reordered %lu packets.\n",
+           counters.received, counters.forwarded, counters.lost, counters.rate_dropped, counters.duplicated, counters.reordered);
     return 0;
-}
\ No newline at end of file
+}
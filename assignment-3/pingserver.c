@@ -1,19 +1,34 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <endian.h>
+#include "error.h"
+#include "evloop.h"
+#include "twamp.h"
 
 static int PORT = 1234;
-static int SIZE = 64;
+
+// Largest UDP payload, so every request can be echoed at its own size
+#define MAX_DATAGRAM 65507
+
+// Room for the receive timestamp that comes with every datagram
+#define CONTROL_SIZE 64
+
+// Reflector mode: every worker thread has its own socket on the port, drained and answered in batches
+#define BATCH 64
+static int REFLECT_SOCKBUF = 4*1024*1024;
 
 int createSocket() {
     int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-
-    if (fd < 0) {
-        fprintf(stderr, "ERROR: Socket could not be acquired\n");
-        exit(1);
-    }
+    errorHandler(fd, "Socket could not be acquired");
     return fd;
 }
 
@@ -26,41 +41,206 @@ void bindSocket(int fd) {
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     err = bind(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
-    if (err < 0) {
-        fprintf(stderr, "ERROR: Could not bind socket\n");
-        exit(1);
+    errorHandler(err, "Could not bind socket");
+}
+
+// Ask the kernel for the time each datagram arrived, so two-way probes aren't stamped late by the time they spent queued
+void enableTimestamps(int fd) {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+}
+
+uint64_t toNs(struct timespec ts) {
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The kernel's receive time of a datagram, or the current time when it didn't stamp it
+struct timespec receiveTime(struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return ts;
+        }
     }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts;
 }
 
-int main(int argc, char ** argv) {
-    int fd, errrcv, errsend;
-    char msg[64];
-    struct sockaddr_in addr, from;
-    socklen_t fromlen;
-    
-    // Create socket and bind
+// Fill in the reflector's times of a two-way probe, any other datagram is echoed as it is
+void stampProbe(char *msg, int len, struct timespec received) {
+    struct twamp_packet probe;
+    struct timespec now;
+
+    if (len < (int) sizeof(probe) || memcmp(msg, TWAMP_TAG, sizeof(probe.tag)) != 0) {
+        return;
+    }
+    memcpy(&probe, msg, sizeof(probe));
+    clock_gettime(CLOCK_REALTIME, &now);
+    probe.t2 = htobe64(toNs(received));
+    probe.t3 = htobe64(toNs(now));
+    memcpy(msg, &probe, sizeof(probe));
+}
+
+// A worker of the reflector mode, with its own socket and event loop
+struct reflector {
+    char *bufs;
+    char control[BATCH][CONTROL_SIZE];
+    struct sockaddr_in from[BATCH];
+    struct iovec iov[BATCH];
+    struct mmsghdr msgs[BATCH];
+};
+
+// Echo the datagrams queued on the socket of a worker in batches of up to BATCH, one recvmmsg and one sendmmsg call per batch
+// A worker that has more than a batch queued is called again on the next round of its loop
+void onBatch(EvLoop *loop, int fd, int events, void *arg) {
+    struct reflector *r = arg;
+    int n, sent, err, i;
+
+    for (i = 0; i < BATCH; i++) {
+        r->iov[i].iov_len = MAX_DATAGRAM;
+        r->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        r->msgs[i].msg_hdr.msg_control = r->control[i];
+        r->msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+    }
+
+    // Take whatever is queued without waiting
+    n = recvmmsg(fd, r->msgs, BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    errorHandler(n, "Something went wrong when receiving message from client");
+
+    // Each reply goes back to its sender, as long as its request
+    for (i = 0; i < n; i++) {
+        r->iov[i].iov_len = r->msgs[i].msg_len;
+        stampProbe(r->iov[i].iov_base, r->msgs[i].msg_len, receiveTime(&r->msgs[i].msg_hdr));
+        r->msgs[i].msg_hdr.msg_control = NULL;
+        r->msgs[i].msg_hdr.msg_controllen = 0;
+    }
+    sent = 0;
+    while (sent < n) {
+        err = sendmmsg(fd, r->msgs + sent, n - sent, 0);
+        if (err < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // A reply the kernel can't take right now is dropped, like the network would
+            if (errno == ENOBUFS || errno == EAGAIN) {
+                break;
+            }
+            errorHandler(err, "Message was not sent");
+        }
+        sent += err;
+    }
+}
+
+// Runs a worker of the reflector mode
+void * reflect(void *arg) {
+    int fd, err, i, one = 1;
+    struct reflector *r;
+    EvLoop *loop;
+
+    // The kernel spreads the clients over the sockets sharing the port by a hash of their address
     fd = createSocket();
+    err = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    errorHandler(err, "Could not share the port between workers");
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &REFLECT_SOCKBUF, sizeof(REFLECT_SOCKBUF));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &REFLECT_SOCKBUF, sizeof(REFLECT_SOCKBUF));
+    enableTimestamps(fd);
     bindSocket(fd);
 
-    // Keep receiving messages and replying back with the message received.
-    while (1) {
-        errrcv = 0;
-        fromlen = sizeof(struct sockaddr_in);
+    r = calloc(1, sizeof(struct reflector));
+    errorHandler(r == NULL ? -1 : 0, "Out of memory for the receive buffers");
+    r->bufs = malloc((size_t) BATCH * MAX_DATAGRAM);
+    errorHandler(r->bufs == NULL ? -1 : 0, "Out of memory for the receive buffers");
+    for (i = 0; i < BATCH; i++) {
+        r->iov[i].iov_base = r->bufs + (size_t) i * MAX_DATAGRAM;
+        r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+        r->msgs[i].msg_hdr.msg_iovlen = 1;
+        r->msgs[i].msg_hdr.msg_name = &r->from[i];
+    }
 
-        errrcv = recvfrom(fd, msg, SIZE, 0, (struct sockaddr*) &from, &fromlen);
-        if (errrcv < 0) {
-            fprintf(stderr, "ERROR: Something went wrong when receiving message from client");
-            exit(1);
-        }
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+    err = ev_add(loop, fd, EV_READ, onBatch, r);
+    errorHandler(err, "Could not watch the socket");
+    err = ev_run(loop);
+    errorHandler(err, "Something went wrong when waiting for requests");
+    return NULL;
+}
+
+// Echo a datagram back to its sender
+void onRequest(EvLoop *loop, int fd, int events, void *arg) {
+    int errrcv, errsend;
+    char msg[MAX_DATAGRAM], control[CONTROL_SIZE];
+    struct sockaddr_in from;
+    struct iovec iov;
+    struct msghdr hdr;
+
+    iov.iov_base = msg;
+    iov.iov_len = MAX_DATAGRAM;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &from;
+    hdr.msg_namelen = sizeof(struct sockaddr_in);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
 
-        errsend = sendto(fd, msg, SIZE, 0, (struct sockaddr*) &from, sizeof(struct sockaddr_in));
+    errrcv = recvmsg(fd, &hdr, 0);
+    errorHandler(errrcv, "Something went wrong when receiving message from client");
+    stampProbe(msg, errrcv, receiveTime(&hdr));
 
-        if (errsend < 0) {
-            fprintf(stderr, "ERROR: Message was not sent");
-            exit(1);
+    errsend = sendto(fd, msg, errrcv, 0, (struct sockaddr*) &from, sizeof(struct sockaddr_in));
+    errorHandler(errsend, "Message was not sent");
+}
+
+int main(int argc, char ** argv) {
+    int fd, err, opt, workers = -1, i;
+    EvLoop *loop;
+    pthread_t thread;
+
+    while ((opt = getopt(argc, argv, "w:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: pingserver [-w <worker-threads>]\n");
+            return 1;
         }
+    }
 
+    // Reflector mode with worker threads, one per CPU if no count is given
+    if (workers >= 0) {
+        if (workers == 0) {
+            workers = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        for (i = 1; i < workers; i++) {
+            if (pthread_create(&thread, NULL, reflect, NULL) != 0) {
+                fprintf(stderr, "ERROR: Could not start worker thread\n");
+                return 1;
+            }
+        }
+        reflect(NULL);
     }
+    
+    // Create socket and bind
+    fd = createSocket();
+    enableTimestamps(fd);
+    bindSocket(fd);
+
+    // Keep receiving messages and replying back with the message received
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+    err = ev_add(loop, fd, EV_READ, onRequest, NULL);
+    errorHandler(err, "Could not watch the socket");
+    err = ev_run(loop);
+    errorHandler(err, "Something went wrong when waiting for requests");
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,229 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "pingmon.h"
+
+// Prints what pingmon publishes in shared memory. Once the segment is mapped, reading it takes no system calls,
+// so a dashboard can poll it as often as it likes without slowing the monitor down
+
+static int STALE_SECONDS = 5;           // heartbeat age after which the monitor is reported as stopped
+
+struct summary {
+    uint64_t sent, received, rtt_sum;
+    uint32_t rtt_min, rtt_p99, rtt_max;
+    int seconds;
+};
+
+struct pingmon_header * mapShm(const char *name) {
+    struct pingmon_header *header;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: No monitor publishes in %s, is pingmon running?\n", name);
+        exit(1);
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < PINGMON_TARGETS_OFFSET) {
+        fprintf(stderr, "ERROR: Shared memory %s is not a monitor's\n", name);
+        exit(1);
+    }
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map shared memory %s\n", name);
+        exit(1);
+    }
+    close(fd);
+
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != PINGMON_MAGIC ||
+            PINGMON_TARGETS_OFFSET + header->ntargets * header->target_size > (uint64_t) st.st_size) {
+        fprintf(stderr, "ERROR: Shared memory %s is not a monitor's\n", name);
+        exit(1);
+    }
+    return header;
+}
+
+// Copy the bucket published count - 1 buckets ago, or return 0 when it was overwritten or is still being written
+int readBucket(struct pingmon_header *header, struct pingmon_target *target, uint64_t number, struct pingmon_bucket *bucket) {
+    uint64_t published;
+
+    while (1) {
+        published = __atomic_load_n(&target->published, __ATOMIC_ACQUIRE);
+        if (number >= published || published - number > header->nbuckets) {
+            return 0;
+        }
+        if (pingmonReadBucket(target, number % header->nbuckets, bucket)) {
+            return 1;
+        }
+    }
+}
+
+void printBucket(const char *name, struct pingmon_bucket *bucket) {
+    char when[32];
+    time_t second = bucket->second;
+    int printerr;
+
+    strftime(when, sizeof(when), "%H:%M:%S", localtime(&second));
+    printerr = printf("%-24s %s %6u %6u %6.1f%% %9.3f %9.3f %9.3f %9.3f\n", name, when, bucket->sent, bucket->received,
+                      bucket->sent ? 100.0 * (bucket->sent - bucket->received) / bucket->sent : 0.0,
+                      bucket->rtt_min / 1E6, bucket->rtt_avg / 1E6, bucket->rtt_p99 / 1E6, bucket->rtt_max / 1E6);
+    if (printerr < 0) {
+        fprintf(stderr, "ERROR: Something went wrong when printing to stdout\n");
+        exit(1);
+    }
+}
+
+int selected(struct pingmon_target *target, char **names, int nnames) {
+    int i;
+
+    if (nnames == 0) {
+        return 1;
+    }
+    for (i = 0; i < nnames; i++) {
+        if (strncmp(target->name, names[i], PINGMON_NAMELEN) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Sum up the last seconds of every selected target. The p99 over several seconds is the worst of their p99s
+void printSummary(struct pingmon_header *header, int seconds, char **names, int nnames) {
+    struct pingmon_target *target;
+    struct pingmon_bucket bucket;
+    struct summary sum;
+    uint64_t published, number;
+    uint32_t t;
+    int printerr;
+
+    printf("%-24s %7s %8s %8s %7s %9s %9s %9s %9s\n", "target", "seconds", "sent", "received", "loss",
+           "min ms", "avg ms", seconds > 1 ? "worst p99" : "p99 ms", "max ms");
+    for (t = 0; t < header->ntargets; t++) {
+        target = pingmonTarget(header, t);
+        if (!selected(target, names, nnames)) {
+            continue;
+        }
+
+        memset(&sum, 0, sizeof(sum));
+        published = __atomic_load_n(&target->published, __ATOMIC_ACQUIRE);
+        for (number = published; number > 0 && sum.seconds < seconds; number--) {
+            if (!readBucket(header, target, number - 1, &bucket)) {
+                break;
+            }
+            if (bucket.received > 0) {
+                if (sum.received == 0 || bucket.rtt_min < sum.rtt_min) {
+                    sum.rtt_min = bucket.rtt_min;
+                }
+                if (bucket.rtt_p99 > sum.rtt_p99) {
+                    sum.rtt_p99 = bucket.rtt_p99;
+                }
+                if (bucket.rtt_max > sum.rtt_max) {
+                    sum.rtt_max = bucket.rtt_max;
+                }
+            }
+            sum.sent += bucket.sent;
+            sum.received += bucket.received;
+            sum.rtt_sum += (uint64_t) bucket.rtt_avg * bucket.received;
+            sum.seconds++;
+        }
+
+        printerr = printf("%-24s %7d %8lu %8lu %6.1f%% %9.3f %9.3f %9.3f %9.3f\n", target->name, sum.seconds,
+                          (unsigned long) sum.sent, (unsigned long) sum.received,
+                          sum.sent ? 100.0 * (sum.sent - sum.received) / sum.sent : 0.0, sum.rtt_min / 1E6,
+                          sum.received ? (double) sum.rtt_sum / sum.received / 1E6 : 0.0, sum.rtt_p99 / 1E6, sum.rtt_max / 1E6);
+        if (printerr < 0) {
+            fprintf(stderr, "ERROR: Something went wrong when printing to stdout\n");
+            exit(1);
+        }
+    }
+}
+
+// Print every bucket of the selected targets as it's published
+void followTargets(struct pingmon_header *header, char **names, int nnames) {
+    struct pingmon_target *target;
+    struct pingmon_bucket bucket;
+    struct timespec poll;
+    uint64_t *seen, published;
+    uint32_t t;
+
+    seen = calloc(header->ntargets, sizeof(uint64_t));
+    if (seen == NULL) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(1);
+    }
+    for (t = 0; t < header->ntargets; t++) {
+        seen[t] = __atomic_load_n(&pingmonTarget(header, t)->published, __ATOMIC_ACQUIRE);
+    }
+
+    // The monitor publishes once a second, polling ten times as often shows a second soon after it's done
+    poll.tv_sec = 0;
+    poll.tv_nsec = 100000000;
+    printf("%-24s %8s %6s %6s %7s %9s %9s %9s %9s\n", "target", "time", "sent", "recv", "loss",
+           "min ms", "avg ms", "p99 ms", "max ms");
+    while (1) {
+        for (t = 0; t < header->ntargets; t++) {
+            target = pingmonTarget(header, t);
+            if (!selected(target, names, nnames)) {
+                continue;
+            }
+            published = __atomic_load_n(&target->published, __ATOMIC_ACQUIRE);
+            // A reader that fell more than a ring behind skips what was overwritten
+            if (published - seen[t] > header->nbuckets) {
+                seen[t] = published - header->nbuckets;
+            }
+            for (; seen[t] < published; seen[t]++) {
+                if (readBucket(header, target, seen[t], &bucket)) {
+                    printBucket(target->name, &bucket);
+                }
+            }
+        }
+        fflush(stdout);
+        nanosleep(&poll, NULL);
+    }
+}
+
+int main(int argc, char ** argv) {
+    int opt, badopt = 0, follow = 0, seconds = 1;
+    char *shmname = PINGMON_SHM;
+    struct pingmon_header *header;
+
+    // The last -n <seconds> of every target, or only those named, -w to print each second as it comes in instead
+    while ((opt = getopt(argc, argv, "m:n:w")) != -1) {
+        switch (opt) {
+        case 'm':
+            shmname = optarg;
+            break;
+        case 'n':
+            seconds = atoi(optarg);
+            break;
+        case 'w':
+            follow = 1;
+            break;
+        default:
+            badopt = 1;
+        }
+    }
+    if (badopt || seconds < 1 || shmname[0] != '/') {
+        fprintf(stderr, "Usage: pingstat [-m /<shm-name>] [-n <seconds> | -w] [target]...\n");
+        return 1;
+    }
+
+    header = mapShm(shmname);
+    if (__atomic_load_n(&header->heartbeat, __ATOMIC_ACQUIRE) < time(NULL) - STALE_SECONDS) {
+        fprintf(stderr, "pingmon (pid %d) has not published for more than %d seconds\n", header->pid, STALE_SECONDS);
+    }
+
+    if (follow) {
+        followTargets(header, argv + optind, argc - optind);
+    } else {
+        printSummary(header, seconds, argv + optind, argc - optind);
+    }
+    return 0;
+}
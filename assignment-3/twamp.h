@@ -0,0 +1,19 @@
+// twamp.h
+//
+// Two-way measurement probe, in the spirit of TWAMP light, shared by pingclient3 and pingserver.
+// The reflector echoes the probe like any other datagram, but fills in when it received it and when it sent the reply back,
+// so the client can tell the delay of the path towards the reflector apart from the one back.
+
+#include <stdint.h>
+
+#define TWAMP_TAG "TWMP"
+
+// Times are CLOCK_REALTIME in nanoseconds and all fields are in network byte order.
+// The probe may be padded to any size, the reflector keeps the size of the request.
+struct twamp_packet {
+    char tag[4];
+    uint32_t seq;
+    uint64_t t1;            // client sent the probe
+    uint64_t t2;            // reflector received it
+    uint64_t t3;            // reflector sent the reply
+};
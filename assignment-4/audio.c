@@ -15,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stddef.h>
 
 #define AUDIODEV	"/dev/dsp"
 #define swap_short(x)		(x)
@@ -138,5 +139,52 @@ int aud_writeinit (int sample_rate, int sample_size, int channels)
   return audio_fd;
 }
 
+int aud_wavinit (char *filename, int sample_rate, int sample_size, int channels)
+{
+  /* Creates a wave (RIFF) file and writes its header.
+   * Returns file descriptor if successful*/
+  int fd;
+  WaveHeader wh;
+
+  if (0 > (fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0644))){
+    fprintf(stderr,"unable to create the audiofile\n");
+    return -1;
+  }
+
+  memset (&wh, 0, sizeof(wh));
+  memcpy (wh.main_chunk, RIFF, sizeof(wh.main_chunk));
+  memcpy (wh.chunk_type, WAVEFMT, sizeof(wh.chunk_type));
+  /* 'WAVEfmt' is followed by the padding byte that holds the space of 'fmt ' */
+  ((char *) &wh)[offsetof(WaveHeader, sc_len) - 1] = ' ';
+  wh.length = swap_long(sizeof(wh) - 8);
+  wh.sc_len = swap_long(16);
+  wh.format = swap_short(PCM_CODE);
+  wh.chans = swap_short(channels);
+  wh.sample_fq = swap_long(sample_rate);
+  wh.byte_p_spl = swap_short((sample_size/8) * channels);
+  wh.byte_p_sec = swap_long(sample_rate * wh.byte_p_spl);
+  wh.bit_p_spl = swap_short(sample_size);
+  wh.data_chunk = swap_long(DATA);
+  wh.data_length = 0;
+
+  if (write (fd, &wh, sizeof(wh)) != sizeof(wh)) {
+    fprintf (stderr, "unable to write the WAVE header\n");
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
 
+int aud_wavfinish (int fd, unsigned int data_length)
+{
+  /* Patches the chunk lengths of a header written by aud_wavinit */
+  uint32_t length = swap_long(sizeof(WaveHeader) - 8 + data_length);
+  uint32_t dlength = swap_long(data_length);
 
+  if (pwrite (fd, &length, sizeof(length), offsetof(WaveHeader, length)) != sizeof(length) ||
+      pwrite (fd, &dlength, sizeof(dlength), offsetof(WaveHeader, data_length)) != sizeof(dlength)) {
+    fprintf (stderr, "unable to finish the WAVE header\n");
+    return -1;
+  }
+  return 0;
+}
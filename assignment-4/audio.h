@@ -34,3 +34,25 @@ int aud_readinit (char *filename, int *sample_rate, int*sample_size, int* channe
  */
 int aud_writeinit (int sample_rate, int sample_size, int channels); 
 
+/** create a WAV-file for writing
+ *
+ * this function creates (or truncates) the file pointed to by filename and writes
+ * a PCM WAV header describing the given stream. The data chunk length is left at 0
+ * until aud_wavfinish is called.
+ *
+ * @params sample_rate, sample_size, channels: see aud_readinit above
+ * @return a new file descriptor positioned at the start of the data chunk, <0 on failure
+ */
+int aud_wavinit (char *filename, int sample_rate, int sample_size, int channels);
+
+/** finish a WAV-file created by aud_wavinit
+ *
+ * fills in the RIFF and data chunk lengths now that the size of the data is known.
+ * The file descriptor is not closed.
+ *
+ * @param fd		a descriptor returned by aud_wavinit
+ * @param data_length	the number of bytes of PCM data written after the header
+ * @return 0 on success, <0 on failure
+ */
+int aud_wavfinish (int fd, unsigned int data_length);
+
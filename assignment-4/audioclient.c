@@ -4,20 +4,70 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 #include "audio.h"
-
-#define BUFSIZE 1024
-#define SIZE 64
+#include "error.h"
+#include "cache.h"
+#include "conceal.h"
+#include "evloop.h"
+#include "protocol.h"
 
 static int PORT_SERVER = 1234;
 
-// Basic errorhandler that takes error code and message
-void errorHandler(int error, char * msg) {
-    if (error < 0) {
-        fprintf(stderr, "ERROR: %s\n", msg);
-        exit(1);
-    }
-}
+// Default size limit of the track cache, in megabytes
+static long long CACHE_LIMIT_MB = 512;
+
+// Default seconds a cached track plays without asking the server whether it changed
+static long CACHE_MAX_AGE = 300;
+
+// Seconds of silence after which a stream is resumed, and after which we give up on it,
+// with and without a token to resume it with
+#define RESUME_AFTER 1
+#define RESUME_TIMEOUT 30
+#define STREAM_TIMEOUT 6
+
+// Fetching from several mirrors: packets per range requested from one mirror,
+// and how many packets may be fetched ahead of playback
+#define CHUNK 64
+#define REASM_PACKETS 2048
+#define MAX_MIRRORS 16
+
+// States of a mirror
+#define MIRROR_IDLE 0
+#define MIRROR_REQUESTED 1      // range requested, waiting for the header
+#define MIRROR_FETCHING 2
+#define MIRROR_DRAINING 3       // range complete, waiting for the FIN
+
+struct mirror {
+    struct sockaddr_in addr;
+    char * host;
+    int fd, state, chunk, dead;
+    int ready;                  // events the loop saw on fd this round
+    uint32_t first, end, next;  // range requested, and the first packet of it we don't have
+    uint32_t got, dups;         // packets of the range received, and duplicates among them
+    struct timespec requested, progress;
+    double srtt, rate, loss;    // observed round trip time, packets per second and loss rate
+    char header[sizeof(struct audio_header)];
+};
+
+// Pre-shared key for encrypted sessions, and the state of the session once the header arrived
+static uint8_t psk[CRYPTO_KEYBYTES];
+static int have_psk = 0;
+static uint8_t client_nonce[CRYPTO_NONCEBYTES];
+static CryptoSession secure;
+static CryptoSession * session = NULL;
+
+// Every wait for the server or the audio device goes through this loop
+static EvLoop * loop;
+
+// The header packet as received, so resends of it can be recognised
+static char header_packet[MAXPACKET];
+static int header_len = 0;
 
 // Takes in a name as string, and returns corresponding in_addr if address is found
 struct in_addr * resolveHostName(const char *name) {
@@ -34,6 +84,22 @@ struct in_addr * resolveHostName(const char *name) {
     return addrp;
 }
 
+// Gets a timespec of the current time
+struct timespec getCurrentTime() {
+    struct timespec now;
+    int err = clock_gettime(CLOCK_MONOTONIC, &now);
+    errorHandler(err, "Something went wrong when reading the system clock");
+    return now;
+}
+
+// Gets the time difference between two timespecs in a double
+double getTimediff(struct timespec starttime, struct timespec endtime) {
+    long sec = endtime.tv_sec - starttime.tv_sec;
+    long ns = endtime.tv_nsec - starttime.tv_nsec;
+
+    return ((double) sec) + ((double) ns*1E-9);
+}
+
 // Creates socket and returns file descriptor
 int createSocket() {
     int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -42,46 +108,119 @@ int createSocket() {
     return fd;
 }
 
+// Sends a datagram to dest, sealed when the session is encrypted
+int sendPacket(int fd, void * buf, int len, struct sockaddr_in dest) {
+    char sealed[MAXPACKET];
+
+    if (session != NULL) {
+        len = crypto_seal(session, sealed, buf, len);
+        buf = sealed;
+    }
+    return sendto(fd, buf, len, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
+}
+
 // Sends a string to a specified sockaddr_in destination through the provided socket file descriptor
 void sendString(int fd, char * msg, struct sockaddr_in dest) {
     int errsend;
 
-    errsend = sendto(fd, msg, SIZE, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
+    errsend = sendPacket(fd, msg, SIZE, dest);
     errorHandler(errsend, "Message was not sent");
 }
 
-// Receives the audio header information, and stores it in the provided pointers
-void recvAudioHeader(int fd, int * sample_rate, int * sample_size, int * channels) {
-    int header[3], nb, err;
+// Receives a datagram into buf, opened when the session is encrypted
+// The server resends the header until it sees our acknowledgement, so a resent header is acknowledged again here
+// Returns CRYPTO_FORGED for datagrams callers should ignore: resent headers and datagrams that fail authentication
+int recvPacket(int fd, void * buf, int len) {
+    char raw[MAXPACKET];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(struct sockaddr_in);
+    int n;
+
+    n = recvfrom(fd, raw, sizeof(raw), 0, (struct sockaddr*) &from, &fromlen);
+    if (n < 0) {
+        return n;
+    }
+    if (n == header_len && memcmp(raw, header_packet, n) == 0) {
+        sendString(fd, "ACK", from);
+        return CRYPTO_FORGED;
+    }
+    if (session == NULL) {
+        n = n < len ? n : len;
+        memcpy(buf, raw, n);
+        return n;
+    }
+    if (n - CRYPTO_OVERHEAD > len) {
+        return CRYPTO_FORGED;
+    }
+    return crypto_open(session, buf, raw, n);
+}
+
+// Sends a request to the server. With a pre-shared key the request is sealed behind a hello
+void sendRequest(int fd, char * request, int len, struct sockaddr_in dest) {
+    int err;
+    char packet[sizeof(struct secure_hello) + BUFSIZE + CRYPTO_TAGBYTES];
+    struct secure_hello hello;
+
+    if (!have_psk) {
+        err = sendto(fd, request, len, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
+        errorHandler(err, "Message was not sent");
+        return;
+    }
+
+    memset(&hello, 0, sizeof(hello));
+    strcpy(hello.tag, SECURE_TAG);
+    crypto_random(client_nonce, sizeof(client_nonce));
+    memcpy(hello.nonce, client_nonce, sizeof(client_nonce));
+
+    memcpy(packet, &hello, sizeof(hello));
+    aead_seal((uint8_t *) packet + sizeof(hello), (uint8_t *) packet + sizeof(hello) + len, (uint8_t *) request, len,
+            (uint8_t *) &hello, sizeof(hello), psk, hello.nonce);
+    err = sendto(fd, packet, sizeof(hello) + len + CRYPTO_TAGBYTES, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
+    errorHandler(err, "Message was not sent");
+}
+
+// Enlarges the kernel buffers of a socket, so bulk transfers are not limited by the default sizes
+void setBulkBuffers(int fd) {
+    int err, size = BULK_SOCKBUF;
+
+    err = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    errorHandler(err, "Could not set socket send buffer size");
+    err = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    errorHandler(err, "Could not set socket receive buffer size");
+}
+
+// Receives the audio header information, and stores it in the provided header
+// The caller acknowledges the header, as the reply depends on its content
+void recvAudioHeader(int fd, struct audio_header * header) {
+    int nb, err;
     struct sockaddr_in from;
-    fd_set read_set;
     socklen_t fromlen;
-    struct timeval timeout = {
-        tv_sec: 6,
-        tv_usec: 0
-    };
 
     // Wait no more than 6 seconds for the header. 
-    FD_ZERO(&read_set);
-    FD_SET(fd, &read_set);
-    nb = select(fd+1, &read_set, NULL, NULL, &timeout);
+    nb = ev_wait(loop, fd, EV_READ, 6);
     errorHandler(nb, "Something went wrong when waiting for audio header packet");
 
     if (nb == 0) {
         errorHandler(-1, "No message received from server. Maybe it's not started yet?");
     }
 
-    if (FD_ISSET(fd, &read_set)) {
-        err = recvfrom(fd, &header, 3*sizeof(int), 0, (struct sockaddr*) &from, &fromlen);
-        errorHandler(err, "Something went wrong when receiving header");
+    fromlen = sizeof(struct sockaddr_in);
+    err = recvfrom(fd, header_packet, sizeof(header_packet), 0, (struct sockaddr*) &from, &fromlen);
+    errorHandler(err, "Something went wrong when receiving header");
+    header_len = err;
 
-        // Send header acknowledgement
-        sendString(fd, "ACK", from);
+    if (!have_psk) {
+        memcpy(header, header_packet, sizeof(struct audio_header));
+        return;
     }
 
-    *sample_rate = header[0];
-    *sample_size = header[1];
-    *channels = header[2];
+    // The server's nonce comes first, then the header sealed with the session key both nonces give
+    crypto_session(&secure, psk, client_nonce, (uint8_t *) header_packet, 0);
+    err = crypto_open_seq(&secure, 0, header, header_packet + CRYPTO_NONCEBYTES, header_len - CRYPTO_NONCEBYTES);
+    if (header_len < CRYPTO_NONCEBYTES || err != sizeof(struct audio_header)) {
+        errorHandler(-1, "Audio header failed authentication. Does the server have the same key?");
+    }
+    session = &secure;
 }
 
 // Takes a string host and pointer to a sockaddr_in, and changes it with server info
@@ -103,76 +242,880 @@ void closeConnection(int aud_fd, int sock_fd) {
     errorHandler(err, "Something went wrong when closing audio device file descriptor");
 }
 
-int main(int argc, char ** argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: audioclient <hostname> <filename>\n");
-        return 1;
+// Sends a cumulative acknowledgement for a download: every packet before next has arrived
+void sendDownloadAck(int fd, uint32_t next, struct sockaddr_in dest) {
+    char msg[SIZE] = {0};
+
+    snprintf(msg, SIZE, "ACK %u", next);
+    sendString(fd, msg, dest);
+}
+
+// Acknowledges packet seq of a stream
+void sendStreamAck(int fd, uint32_t seq, struct sockaddr_in dest) {
+    char msg[SIZE] = {0};
+
+    snprintf(msg, SIZE, "ACK %u", seq);
+    sendString(fd, msg, dest);
+}
+
+// Downloads a whole audio file over UDP without realtime pacing, and stores it in the wav file outfile
+// Packets may arrive out of order, so each one is written straight to its place in the file
+void downloadAudio(int sock_fd, struct sockaddr_in server, char * outfile) {
+    int wav_fd, nb, len, err;
+    uint32_t next = 0, end;
+    unsigned int data_length = 0;
+    off_t data_offset;
+    char * received;
+    struct audio_header header;
+    struct dl_packet packet;
+
+    setBulkBuffers(sock_fd);
+    recvAudioHeader(sock_fd, &header);
+    sendString(sock_fd, "ACK", server);
+
+    wav_fd = aud_wavinit(outfile, header.sample_rate, header.sample_size, header.channels);
+    errorHandler(wav_fd, "Couldn't create output file");
+    data_offset = lseek(wav_fd, 0, SEEK_CUR);
+    errorHandler(data_offset, "Could not get offset of audio data");
+
+    received = calloc(header.packets + 1, 1);
+    if (received == NULL) {
+        errorHandler(-1, "Could not allocate download bookkeeping");
     }
 
-    // Initialise variables for main
-    int sock_fd, aud_fd, sock_p, sample_rate, sample_size, channels, nb, err;
-    struct sockaddr_in from;
-    char buffer[BUFSIZE];
-    fd_set read_set;
-    struct timeval timeout = {
-        tv_sec: 6,
-        tv_usec: 0
-    };
+    while (1) {
+        nb = ev_wait(loop, sock_fd, EV_READ, 6);
+        errorHandler(nb, "Something went wrong when waiting for the server");
+        if (nb == 0) {
+            // Every packet arrived, only the FIN got lost
+            if (next == header.packets) {
+                break;
+            }
+            errorHandler(-1, "Haven't received a packet from the server for more than 6 seconds");
+        }
 
-    // DNS (resolving hostname)
-    setServerSockaddr(&from, argv[1]);
+        len = recvPacket(sock_fd, &packet, sizeof(packet));
+        if (len == CRYPTO_FORGED) {
+            continue;
+        }
+        errorHandler(len, "Something went wrong when receiving packet from server");
 
-    // Create socket
-    sock_fd = createSocket();
+        if (next == header.packets && len == SIZE && strcmp((char *) &packet, "FIN") == 0) {
+            break;
+        }
+        if (len < (int) sizeof(uint32_t) || packet.seq >= header.packets) {
+            continue;
+        }
 
-    // Send filename to server
-    sendString(sock_fd, argv[2], from);
+        len -= sizeof(uint32_t);
+        if (!received[packet.seq]) {
+            err = pwrite(wav_fd, packet.data, len, data_offset + (off_t) packet.seq*BUFSIZE);
+            errorHandler(err, "Something went wrong writing to the output file");
+            received[packet.seq] = 1;
 
-    recvAudioHeader(sock_fd, &sample_rate, &sample_size, &channels);
+            end = packet.seq*BUFSIZE + len;
+            if (end > data_length) {
+                data_length = end;
+            }
+            while (next < header.packets && received[next]) {
+                next++;
+            }
+        }
+        sendDownloadAck(sock_fd, next, server);
+    }
+    free(received);
+
+    err = aud_wavfinish(wav_fd, data_length);
+    errorHandler(err, "Couldn't finish output file");
+    err = close(wav_fd);
+    errorHandler(err, "Something went wrong when closing output file");
+
+    err = printf("Downloaded %u bytes to %s\n", data_length, outfile);
+    errorHandler(err, "Something went wrong when printing to stdout");
+}
+
+// Downloads a whole audio file over a TCP connection to the server, and stores it in the wav file outfile
+void tcpDownloadAudio(struct sockaddr_in server, char * filename, char * outfile) {
+    int fd, wav_fd, len, err;
+    unsigned int data_length = 0;
+    char request[SIZE] = {0}, * buffer;
+    struct audio_header header;
+
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    errorHandler(fd, "TCP socket could not be acquired");
+    setBulkBuffers(fd);
+
+    err = connect(fd, (struct sockaddr*) &server, sizeof(struct sockaddr_in));
+    errorHandler(err, "Could not connect to server over TCP");
+
+    snprintf(request, SIZE, "%s%s", REQ_DOWNLOAD, filename);
+    err = send(fd, request, SIZE, 0);
+    errorHandler(err, "Could not send download request");
+
+    err = recv(fd, &header, sizeof(header), MSG_WAITALL);
+    errorHandler(err, "Something went wrong when receiving header");
+    if (err != sizeof(header)) {
+        errorHandler(-1, "Server closed the connection before sending the audio header");
+    }
+
+    wav_fd = aud_wavinit(outfile, header.sample_rate, header.sample_size, header.channels);
+    errorHandler(wav_fd, "Couldn't create output file");
+
+    buffer = malloc(BULK_SOCKBUF);
+    if (buffer == NULL) {
+        errorHandler(-1, "Could not allocate download buffer");
+    }
+    while ((len = read(fd, buffer, BULK_SOCKBUF)) > 0) {
+        err = write(wav_fd, buffer, len);
+        errorHandler(err, "Something went wrong writing to the output file");
+        data_length += len;
+    }
+    errorHandler(len, "Something went wrong when receiving audio data");
+    free(buffer);
+
+    err = aud_wavfinish(wav_fd, data_length);
+    errorHandler(err, "Couldn't finish output file");
+    err = close(wav_fd);
+    errorHandler(err, "Something went wrong when closing output file");
+    err = close(fd);
+    errorHandler(err, "Something went wrong when closing TCP connection");
+
+    err = printf("Downloaded %u bytes to %s\n", data_length, outfile);
+    errorHandler(err, "Something went wrong when printing to stdout");
+}
+
+// Returns the cache directory to use: $AUDIOCACHE, or ~/.cache/audioclient, created if needed
+// Returns NULL when there is no usable cache directory
+char * cacheDirectory(char * dir, int len) {
+    char * env;
+
+    if ((env = getenv("AUDIOCACHE")) != NULL) {
+        snprintf(dir, len, "%s", env);
+    } else if ((env = getenv("HOME")) != NULL) {
+        snprintf(dir, len, "%s/.cache", env);
+        mkdir(dir, 0755);
+        snprintf(dir, len, "%s/.cache/audioclient", env);
+    } else {
+        return NULL;
+    }
+
+    if (mkdir(dir, 0755) < 0 && access(dir, W_OK) < 0) {
+        fprintf(stderr, "WARNING: Cache directory %s is not usable, playing without cache\n", dir);
+        return NULL;
+    }
+    return dir;
+}
+
+// Plays a cached wav file from disk, without touching the network
+void playCached(char * path) {
+    int wav_fd, aud_fd, sample_rate, sample_size, channels, len, err;
+    char buffer[BUFSIZE];
+
+    wav_fd = aud_readinit(path, &sample_rate, &sample_size, &channels);
+    errorHandler(wav_fd, "Couldn't read cached audio file");
 
-    // Get audio device file descriptor
     aud_fd = aud_writeinit(sample_rate, sample_size, channels);
     errorHandler(aud_fd, "Couldn't connect to audio device\n");
 
-    FD_ZERO(&read_set);
+    while ((len = read(wav_fd, buffer, BUFSIZE)) > 0) {
+        err = write(aud_fd, buffer, len);
+        errorHandler(err, "Something went wrong writing to the audio device");
+    }
+    errorHandler(len, "Something went wrong when reading the cached audio file");
+
+    closeConnection(aud_fd, wav_fd);
+}
+
+// Plays the packets of a stream as they arrive, acknowledging each one, until the server ends the session
+// Packets the server gave up on because they would have arrived too late are concealed from the audio played before them
+// A format marker between two playlist tracks reopens the audio device with the new settings
+// Every packet is also written to cache_fd when it is not -1, adding up the bytes in data_length
+// When the server goes quiet and the header carried a token, the stream is resumed from a new socket,
+// in case our address changed. The server carries on at the first packet we still need
+// Returns 0 when the stream ended, 1 if the server went quiet for too long,
+// 2 when the stream ended but lost packets were concealed, so it must not be cached
+int playStream(int * sock_fd, struct sockaddr_in server, struct audio_header * header, int * aud_fd, int cache_fd,
+        unsigned int * data_length) {
+    int sock_p, nb, err, concealed = 0, silent = 0, wait;
+    uint32_t expected = 0;
+    char raw[sizeof(struct dl_packet)], fill[BUFSIZE];
+    struct dl_packet * packet = (struct dl_packet *) raw;
+    struct format_marker marker;
+    Concealer pcm;
+
+    err = conceal_init(&pcm, header->sample_rate, header->sample_size, header->channels);
+    errorHandler(err, "Could not set up packet loss concealment");
 
     // Listen for incoming packets, and write buffer immediately to audio file descriptor
-    do {
-        // Wait max 6 seconds to receive next packet, otherwise exit
-        timeout.tv_sec = 6;
-        timeout.tv_usec = 0;
-        FD_SET(sock_fd, &read_set);
-        nb = select(sock_fd+1, &read_set, NULL, NULL, &timeout);
-        errorHandler(nb, "Something went wrong with select function timeout");
+    while (1) {
+        // Wait for the next packet, for a second at a time when the stream can be resumed
+        wait = header->token != 0 ? RESUME_AFTER : STREAM_TIMEOUT;
+        nb = ev_wait(loop, *sock_fd, EV_READ, wait);
+        errorHandler(nb, "Something went wrong when waiting for the server");
         if (nb == 0) {
-            err = printf("Haven't received a packet from the server for more than 6 seconds.\nClosing connection\n");
-            errorHandler(err, "Something went wrong printing to screen");
-            closeConnection(aud_fd, sock_fd);
-            return 0;
+            silent += wait;
+            if (silent >= (header->token != 0 ? RESUME_TIMEOUT : STREAM_TIMEOUT)) {
+                err = printf("Haven't received a packet from the server for more than %d seconds.\nClosing connection\n", silent);
+                errorHandler(err, "Something went wrong printing to screen");
+                conceal_free(&pcm);
+                return 1;
+            }
+
+            // Ask the server to continue the stream, from a new socket the first time
+            if (silent == RESUME_AFTER) {
+                err = close(*sock_fd);
+                errorHandler(err, "Something went wrong when closing socket file descriptor");
+                *sock_fd = createSocket();
+                err = printf("Server went quiet, resuming the stream\n");
+                errorHandler(err, "Something went wrong printing to screen");
+            }
+            snprintf(raw, SIZE, "%s%llu %u", REQ_RESUME, (unsigned long long) header->token, expected);
+            sendString(*sock_fd, raw, server);
+            continue;
         }
+        silent = 0;
 
         // When we receive something, either check if it is a FIN, or send ACK back to server & play audio buffer
-        if (FD_ISSET(sock_fd, &read_set)) {
-            sock_p = read(sock_fd, buffer, BUFSIZE);
-            errorHandler(sock_p, "Something went wrong when receiving packet from server");
+        sock_p = recvPacket(*sock_fd, raw, sizeof(raw));
+        if (sock_p == CRYPTO_FORGED) {
+            continue;
+        }
+        errorHandler(sock_p, "Something went wrong when receiving packet from server");
+
+        // A FIN, or a packet without data, marks the end of the file
+        if (sock_p == SIZE && strcmp(raw, "FIN") == 0) {
+            break;
+        }
+        if (sock_p < (int) sizeof(uint32_t)) {
+            continue;
+        }
+        sendStreamAck(*sock_fd, packet->seq, server);
+        sock_p -= sizeof(uint32_t);
+
+        // Resends of packets we already played, or already concealed
+        if (packet->seq < expected) {
+            continue;
+        }
+
+        // The server gave up on the packets before this one, fill in for them
+        for (; expected < packet->seq; expected++) {
+            conceal_fill(&pcm, fill, BUFSIZE);
+            err = write(*aud_fd, fill, BUFSIZE);
+            errorHandler(err, "Something went wrong writing to the audio device");
+            concealed++;
+        }
+        expected++;
+        if (sock_p == 0) {
+            break;
+        }
 
-            if (strcmp(buffer, "FIN") == 0) {
-                err = printf("EOF\n");
+        // The next track of a playlist has a different format, reconfigure the audio device
+        if (sock_p == sizeof(marker) && strcmp(packet->data, FORMAT_TAG) == 0) {
+            memcpy(&marker, packet->data, sizeof(marker));
+            *header = marker.header;
+            err = close(*aud_fd);
+            errorHandler(err, "Something went wrong when closing audio device file descriptor");
+            *aud_fd = aud_writeinit(header->sample_rate, header->sample_size, header->channels);
+            errorHandler(*aud_fd, "Couldn't connect to audio device\n");
+            conceal_free(&pcm);
+            err = conceal_init(&pcm, header->sample_rate, header->sample_size, header->channels);
+            errorHandler(err, "Could not set up packet loss concealment");
+            continue;
+        }
+
+        // Smooth the way back from a concealed gap, and remember the audio for the next one
+        conceal_play(&pcm, packet->data, sock_p);
+
+        if (cache_fd >= 0) {
+            err = write(cache_fd, packet->data, sock_p);
+            errorHandler(err, "Something went wrong writing to the cache");
+            *data_length += sock_p;
+        }
+
+        // Tracks of a playlist follow each other within a packet, so only play what arrived
+        err = write(*aud_fd, packet->data, sock_p);
+        errorHandler(err, "Something went wrong writing to the audio device");
+    }
+
+    err = printf("EOF\n");
+    errorHandler(err, "Something went wrong when printing to stdout");
+    conceal_free(&pcm);
+    if (concealed > 0) {
+        err = printf("Concealed %d packets that arrived too late\n", concealed);
+        errorHandler(err, "Something went wrong when printing to stdout");
+        return 2;
+    }
+    return 0;
+}
+
+// Connects to the local transport of a server on this host, if the server address is a loopback one
+// Returns the connected Unix socket, or -1 to use the network
+int connectLocal(struct sockaddr_in server) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if ((ntohl(server.sin_addr.s_addr) >> 24) != 127) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, LOCAL_SOCKET, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Receives the audio header of a local stream, and maps the ring that comes with it
+// data_fd is signalled by the server when it filled a slot, space_fd by us when we freed one
+struct local_ring * recvLocalHeader(int conn, struct audio_header * header, int * data_fd, int * space_fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr * cmsg;
+    struct local_ring * ring;
+    int fds[3], len;
+    union {
+        char buf[CMSG_SPACE(3*sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = header;
+    iov.iov_len = sizeof(struct audio_header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    // A server that is stuck or overloaded is given up on like one on the network
+    len = ev_wait(loop, conn, EV_READ, STREAM_TIMEOUT);
+    errorHandler(len, "Something went wrong when waiting for the local audio header");
+    if (len == 0) {
+        errorHandler(-1, "The server did not answer the local request");
+    }
+    len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    errorHandler(len, "Something went wrong when receiving the local audio header");
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (len != sizeof(struct audio_header) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(3*sizeof(int))) {
+        errorHandler(-1, "The server could not stream this file");
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    ring = mmap(NULL, sizeof(struct local_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (ring == MAP_FAILED) {
+        errorHandler(-1, "Could not map the ring of the local stream");
+    }
+    close(fds[0]);
+    *data_fd = fds[1];
+    *space_fd = fds[2];
+    return ring;
+}
+
+// Plays a local stream from its shared memory ring, see struct local_ring
+// Writing to the audio device blocks at the playback rate, and that is what paces the server: it refills the slots we free
+// Every packet is also written to cache_fd when it is not -1, adding up the bytes in data_length
+// Returns 0 when the stream ended, 1 if the server stopped filling the ring for more than 6 seconds
+int playLocal(struct local_ring * ring, int data_fd, int space_fd, int aud_fd, int cache_fd, unsigned int * data_length) {
+    uint32_t tail;
+    uint64_t count = 1;
+    int len, nb, err;
+
+    while (1) {
+        tail = ring->tail;
+
+        // The ring is empty: sleep until the server fills a slot, checking the head once more after raising our flag
+        if (tail == __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&ring->client_waiting, 1, __ATOMIC_SEQ_CST);
+            if (tail == __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+                nb = ev_wait(loop, data_fd, EV_READ, STREAM_TIMEOUT);
+                errorHandler(nb, "Something went wrong when waiting for the local server");
+                if (nb == 0) {
+                    err = printf("Haven't received a packet from the server for more than %d seconds.\nClosing connection\n", STREAM_TIMEOUT);
+                    errorHandler(err, "Something went wrong printing to screen");
+                    return 1;
+                }
+                err = read(data_fd, &count, sizeof(count));
+                count = 1;
+            }
+            __atomic_store_n(&ring->client_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        // The audio goes straight from the ring to the audio device
+        len = ring->slots[tail % LOCAL_SLOTS].len;
+        if (len == 0) {
+            err = printf("EOF\n");
+            errorHandler(err, "Something went wrong when printing to stdout");
+            return 0;
+        }
+        if (cache_fd >= 0) {
+            err = write(cache_fd, ring->slots[tail % LOCAL_SLOTS].data, len);
+            errorHandler(err, "Something went wrong writing to the cache");
+            *data_length += len;
+        }
+        err = write(aud_fd, ring->slots[tail % LOCAL_SLOTS].data, len);
+        errorHandler(err, "Something went wrong writing to the audio device");
+
+        // A server waiting for room is woken once half of the ring is free, not for every slot
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->server_waiting, __ATOMIC_SEQ_CST) &&
+                __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) - (tail + 1) <= LOCAL_SLOTS/2) {
+            err = write(space_fd, &count, sizeof(count));
+        }
+    }
+}
+
+// Expected time for a mirror to deliver a chunk, lower is better. Mirrors we know nothing about yet go first
+double mirrorScore(struct mirror * m) {
+    if (m->rate == 0) {
+        return 0;
+    }
+    return (m->srtt + CHUNK/m->rate) * (1 + 4*m->loss);
+}
+
+// Asks a mirror for packets [first, end) of chunk
+void requestRange(struct mirror * m, char * filename, int chunk, uint32_t first, uint32_t end) {
+    char request[BUFSIZE] = {0};
+
+    snprintf(request, BUFSIZE, "%s%u %u %s", REQ_RANGE, first, end - first, filename);
+    sendRequest(m->fd, request, strlen(request) + 1, m->addr);
+    m->state = MIRROR_REQUESTED;
+    m->chunk = chunk;
+    m->first = m->next = first;
+    m->end = end;
+    m->got = m->dups = 0;
+    m->requested = m->progress = getCurrentTime();
+}
+
+// Tells a mirror to give up on its range
+void stopMirror(struct mirror * m) {
+    sendString(m->fd, "STOP", m->addr);
+    m->state = MIRROR_IDLE;
+    m->chunk = -1;
+}
+
+// Loop callback of playStriped, notes the events on a mirror socket or the audio device for the round
+void markReady(EvLoop * loop, int fd, int events, void * arg) {
+    *(int *) arg |= events;
+}
+
+// Plays a file fetched from several mirrors at once (hosts separated by commas)
+// The file is split in chunks of CHUNK packets, and every idle mirror is asked for the earliest chunk nobody fetches yet,
+// best scoring mirrors first. Their packets all go into one reassembly buffer, which is played in order
+// A mirror that makes no progress for a few round trips is told to stop, penalised, and its chunk goes to another one
+// Playback gives up when no mirror delivered a packet for STREAM_TIMEOUT seconds
+void playStriped(char * hosts, char * filename) {
+    struct mirror mirrors[MAX_MIRRORS], * m, * best;
+    int count = 0, aud_fd = -1, aud_ready = 0, nchunks = 0, started = 0, i, c, len, nb, err, * owner = NULL, * lens;
+    char * host, * saveptr, * have = NULL, * slots, raw[MAXPACKET];
+    uint32_t play = 0, packets = 0, first, end, seq;
+    struct audio_header header;
+    struct dl_packet * packet = (struct dl_packet *) raw;
+    struct timespec now, delivered;
+    double sample;
+
+    for (host = strtok_r(hosts, ",", &saveptr); host != NULL && count < MAX_MIRRORS; host = strtok_r(NULL, ",", &saveptr)) {
+        m = &mirrors[count++];
+        memset(m, 0, sizeof(struct mirror));
+        m->host = host;
+        setServerSockaddr(&m->addr, host);
+        m->fd = createSocket();
+        setBulkBuffers(m->fd);
+        m->chunk = -1;
+        err = ev_add(loop, m->fd, EV_READ, markReady, &m->ready);
+        errorHandler(err, "Could not watch mirror socket");
+    }
+
+    slots = malloc((size_t) REASM_PACKETS*BUFSIZE);
+    lens = calloc(REASM_PACKETS, sizeof(int));
+    if (slots == NULL || lens == NULL) {
+        errorHandler(-1, "Could not allocate reassembly buffer");
+    }
+
+    // Every mirror is asked for the first chunk, the fastest one to answer decides when playback starts
+    for (i = 0; i < count; i++) {
+        requestRange(&mirrors[i], filename, 0, 0, CHUNK);
+    }
+    delivered = getCurrentTime();
+
+    // started once the first header is in, packets may then well be 0 for an empty track
+    while (!started || play < packets) {
+        now = getCurrentTime();
+
+        // Stalled mirrors give up their chunk
+        for (i = 0; i < count; i++) {
+            m = &mirrors[i];
+            if (m->state == MIRROR_IDLE || getTimediff(m->progress, now) < 0.25 + 4*m->srtt) {
+                continue;
+            }
+            if (m->state != MIRROR_DRAINING) {
+                err = printf("Mirror %s stalled, moving its chunk elsewhere\n", m->host);
                 errorHandler(err, "Something went wrong when printing to stdout");
-                closeConnection(aud_fd, sock_fd);
-                return 0;
+                m->loss = m->loss*0.5 + 0.5;
+                m->srtt = m->srtt*2 > 0.05 ? m->srtt*2 : 0.05;
+                if (owner != NULL && m->chunk >= 0 && owner[m->chunk] == i) {
+                    owner[m->chunk] = -1;
+                }
+            }
+            stopMirror(m);
+        }
+        if (!started) {
+            for (i = 0; i < count && mirrors[i].state == MIRROR_IDLE; i++);
+            if (i == count) {
+                errorHandler(-1, "None of the mirrors answered");
             }
+        }
 
-            sendString(sock_fd, "ACK", from);
+        // Every mirror stalled or went away: stop asking them again. Playing from a full window counts as progress
+        if (getTimediff(delivered, now) > STREAM_TIMEOUT) {
+            err = printf("Haven't received a packet from any mirror for more than %d seconds.\n", STREAM_TIMEOUT);
+            errorHandler(err, "Something went wrong when printing to stdout");
+            errorHandler(-1, "None of the mirrors could deliver the rest of the file");
+        }
 
-            err = write(aud_fd, buffer, BUFSIZE);
+        // Hand out chunks within the reassembly window to idle mirrors, best first
+        while (started) {
+            best = NULL;
+            for (i = 0; i < count; i++) {
+                m = &mirrors[i];
+                if (m->state == MIRROR_IDLE && !m->dead && (best == NULL || mirrorScore(m) < mirrorScore(best))) {
+                    best = m;
+                }
+            }
+            for (c = play/CHUNK; c < nchunks && owner[c] != -1; c++);
+            if (best == NULL || c == nchunks || (c + 1)*CHUNK > play + REASM_PACKETS) {
+                break;
+            }
+            end = (c + 1)*CHUNK < packets ? (c + 1)*CHUNK : packets;
+            for (first = c*CHUNK; first < end && have[first]; first++);
+            requestRange(best, filename, c, first, end);
+            owner[c] = best - mirrors;
+        }
+
+        // The audio device is only watched while the next packet is there to be played
+        for (i = 0; i < count; i++) {
+            mirrors[i].ready = 0;
+        }
+        aud_ready = 0;
+        if (aud_fd >= 0 && have[play]) {
+            err = ev_add(loop, aud_fd, EV_WRITE, markReady, &aud_ready);
+            errorHandler(err, "Could not watch audio device");
+        }
+        nb = ev_run_once(loop, 0.02);
+        errorHandler(nb, "Something went wrong when waiting for mirrors");
+        if (aud_fd >= 0 && have[play]) {
+            ev_del(loop, aud_fd);
+        }
+        now = getCurrentTime();
+
+        // Play the next packet once it is there
+        if (aud_ready) {
+            err = write(aud_fd, slots + (size_t) (play % REASM_PACKETS)*BUFSIZE, lens[play % REASM_PACKETS]);
             errorHandler(err, "Something went wrong writing to the audio device");
+            play++;
+            delivered = now;
+        }
+
+        for (i = 0; i < count; i++) {
+            m = &mirrors[i];
+            if (!m->ready) {
+                continue;
+            }
+            while ((len = recv(m->fd, raw, sizeof(raw), MSG_DONTWAIT)) >= 0) {
+                // The header of the file, in answer to a range request
+                if (m->state == MIRROR_REQUESTED && len == sizeof(struct audio_header)) {
+                    memcpy(m->header, raw, len);
+                    if (!started) {
+                        started = 1;
+                        delivered = now;
+                        memcpy(&header, raw, len);
+                        packets = header.packets;
+                        nchunks = (packets + CHUNK - 1)/CHUNK;
+                        have = calloc(packets + 1, 1);
+                        owner = malloc((nchunks + 1)*sizeof(int));
+                        if (have == NULL || owner == NULL) {
+                            errorHandler(-1, "Could not allocate download bookkeeping");
+                        }
+                        for (c = 0; c < nchunks; c++) {
+                            owner[c] = -1;
+                        }
+                        owner[0] = i;
+                        aud_fd = aud_writeinit(header.sample_rate, header.sample_size, header.channels);
+                        errorHandler(aud_fd, "Couldn't connect to audio device\n");
+
+                        // Nothing to fetch
+                        if (packets == 0) {
+                            break;
+                        }
+                    } else if (memcmp(raw, &header, len) != 0) {
+                        // A mirror with another version of the file is no use
+                        err = printf("Mirror %s has a different version of %s, not using it\n", m->host, filename);
+                        errorHandler(err, "Something went wrong when printing to stdout");
+                        m->dead = 1;
+                        if (m->chunk >= 0 && owner[m->chunk] == i) {
+                            owner[m->chunk] = -1;
+                        }
+                        stopMirror(m);
+                        continue;
+                    }
+                    sendString(m->fd, "ACK", m->addr);
+                    sample = getTimediff(m->requested, now);
+                    m->srtt = m->srtt == 0 ? sample : 0.875*m->srtt + 0.125*sample;
+                    m->state = MIRROR_FETCHING;
+                    m->progress = now;
+                    continue;
+                }
+                if (len == sizeof(struct audio_header) && memcmp(raw, m->header, len) == 0) {
+                    sendString(m->fd, "ACK", m->addr);
+                    continue;
+                }
+                if (len == SIZE && memcmp(raw, "FIN", 4) == 0) {
+                    if (m->state == MIRROR_DRAINING) {
+                        m->state = MIRROR_IDLE;
+                        m->chunk = -1;
+                    }
+                    continue;
+                }
+                if (len < (int) sizeof(uint32_t)) {
+                    continue;
+                }
+
+                // Audio data. Anything outside the range we asked for is a leftover of a stopped transfer
+                seq = packet->seq;
+                if (m->state == MIRROR_IDLE || seq < m->first || seq >= m->end) {
+                    if (m->state == MIRROR_IDLE) {
+                        stopMirror(m);
+                    }
+                    continue;
+                }
+                len -= sizeof(uint32_t);
+                if (!have[seq]) {
+                    memcpy(slots + (size_t) (seq % REASM_PACKETS)*BUFSIZE, packet->data, len);
+                    lens[seq % REASM_PACKETS] = len;
+                    have[seq] = 1;
+                    m->got++;
+                    delivered = now;
+                } else {
+                    m->dups++;
+                }
+                while (m->next < m->end && have[m->next]) {
+                    m->next++;
+                }
+                sendDownloadAck(m->fd, m->next, m->addr);
+                m->progress = now;
+
+                if (m->state == MIRROR_FETCHING && m->next == m->end) {
+                    // Range complete: learn from it, and stop whoever else was fetching the same chunk
+                    sample = (m->end - m->first)/getTimediff(m->requested, now);
+                    m->rate = m->rate == 0 ? sample : 0.7*m->rate + 0.3*sample;
+                    m->loss = 0.7*m->loss + 0.3*((double) m->dups/(m->got + m->dups + 1));
+                    owner[m->chunk] = -2;
+                    for (c = 0; c < count; c++) {
+                        if (c != i && mirrors[c].chunk == m->chunk && mirrors[c].state != MIRROR_DRAINING &&
+                                mirrors[c].state != MIRROR_IDLE) {
+                            stopMirror(&mirrors[c]);
+                        }
+                    }
+                    m->state = MIRROR_DRAINING;
+                }
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                errorHandler(len, "Something went wrong when receiving packet from mirror");
+            }
+        }
+    }
+
+    err = printf("EOF\n");
+    errorHandler(err, "Something went wrong when printing to stdout");
+    for (i = 0; i < count; i++) {
+        if (mirrors[i].state == MIRROR_REQUESTED || mirrors[i].state == MIRROR_FETCHING) {
+            stopMirror(&mirrors[i]);
+        }
+        ev_del(loop, mirrors[i].fd);
+        close(mirrors[i].fd);
+    }
+    close(aud_fd);
+    free(slots);
+    free(lens);
+    free(have);
+    free(owner);
+}
+
+int main(int argc, char ** argv) {
+    // Initialise variables for main
+    int sock_fd, aud_fd, err, opt, i, len, use_tcp = 0, striped, cache_fd = -1, local_fd = -1, data_fd = -1, space_fd = -1;
+    unsigned int data_length = 0;
+    long long cache_limit = CACHE_LIMIT_MB;
+    long max_age = CACHE_MAX_AGE;
+    char * outfile = NULL, * cache_dir = NULL, request[BUFSIZE] = {0}, dir[2048], path[4096], alias[4096];
+    struct sockaddr_in from;
+    struct audio_header header;
+    struct local_ring * ring = NULL;
+
+    // -d <outfile> downloads the file as fast as possible instead of playing it, -t does so over TCP
+    // -C <megabytes> limits the size of the track cache, 0 disables it
+    // -A <seconds> plays a cached track that long after the server last confirmed it, 0 always asks the server
+    // -k <keyfile> encrypts the session with a key shared with the server
+    while ((opt = getopt(argc, argv, "d:tC:A:k:")) != -1) {
+        switch (opt) {
+            case 'k':
+                errorHandler(crypto_loadkey(optarg, psk), "Could not load pre-shared key");
+                have_psk = 1;
+                break;
+            case 'C':
+                cache_limit = atoll(optarg);
+                break;
+            case 'A':
+                max_age = atol(optarg);
+                break;
+            case 'd':
+                outfile = optarg;
+                break;
+            case 't':
+                use_tcp = 1;
+                break;
+            default:
+                argc = 0;
         }
+    }
+    striped = argc - optind >= 2 && strchr(argv[optind], ',') != NULL;
+    if (argc - optind < 2 || (outfile != NULL && argc - optind != 2) || (use_tcp && (outfile == NULL || have_psk)) ||
+            (striped && (argc - optind != 2 || outfile != NULL || have_psk))) {
+        fprintf(stderr, "Usage: audioclient [-k <keyfile>] [-C <cache-megabytes>] [-A <cache-max-age>] <hostname> <filename>...\n");
+        fprintf(stderr, "       audioclient <hostname>,<mirror>... <filename>\n");
+        fprintf(stderr, "       audioclient [-k <keyfile>] -d <outfile> <hostname> <filename>\n");
+        fprintf(stderr, "       audioclient -d <outfile> -t <hostname> <filename>\n");
+        return 1;
+    }
+    // EVLOOP in the environment picks the backend, as for the server
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+
+    // Several mirrors: fetch the file from all of them at once
+    if (striped) {
+        playStriped(argv[optind], argv[optind+1]);
+        return 0;
+    }
 
-    } while(sock_p > 0);
+    // Single tracks are cached. Playlists are not, the header only describes their first track
+    if (argc - optind == 2 && outfile == NULL && cache_limit > 0) {
+        cache_dir = cacheDirectory(dir, sizeof(dir));
+    }
+    if (cache_dir != NULL && cache_alias(alias, sizeof(alias), cache_dir, argv[optind], argv[optind+1]) < 0) {
+        cache_dir = NULL;
+    }
+
+    // The server confirmed our copy less than max_age seconds ago: play it without asking again
+    if (cache_dir != NULL && max_age > 0 && cache_fresh(alias, path, sizeof(path), cache_dir, max_age)) {
+        err = printf("Playing %s from cache\n", argv[optind+1]);
+        errorHandler(err, "Something went wrong when printing to stdout");
+        playCached(path);
+        return 0;
+    }
+
+    // DNS (resolving hostname)
+    setServerSockaddr(&from, argv[optind]);
+
+    if (outfile != NULL) {
+        if (use_tcp) {
+            tcpDownloadAudio(from, argv[optind+1], outfile);
+            return 0;
+        }
+        sock_fd = createSocket();
+        snprintf(request, SIZE, "%s%s", REQ_DOWNLOAD, argv[optind+1]);
+        sendRequest(sock_fd, request, SIZE, from);
+        downloadAudio(sock_fd, from, outfile);
+        err = close(sock_fd);
+        errorHandler(err, "Something went wrong when closing socket file descriptor");
+        return 0;
+    }
+
+    // A server on this host streams through shared memory instead of the loopback network
+    if (argc - optind == 2 && !have_psk && (local_fd = connectLocal(from)) >= 0) {
+        strncpy(request, argv[optind+1], SIZE - 1);
+        err = write(local_fd, request, SIZE);
+        errorHandler(err, "Something went wrong when sending the request to the local server");
+        ring = recvLocalHeader(local_fd, &header, &data_fd, &space_fd);
+        sock_fd = local_fd;
+    } else {
+        // Create socket
+        sock_fd = createSocket();
+
+        if (argc - optind == 2) {
+            // Send filename to server
+            strncpy(request, argv[optind+1], SIZE - 1);
+            sendRequest(sock_fd, request, SIZE, from);
+        } else {
+            // Several files are played gaplessly as one playlist
+            len = snprintf(request, BUFSIZE, "%s", REQ_PLAYLIST);
+            for (i = optind + 1; i < argc && len < BUFSIZE; i++) {
+                len += snprintf(request + len, BUFSIZE - len, "%s\n", argv[i]);
+            }
+            if (len >= BUFSIZE) {
+                errorHandler(-1, "Playlist does not fit in one request");
+            }
+            sendRequest(sock_fd, request, len + 1, from);
+        }
+
+        recvAudioHeader(sock_fd, &header);
+    }
+
+    // The header tells which version of the file the server has, play it from the cache if we have it
+    if (cache_dir != NULL && cache_path(path, sizeof(path), cache_dir, argv[optind], argv[optind+1], header.mtime, header.packets) < 0) {
+        cache_dir = NULL;
+    }
+    if (cache_dir != NULL && cache_lookup(path)) {
+        // A local server notices we closed the connection
+        if (local_fd < 0) {
+            sendString(sock_fd, CACHE_HIT, from);
+        }
+        err = close(sock_fd);
+        errorHandler(err, "Something went wrong when closing socket file descriptor");
+        cache_confirm(alias, path);
+        err = printf("Playing %s from cache\n", argv[optind+1]);
+        errorHandler(err, "Something went wrong when printing to stdout");
+        playCached(path);
+        return 0;
+    }
+    if (local_fd < 0) {
+        sendString(sock_fd, "ACK", from);
+    }
+
+    // Get audio device file descriptor
+    aud_fd = aud_writeinit(header.sample_rate, header.sample_size, header.channels);
+    errorHandler(aud_fd, "Couldn't connect to audio device\n");
+
+    // Fill the cache while the track streams in
+    if (cache_dir != NULL) {
+        cache_fd = cache_create(path, header.sample_rate, header.sample_size, header.channels);
+    }
+
+    if (local_fd >= 0) {
+        err = playLocal(ring, data_fd, space_fd, aud_fd, cache_fd, &data_length);
+    } else {
+        err = playStream(&sock_fd, from, &header, &aud_fd, cache_fd, &data_length);
+    }
+    if (err == 0) {
+        if (cache_fd >= 0 && cache_commit(cache_fd, path, data_length, cache_dir, cache_limit*1024*1024) == 0) {
+            cache_confirm(alias, path);
+        }
+    } else if (cache_fd >= 0) {
+        cache_abort(cache_fd, path);
+    }
 
     // Close socket and audio file descriptors when finished
+    if (ring != NULL) {
+        munmap(ring, sizeof(struct local_ring));
+        close(data_fd);
+        close(space_fd);
+    }
     closeConnection(aud_fd, sock_fd);
 
     return 0;
-}
\ No newline at end of file
+}
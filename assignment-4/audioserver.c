@@ -1,27 +1,123 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 #include "audio.h"
-
-#define BUFSIZE 1024
-#define SIZE 64
+#include "error.h"
+#include "evloop.h"
+#include "pool.h"
+#include "protocol.h"
 
 static int PORT = 1234;
 
-// Basic errorhandler that takes error code and message
-void errorHandler(int error, char * msg) {
-    if (error < 0) {
-        fprintf(stderr, "ERROR: %s\n", msg);
-        exit(1);
-    }
-}
+// Pre-shared key for encrypted sessions, and the state of the current session when it is encrypted
+static uint8_t psk[CRYPTO_KEYBYTES];
+static int have_psk = 0;
+static CryptoSession secure;
+static CryptoSession * session = NULL;
+static uint8_t server_nonce[CRYPTO_NONCEBYTES];
+
+// Audio the client buffers before playing, in seconds. A lost packet is resent until the client would play it
+#define PLAYOUT_DELAY 0.2
+
+// Playback schedule of a stream: packet seq is due to be sent at start + seq/pack_per_sec
+struct schedule {
+    struct timespec start;
+    struct timespec last_ack;
+    double pack_per_sec;
+    uint32_t seq;               // next packet to send
+    uint32_t acked;             // packet after the last one the client acknowledged
+    uint32_t skipped;           // packets given up on because they would have arrived too late
+    uint64_t token;             // lets the client move the stream to a new address, 0 if it can't
+};
+
+// Streams that time out are parked this long, so their client can resume them with the token from the header
+#define PARK_SECONDS 60
+#define MAX_PARKED 16
+
+// Buffers in the packet pool. Every session takes one or two for its state and packet buffer, parked streams included
+#define POOL_BUFFERS 1024
+
+// Seconds a TCP or local client gets to send its request, and a TCP download to make progress
+#define REQUEST_TIMEOUT 2
+
+// How much of the next playlist track is mapped ahead of time
+#define PRIME_SIZE (256*1024)
+#define MAX_TRACKS 256
+
+// Kinds of session on the UDP socket: streams and playlists are paced at the playback rate, downloads go as fast as the path allows
+#define KIND_STREAM 0
+#define KIND_PLAYLIST 1
+#define KIND_DOWNLOAD 2
+
+// What a session waits for: the acknowledgement of its audio header, the time the next packet is due,
+// or the acknowledgement of the packets it sent
+#define PHASE_HEADER 0
+#define PHASE_DUE 1
+#define PHASE_SENT 2
+
+// The tracks of a playlist and the one after the current track, opened ahead of time
+struct playlist {
+    char list[MAXPACKET + 1];           // the request, the tracks point into it
+    uint16_t tracks[MAX_TRACKS];        // offsets of the track names in list
+    int count, current, next, next_fd;
+    void * primed;                      // the first pages of the next track, MAP_FAILED if none
+    size_t primed_len;
+    struct audio_header next_header;
+    int rate_changed;                   // a format marker went out, the packet rate of the new track applies after it
+    int ending;                         // the empty packet that ends the playlist went out
+};
 
+// Congestion control of a download, see startDownload
+struct download {
+    uint32_t first, base, next, end, rtt_seq;
+    int dupacks, rtt_pending;
+    double cwnd, ssthresh, srtt, rttvar, rto;
+    struct timespec rtt_start, last_progress;
+};
+
+// A session on the UDP socket. It lives in an arena of its own, so it outlives the request that started it when it is parked,
+// and all of its memory goes back to the pool in one step when it ends
+// Sessions are driven by the event loop: their timer sends the next packet when it is due and resends what is not acknowledged,
+// and the acknowledgements come in through the callback of the UDP socket
+struct stream {
+    Arena * arena;
+    int kind, phase;
+    int fd;                     // the UDP socket
+    int wav_fd;
+    int timer;                  // the pending timer, <0 if there is none
+    off_t data_offset;
+    struct sockaddr_in client;
+    struct audio_header header;
+    struct schedule sched;
+    struct timespec since;      // when the audio header first went out
+    struct timespec deadline;   // when the client plays the packet in flight, it is given up on after that unless reliable
+    struct timespec parked_at;
+    double interval;            // between resends of the audio header
+    struct dl_packet * packet;  // the next packet is read into and sent from here
+    int len, reliable;          // bytes of audio in the packet, and whether it must arrive however late
+    struct playlist * playlist; // for KIND_PLAYLIST only
+    struct download * download; // for KIND_DOWNLOAD only
+};
+static struct stream * parked[MAX_PARKED];
+
+// The session being served on the UDP socket, NULL while the server waits for a request
+// One runs at a time: until it ends, requests of other clients are dropped and they have to ask again
+static struct stream * active;
 // Creates socket and returns file descriptor
 int createSocket() {
     int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -29,6 +125,27 @@ int createSocket() {
     return fd;
 }
 
+// Creates the TCP socket used for bulk downloads and returns file descriptor
+int createTcpSocket() {
+    int fd, err, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    errorHandler(fd, "TCP socket could not be acquired");
+    err = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    errorHandler(err, "Could not set SO_REUSEADDR on TCP socket");
+    return fd;
+}
+
+// Enlarges the kernel buffers of a socket, so bulk transfers are not limited by the default sizes
+void setBulkBuffers(int fd) {
+    int err, size = BULK_SOCKBUF;
+
+    err = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    errorHandler(err, "Could not set socket send buffer size");
+    err = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    errorHandler(err, "Could not set socket receive buffer size");
+}
+
 // Binds a given file descriptor to a socket
 void bindSocket(int fd) {
     struct sockaddr_in addr;
@@ -42,6 +159,25 @@ void bindSocket(int fd) {
     errorHandler(err, "Could not bind socket");
 }
 
+// Creates the Unix socket of the local transport, replacing one left behind by an earlier server
+int createLocalSocket() {
+    struct sockaddr_un addr;
+    int fd, err;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    errorHandler(fd, "Unix socket could not be acquired");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, LOCAL_SOCKET, sizeof(addr.sun_path) - 1);
+    unlink(LOCAL_SOCKET);
+    err = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    errorHandler(err, "Could not bind Unix socket");
+    err = listen(fd, 16);
+    errorHandler(err, "Could not listen on Unix socket");
+    return fd;
+}
+
 // Gets a timespec of the current time
 struct timespec getCurrentTime() {
     struct timespec starttime;
@@ -62,183 +198,1406 @@ double getTimediff(struct timespec starttime, struct timespec endtime) {
     return ((double) sec) + ((double) ns*1E-9);
 }
 
+// Sends a datagram to dest, sealed when the session is encrypted
+int sendPacket(int fd, void * buf, int len, struct sockaddr_in dest) {
+    char sealed[MAXPACKET];
+
+    if (session != NULL) {
+        len = crypto_seal(session, sealed, buf, len);
+        buf = sealed;
+    }
+    return sendto(fd, buf, len, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
+}
+
+// Receives a datagram into buf, opened when the session is encrypted
+// Returns CRYPTO_FORGED for datagrams that fail authentication, which callers ignore
+int recvPacket(int fd, void * buf, int len, int flags, struct sockaddr_in * from) {
+    char sealed[MAXPACKET];
+    socklen_t fromlen = sizeof(struct sockaddr_in);
+    int n;
+
+    if (session == NULL) {
+        return recvfrom(fd, buf, len, flags, (struct sockaddr*) from, from != NULL ? &fromlen : NULL);
+    }
+    n = recvfrom(fd, sealed, sizeof(sealed), flags, (struct sockaddr*) from, from != NULL ? &fromlen : NULL);
+    if (n < 0) {
+        return n;
+    }
+    if (n - CRYPTO_OVERHEAD > len) {
+        return CRYPTO_FORGED;
+    }
+    return crypto_open(session, buf, sealed, n);
+}
+
 // Sends a string to a specified sockaddr_in destination through the provided socket file descriptor
 void sendString(int fd, char * msg, struct sockaddr_in dest) {
     int errsend;
 
-    errsend = sendto(fd, msg, SIZE, 0, (struct sockaddr*) &dest, sizeof(struct sockaddr_in));
+    errsend = sendPacket(fd, msg, SIZE, dest);
     errorHandler(errsend, "Message was not sent");
 }
 
-// Sends packet with specialised format containing audio header information to client
-int sendAudioHeader(int client_fd, struct sockaddr_in client, int sample_rate, int sample_size, int channels, struct timeval timeout) {
-    int err, nb, header[3] = {sample_rate, sample_size, channels};
-    double timediff;
-    struct timespec starttime;
-    char ack[SIZE];
-    fd_set read_set;
-    
-    // Get starttime for timeout
-    starttime = getCurrentTime();
-    FD_ZERO(&read_set);
-    // Send header information out for 6 seconds max, until an acknowledgement arrives
-    do {
-        err = sendto(client_fd, header, sizeof(int[3]), 0, (struct sockaddr*) &client, sizeof(struct sockaddr_in));
-        errorHandler(err, "Something went wrong sending header to client");
-
-        FD_SET(client_fd, &read_set);
-        nb = select(client_fd+1, &read_set, NULL, NULL, &timeout);
-        errorHandler(nb, "Something went wrong when waiting for audio header packet");
-
-        // Receive and confirm acknowledgement content
-        if (FD_ISSET(client_fd, &read_set)) {
-            err = read(client_fd, ack, SIZE);
-            errorHandler(err, "Something went wrong when receiving ack");
-            
-            // Go back to listen for requests if we don't receive an acknowledgement back from the client
-            if (strcmp(ack, "ACK") != 0) {
-                err = printf("Received something other than an acknowledgement after sending audio header\nClosing Connection");
-                errorHandler(err, "Something went wrong when printing to stdout");
-                return 1;
+// Checks the request of an encrypted session and sets up the session key
+// The opened request replaces the content of buf. Returns -1 if the request does not carry our pre-shared key
+int openSecureRequest(char * buf, int len) {
+    struct secure_hello hello;
+    uint8_t request[BUFSIZE];
+
+    len -= sizeof(hello) + CRYPTO_TAGBYTES;
+    if (!have_psk || len < 0 || len >= BUFSIZE) {
+        return -1;
+    }
+    memcpy(&hello, buf, sizeof(hello));
+    if (aead_open(request, (uint8_t *) buf + sizeof(hello) + len, (uint8_t *) buf + sizeof(hello), len,
+            (uint8_t *) &hello, sizeof(hello), psk, hello.nonce) < 0) {
+        return -1;
+    }
+    memcpy(buf, request, len);
+    buf[len] = '\0';
+
+    // Our nonce makes the session key fresh even if someone replays the request
+    crypto_random(server_nonce, sizeof(server_nonce));
+    crypto_session(&secure, psk, hello.nonce, server_nonce, 1);
+    session = &secure;
+    return 0;
+}
+
+// Opens a wav file and fills in the audio header describing it
+// Returns the file descriptor, positioned at the start of the audio data, or -1 if it can't be read
+int openAudio(char * filename, struct audio_header * header) {
+    int wav_fd, err, sample_rate, sample_size, channels;
+    off_t data_offset;
+    struct stat st;
+
+    wav_fd = aud_readinit(filename, &sample_rate, &sample_size, &channels);
+    if (wav_fd < 0) {
+        return -1;
+    }
+
+    // Number of packets needed for the data following the wav header
+    err = fstat(wav_fd, &st);
+    errorHandler(err, "Could not stat audio file");
+    data_offset = lseek(wav_fd, 0, SEEK_CUR);
+    errorHandler(data_offset, "Could not get offset of audio data");
+
+    header->sample_rate = sample_rate;
+    header->sample_size = sample_size;
+    header->channels = channels;
+    header->packets = (st.st_size - data_offset + BUFSIZE - 1) / BUFSIZE;
+    header->mtime = st.st_mtime;
+    header->token = 0;
+    return wav_fd;
+}
+
+// Adds sec seconds to a timespec
+struct timespec addTime(struct timespec t, double sec) {
+    long ns = t.tv_nsec + (long) ((sec - (long) sec)*1E9);
+
+    t.tv_sec += (long) sec + ns/1000000000;
+    t.tv_nsec = ns%1000000000;
+    if (t.tv_nsec < 0) {
+        t.tv_sec--;
+        t.tv_nsec += 1000000000;
+    }
+    return t;
+}
+
+// Starts the playback schedule of a stream. The schedule starts PLAYOUT_DELAY in the past,
+// so the first PLAYOUT_DELAY seconds of audio go out as fast as the client acknowledges them and fill its buffer
+void startSchedule(struct schedule * sched, double pack_per_sec) {
+    sched->pack_per_sec = pack_per_sec;
+    sched->seq = 0;
+    sched->acked = 0;
+    sched->skipped = 0;
+    sched->token = 0;
+    sched->last_ack = getCurrentTime();
+    sched->start = addTime(sched->last_ack, -PLAYOUT_DELAY);
+}
+
+// Changes the packet rate of a running schedule, without moving the due time of the next packet
+void setScheduleRate(struct schedule * sched, double pack_per_sec) {
+    struct timespec due = addTime(sched->start, sched->seq/sched->pack_per_sec);
+
+    sched->start = addTime(due, -(sched->seq/pack_per_sec));
+    sched->pack_per_sec = pack_per_sec;
+}
+
+// Moves a stream that broke off to packet seq, the first one the client still needs
+// The client's buffer ran dry in the meantime, so it is filled up again first
+void resumeSchedule(struct schedule * sched, uint32_t seq) {
+    sched->seq = sched->acked = seq;
+    sched->last_ack = getCurrentTime();
+    sched->start = addTime(sched->last_ack, -(PLAYOUT_DELAY + sched->seq/sched->pack_per_sec));
+}
+
+// Number of packets per second needed to play audio in the given format in realtime
+double packetRate(struct audio_header * header) {
+    int byterate = header->sample_rate * (header->sample_size/8) * header->channels;
+    return (double)byterate/BUFSIZE;
+}
+// Opens the next track of a playlist ahead of time: parses its header and maps its first pages,
+// so they are already in the page cache when the track starts
+// Returns the file descriptor, or -1 if the track can't be played
+int primeAudio(char * filename, struct audio_header * header, void ** primed, size_t * primed_len) {
+    int wav_fd;
+    struct stat st;
+
+    wav_fd = openAudio(filename, header);
+    if (wav_fd < 0) {
+        return -1;
+    }
+    if (fstat(wav_fd, &st) < 0) {
+        close(wav_fd);
+        return -1;
+    }
+
+    *primed_len = st.st_size;
+    if (*primed_len > PRIME_SIZE) {
+        *primed_len = PRIME_SIZE;
+    }
+    *primed = mmap(NULL, *primed_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, wav_fd, 0);
+    return wav_fd;
+}
+
+// Ends a session: closes its files and gives its memory back to the pool
+void endStream(struct stream * stream) {
+    if (stream->wav_fd >= 0) {
+        close(stream->wav_fd);
+    }
+    if (stream->playlist != NULL) {
+        if (stream->playlist->next_fd >= 0) {
+            close(stream->playlist->next_fd);
+        }
+        if (stream->playlist->primed != MAP_FAILED) {
+            munmap(stream->playlist->primed, stream->playlist->primed_len);
+        }
+    }
+    arena_free(stream->arena);
+}
+
+// Prints that the server is free for the next request
+void printListening() {
+    int err;
+
+    err = printf("Listening for requests on port %d\n", PORT);
+    errorHandler(err, "Something went wrong when printing to stdout");
+}
+
+// Sets up the state of a new session on the UDP socket
+// When the pool is exhausted, parked streams are given up on, longest parked first, to make room
+// Returns NULL if there is no room even then
+struct stream * newStream(int kind, int fd, struct sockaddr_in client) {
+    Arena * arena;
+    struct stream * stream;
+    int i, oldest;
+
+    while ((arena = arena_new()) == NULL) {
+        for (oldest = -1, i = 0; i < MAX_PARKED; i++) {
+            if (parked[i] != NULL && (oldest < 0 || getTimediff(parked[i]->parked_at, parked[oldest]->parked_at) > 0)) {
+                oldest = i;
             }
         }
-        
-        // If we've been sending audio headers out for more than 6 seconds, go back to listen for other requests
-        timediff = getTimediff(starttime, getCurrentTime());
-        if (timediff > 6) {
-            err = printf("Waited for more than 6 seconds for audio header acknowledgement to arrive from client.\nClosing Connection");
-            errorHandler(err, "Something went wrong when printing to stdout");
+        if (oldest < 0) {
+            return NULL;
+        }
+        endStream(parked[oldest]);
+        parked[oldest] = NULL;
+    }
+
+    stream = arena_alloc(arena, sizeof(struct stream));
+    if (stream == NULL || (stream->packet = arena_alloc(arena, sizeof(struct dl_packet))) == NULL ||
+            (kind == KIND_PLAYLIST && (stream->playlist = arena_alloc(arena, sizeof(struct playlist))) == NULL) ||
+            (kind == KIND_DOWNLOAD && (stream->download = arena_alloc(arena, sizeof(struct download))) == NULL)) {
+        arena_free(arena);
+        return NULL;
+    }
+    stream->arena = arena;
+    stream->kind = kind;
+    stream->fd = fd;
+    stream->client = client;
+    stream->wav_fd = stream->timer = -1;
+    if (stream->playlist != NULL) {
+        stream->playlist->next_fd = -1;
+        stream->playlist->primed = MAP_FAILED;
+    }
+    return stream;
+}
+
+// Parks a stream that timed out, ending parked streams that have waited too long
+// When every slot is taken, the stream parked longest ago makes room
+void parkStream(struct stream * stream) {
+    int i, slot = 0, err;
+    struct timespec now = getCurrentTime();
+
+    for (i = 0; i < MAX_PARKED; i++) {
+        if (parked[i] != NULL && getTimediff(parked[i]->parked_at, now) > PARK_SECONDS) {
+            endStream(parked[i]);
+            parked[i] = NULL;
+        }
+        if (parked[i] == NULL || (parked[slot] != NULL && getTimediff(parked[i]->parked_at, parked[slot]->parked_at) > 0)) {
+            slot = i;
+        }
+    }
+    if (parked[slot] != NULL) {
+        endStream(parked[slot]);
+    }
+
+    stream->parked_at = now;
+    parked[slot] = stream;
+
+    err = printf("Parked the stream at packet %u, the client can resume it\n", stream->sched.acked);
+    errorHandler(err, "Something went wrong when printing to stdout");
+}
+
+void onStreamTimer(EvLoop * loop, void * arg);
+
+// Restarts the timer of a session, seconds from now
+void armStreamTimer(EvLoop * loop, struct stream * stream, double seconds) {
+    if (stream->timer >= 0) {
+        ev_cancel(loop, stream->timer);
+    }
+    stream->timer = ev_timer(loop, seconds > 0 ? seconds : 0, onStreamTimer, stream);
+    errorHandler(stream->timer, "Could not set the timer of a session");
+}
+
+// The active session is over and the server is free again
+// A stream that timed out is parked when it can be resumed, anything else ends
+void closeStream(EvLoop * loop, struct stream * stream, int park) {
+    if (stream->timer >= 0) {
+        ev_cancel(loop, stream->timer);
+        stream->timer = -1;
+    }
+    active = NULL;
+    if (park && stream->header.token != 0) {
+        parkStream(stream);
+    } else {
+        endStream(stream);
+    }
+    printListening();
+}
+
+// Sends the audio header to the client of a session
+// An encrypted header carries our nonce, so the client can derive the session key
+// Every resend uses sequence number 0 and is identical, so the client can recognise them
+void sendAudioHeader(struct stream * stream) {
+    int err, len = sizeof(struct audio_header);
+    char packet[CRYPTO_NONCEBYTES + sizeof(struct audio_header) + CRYPTO_OVERHEAD];
+    void * header = &stream->header;
+
+    if (session != NULL) {
+        memcpy(packet, server_nonce, CRYPTO_NONCEBYTES);
+        len = CRYPTO_NONCEBYTES + crypto_seal_seq(session, 0, packet + CRYPTO_NONCEBYTES, header, len);
+        header = packet;
+    }
+    err = sendto(stream->fd, header, len, 0, (struct sockaddr*) &stream->client, sizeof(struct sockaddr_in));
+    errorHandler(err, "Something went wrong sending header to client");
+}
+
+// Makes a session the active one and sends its audio header, again every interval until an acknowledgement arrives,
+// for 6 seconds at most
+void startAudioHeader(EvLoop * loop, struct stream * stream, double interval) {
+    active = stream;
+    stream->phase = PHASE_HEADER;
+    stream->interval = interval;
+    stream->since = getCurrentTime();
+    sendAudioHeader(stream);
+    armStreamTimer(loop, stream, interval);
+}
+
+// No acknowledgement of the audio header within the interval
+void resendAudioHeader(EvLoop * loop, struct stream * stream) {
+    int err;
+
+    // If we've been sending audio headers out for more than 6 seconds, go back to listen for other requests
+    if (getTimediff(stream->since, getCurrentTime()) > 6) {
+        err = printf("Waited for more than 6 seconds for audio header acknowledgement to arrive from client.\nClosing Connection\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        closeStream(loop, stream, 0);
+        return;
+    }
+    sendAudioHeader(stream);
+    armStreamTimer(loop, stream, stream->interval);
+}
+
+// Reads packet sched.seq of a stream straight from the audio file into the packet buffer
+// Packet header.packets is the empty one at the end, which must arrive. Returns 0 once that has gone out
+int readStreamPacket(struct stream * stream) {
+    if (stream->sched.seq > stream->header.packets) {
+        return 0;
+    }
+    stream->len = pread(stream->wav_fd, stream->packet->data, BUFSIZE, stream->data_offset + (off_t) stream->sched.seq*BUFSIZE);
+    errorHandler(stream->len, "Something went wrong when reading the audio file");
+    stream->reliable = stream->len == 0;
+    return 1;
+}
+
+// Opens the track after the current one ahead of time, skipping tracks that can't be played
+void primeNextTrack(struct playlist * playlist) {
+    while (playlist->next_fd < 0 && playlist->next < playlist->count) {
+        playlist->next_fd = primeAudio(playlist->list + playlist->tracks[playlist->next], &playlist->next_header,
+                                       &playlist->primed, &playlist->primed_len);
+        if (playlist->next_fd < 0) {
+            playlist->next++;
+        }
+    }
+}
+
+// Reads the next packet of a playlist: audio of the current track, a format marker between two tracks
+// if the client has to reconfigure its audio device for the next one, or the empty packet at the end
+// Tracks are read back to back as if they were one file. Returns 0 once the end has gone out
+int readPlaylistPacket(struct stream * stream) {
+    struct playlist * playlist = stream->playlist;
+    struct format_marker marker;
+    struct audio_header header;
+    int len, err;
+
+    if (playlist->ending) {
+        return 0;
+    }
+    if (playlist->rate_changed) {
+        setScheduleRate(&stream->sched, packetRate(&stream->header));
+        playlist->rate_changed = 0;
+    }
+
+    while (1) {
+        len = read(stream->wav_fd, stream->packet->data, BUFSIZE);
+        errorHandler(len, "Something went wrong when reading the audio file");
+
+        // Prime the next track once the current one is under way
+        primeNextTrack(playlist);
+        if (len > 0) {
+            stream->len = len;
+            stream->reliable = 0;
             return 1;
         }
-    } while (nb == 0);
 
-    return 0;
+        err = close(stream->wav_fd);
+        errorHandler(err, "Something went wrong when closing wav file descriptor");
+        stream->wav_fd = -1;
+
+        // Empty packet and FIN end the session, as for a single file
+        if (playlist->next_fd < 0) {
+            playlist->ending = 1;
+            stream->len = 0;
+            stream->reliable = 1;
+            return 1;
+        }
+        if (playlist->primed != MAP_FAILED) {
+            munmap(playlist->primed, playlist->primed_len);
+            playlist->primed = MAP_FAILED;
+        }
+
+        header = stream->header;
+        stream->wav_fd = playlist->next_fd;
+        stream->header = playlist->next_header;
+        playlist->current = playlist->next;
+        playlist->next = playlist->current + 1;
+        playlist->next_fd = -1;
+        err = printf("Streaming track %d: %s\n", playlist->current + 1, playlist->list + playlist->tracks[playlist->current]);
+        errorHandler(err, "Something went wrong when printing to stdout");
+
+        // Only tell the client about the next track if its audio device needs different settings
+        if (stream->header.sample_rate != header.sample_rate || stream->header.sample_size != header.sample_size ||
+                stream->header.channels != header.channels) {
+            memset(&marker, 0, sizeof(marker));
+            strcpy(marker.tag, FORMAT_TAG);
+            marker.header = stream->header;
+            memcpy(stream->packet->data, &marker, sizeof(marker));
+            stream->len = sizeof(marker);
+            stream->reliable = 1;
+            playlist->rate_changed = 1;
+            return 1;
+        }
+    }
+}
+
+// Gets the next packet of a stream or playlist ready and waits until it is due,
+// or when everything has been sent, sends FIN and ends the session
+void nextPacket(EvLoop * loop, struct stream * stream) {
+    struct timespec due;
+    int err;
+
+    if (stream->kind == KIND_PLAYLIST ? readPlaylistPacket(stream) : readStreamPacket(stream)) {
+        due = addTime(stream->sched.start, stream->sched.seq/stream->sched.pack_per_sec);
+        stream->deadline = addTime(due, PLAYOUT_DELAY);
+        stream->packet->seq = stream->sched.seq;
+        stream->phase = PHASE_DUE;
+        armStreamTimer(loop, stream, getTimediff(getCurrentTime(), due));
+        return;
+    }
+
+    sendString(stream->fd, "FIN", stream->client);
+    if (stream->kind == KIND_PLAYLIST) {
+        err = printf("Playlist has been streamed (%u packets too late to resend)\n", stream->sched.skipped);
+    } else {
+        err = printf("Audio has been streamed (%u packets too late to resend)\n", stream->sched.skipped);
+    }
+    errorHandler(err, "Something went wrong when printing to stdout");
+    closeStream(loop, stream, 0);
+}
+
+// Sends the packet of a stream that is due, or resends it, and waits for its acknowledgement until the resend is due
+void sendPaced(EvLoop * loop, struct stream * stream) {
+    int err;
+
+    err = sendPacket(stream->fd, stream->packet, sizeof(uint32_t) + stream->len, stream->client);
+    errorHandler(err, "Something went wrong sending packet to client");
+    stream->phase = PHASE_SENT;
+    armStreamTimer(loop, stream, 1/stream->sched.pack_per_sec);
+}
+
+// The packet in flight was not acknowledged within a packet interval
+// A packet that is still unacknowledged when the client plays it is given up on, the client conceals the gap
+// Packets that are not a part of the audio, like format markers and the end of the stream, are sent until they arrive
+void resendPaced(EvLoop * loop, struct stream * stream) {
+    struct timespec now = getCurrentTime();
+    int err;
+
+    // If the client hasn't acknowledged anything for more than 6 seconds,
+    // stop transmitting audio files and return to listening to requests
+    if (getTimediff(stream->sched.last_ack, now) > 6) {
+        err = printf("Waited for more than 6 seconds for acknowledgement. Closing connection\n");
+        errorHandler(err, "Something went wrong printing to stdout");
+        closeStream(loop, stream, 1);
+        return;
+    }
+    if (!stream->reliable && getTimediff(stream->deadline, now) > 0) {
+        stream->sched.skipped++;
+        stream->sched.seq++;
+        nextPacket(loop, stream);
+        return;
+    }
+    sendPaced(loop, stream);
+}
+
+void resendDownload(EvLoop * loop, struct stream * stream);
+
+void onStreamTimer(EvLoop * loop, void * arg) {
+    struct stream * stream = arg;
+
+    stream->timer = -1;
+    if (stream->phase == PHASE_HEADER) {
+        resendAudioHeader(loop, stream);
+    } else if (stream->kind == KIND_DOWNLOAD) {
+        resendDownload(loop, stream);
+    } else if (stream->phase == PHASE_DUE) {
+        sendPaced(loop, stream);
+    } else {
+        resendPaced(loop, stream);
+    }
+}
+
+// A datagram for a stream or playlist that is under way: the acknowledgement of the packet in flight,
+// or a client that resumes the stream from a new address. Forged datagrams and late acknowledgements of earlier packets are dropped
+void onPacedAnswer(EvLoop * loop, struct stream * stream, char * ack, struct sockaddr_in * from) {
+    struct schedule * sched = &stream->sched;
+    unsigned long long token;
+    unsigned int seq;
+    int err;
+
+    // The client resumes the stream from a new address: carry on there, from where it lost us
+    if (sched->token != 0 && sscanf(ack, REQ_RESUME "%llu %u", &token, &seq) == 2 && token == sched->token &&
+            seq <= sched->seq) {
+        stream->client = *from;
+        resumeSchedule(sched, seq);
+        err = printf("Client moved to %s:%d, resuming at packet %u\n", inet_ntoa(from->sin_addr), ntohs(from->sin_port), sched->seq);
+        errorHandler(err, "Something went wrong when printing to stdout");
+        nextPacket(loop, stream);
+        return;
+    }
+    if (stream->phase == PHASE_SENT && from->sin_addr.s_addr == stream->client.sin_addr.s_addr &&
+            from->sin_port == stream->client.sin_port && strncmp(ack, "ACK ", 4) == 0 && strtoul(ack + 4, NULL, 10) == sched->seq) {
+        sched->last_ack = getCurrentTime();
+        sched->acked = sched->seq + 1;
+        sched->seq++;
+        nextPacket(loop, stream);
+    }
 }
 
 // Streams a given filename to a given client
 // First reads and sends audio header information to client in first packet
-// Then iterates through the audio file, sending each chunk as it goes,
-//      Every time packet is sent, it waits for an acknowledgement before sending next packet
+// Then sends the audio file chunk by chunk at the playback rate, each packet until it is acknowledged or too late to play
 // Finally, sending FIN packet when done transmitting audio file
-void streamAudio(int client_fd, char * filename, struct sockaddr_in client){
-    int wav_fd, wav_pointer, err, sample_rate, sample_size, channels, byterate, nb;
-    double pack_per_sec, timediff;
-    struct timespec extratimeout, starttime;
-    char buffer[BUFSIZE], ack[SIZE];
-    fd_set read_set;
-    struct timeval timeout;
+// Plain streams get a token in their header, so the client can resume them if they break off
+void streamAudio(EvLoop * loop, int fd, char * filename, struct sockaddr_in client) {
+    int err;
+    struct stream * stream;
+
+    stream = newStream(KIND_STREAM, fd, client);
+    if (stream == NULL) {
+        err = printf("Out of memory for sessions. Ignoring request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        return;
+    }
 
     // Initialise the read of the audio file requested by client
-    wav_fd = aud_readinit(filename, &sample_rate, &sample_size, &channels);
-    errorHandler(wav_fd, "Couldn't read audio file");
-
-    // Calculate bitrate necessary for transmission
-    byterate = sample_rate * (sample_size/8) * channels;
-    
-    // Calculate packets/second, based on our BUFSIZE, and set timeout accordingly
-    pack_per_sec = (double)byterate/BUFSIZE;
-    // *0.94 to decrease sleeping time a tiny bit to account for network delay
-    timeout.tv_usec = (((double) 1/pack_per_sec)*1E6)*0.94; 
-
-    // Send audio file header information to client
-    err = sendAudioHeader(client_fd, client, sample_rate, sample_size, channels, timeout);
-    // Return in case of timeout
-    if (err) {return;}
-    
-    // Start reading the audio file, and send packets
-    FD_ZERO(&read_set);
-    do {
-        // Read audio chunk
-        wav_pointer = read(wav_fd, buffer, BUFSIZE);
-        errorHandler(wav_pointer, "Something went wrong when reading the audio file");
-        
-        // Get starttime for transmission of each packet
-        starttime = getCurrentTime();
-        do {
-            // Set timeout to sleep for amount of time to maintain bitrate
-            FD_SET(client_fd, &read_set);
-            timeout.tv_sec = 0;
-            timeout.tv_usec = (((double) 1/pack_per_sec)*1E6);
-
-            // Send audio packet
-            err = sendto(client_fd, buffer, wav_pointer, 0, (struct sockaddr*) &client, sizeof(struct sockaddr_in));
-            errorHandler(err, "Something went wrong sending packet to client");
-            
-            // Wait until acknowledgement arrives
-            nb = select(client_fd+1, &read_set, NULL, NULL, &timeout);
-            errorHandler(nb, "Something went wrong when waiting for acknowledgement");
-
-            // If time it took since trying to send this particular audio packet is more than 6 seconds,
-            // stop transmitting audio files and return to listening to requests
-            timediff = getTimediff(starttime, getCurrentTime());
-            if (timediff > 6 && nb == 0) {
-                err = printf("Waited for more than 6 seconds for acknowledgement. Closing connection\n");
-                errorHandler(err, "Something went wrong printing to stdout");
-                return;
+    stream->wav_fd = openAudio(filename, &stream->header);
+    if (stream->wav_fd < 0) {
+        err = printf("Couldn't read audio file. Ignoring request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        endStream(stream);
+        return;
+    }
+    stream->data_offset = lseek(stream->wav_fd, 0, SEEK_CUR);
+    errorHandler(stream->data_offset, "Could not get offset of audio data");
+    while (session == NULL && stream->header.token == 0) {
+        crypto_random(&stream->header.token, sizeof(stream->header.token));
+    }
+
+    // Resend the header a tiny bit faster than the packet rate, to account for network delay
+    startAudioHeader(loop, stream, 0.94/packetRate(&stream->header));
+}
+
+// Continues a parked stream at packet seq, sending it to the client's current address
+// The file is still open and the header is not sent again, so this takes no more than the first packet's round trip
+void resumeAudio(EvLoop * loop, int fd, uint64_t token, uint32_t seq, struct sockaddr_in client) {
+    int i, err;
+    struct stream * stream;
+    struct timespec now = getCurrentTime();
+
+    for (i = 0; i < MAX_PARKED && (parked[i] == NULL || parked[i]->header.token != token); i++);
+    if (i == MAX_PARKED || getTimediff(parked[i]->parked_at, now) > PARK_SECONDS || seq > parked[i]->header.packets) {
+        // The stream is gone, end the session
+        err = printf("No parked stream for this token\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        sendString(fd, "FIN", client);
+        return;
+    }
+    stream = parked[i];
+    parked[i] = NULL;
+
+    stream->fd = fd;
+    stream->client = client;
+    resumeSchedule(&stream->sched, seq);
+    err = printf("Resuming stream at packet %u\n", seq);
+    errorHandler(err, "Something went wrong when printing to stdout");
+    active = stream;
+    nextPacket(loop, stream);
+}
+
+// Streams the tracks of a playlist (separated by newlines) to a client in one session, without gaps between them
+// Tracks are sent back to back as if they were one file. While a track plays, the next one is primed,
+// and a format marker is sent between them only if the client has to reconfigure its audio device
+// Tracks that can't be opened are skipped
+void streamPlaylist(EvLoop * loop, int fd, char * list, struct sockaddr_in client) {
+    int err;
+    char * track, * saveptr;
+    struct stream * stream;
+    struct playlist * playlist;
+
+    stream = newStream(KIND_PLAYLIST, fd, client);
+    if (stream == NULL) {
+        err = printf("Out of memory for sessions. Ignoring request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        return;
+    }
+    playlist = stream->playlist;
+    strncpy(playlist->list, list, MAXPACKET);
+
+    for (track = strtok_r(playlist->list, "\n", &saveptr); track != NULL && playlist->count < MAX_TRACKS - 1;
+            track = strtok_r(NULL, "\n", &saveptr)) {
+        playlist->tracks[playlist->count++] = track - playlist->list;
+    }
+    while (playlist->current < playlist->count &&
+            (stream->wav_fd = openAudio(playlist->list + playlist->tracks[playlist->current], &stream->header)) < 0) {
+        playlist->current++;
+    }
+    if (stream->wav_fd < 0) {
+        err = printf("None of the tracks in the playlist can be played\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        endStream(stream);
+        return;
+    }
+    playlist->next = playlist->current + 1;
+
+    err = printf("Streaming track %d: %s\n", playlist->current + 1, playlist->list + playlist->tracks[playlist->current]);
+    errorHandler(err, "Something went wrong when printing to stdout");
+    startAudioHeader(loop, stream, 0.94/packetRate(&stream->header));
+}
+
+// Sends download packet seq to the client, reading its chunk straight from the audio file
+void sendDownloadPacket(struct stream * stream, uint32_t seq) {
+    int len, err;
+
+    len = pread(stream->wav_fd, stream->packet->data, BUFSIZE, stream->data_offset + (off_t) seq*BUFSIZE);
+    errorHandler(len, "Something went wrong when reading the audio file");
+
+    stream->packet->seq = seq;
+    err = sendPacket(stream->fd, stream->packet, sizeof(uint32_t) + len, stream->client);
+    errorHandler(err, "Something went wrong sending packet to client");
+}
+
+// Fills the congestion window of a download and waits a retransmission timeout for acknowledgements,
+// or once every packet has been acknowledged, sends FIN and ends the session
+void continueDownload(EvLoop * loop, struct stream * stream) {
+    struct download * dl = stream->download;
+    int err;
+
+    if (dl->base >= dl->end) {
+        sendString(stream->fd, "FIN", stream->client);
+        err = printf("Audio has been downloaded (packets %u to %u)\n", dl->first, dl->end);
+        errorHandler(err, "Something went wrong when printing to stdout");
+        closeStream(loop, stream, 0);
+        return;
+    }
+
+    while (dl->next < dl->end && dl->next < dl->base + (uint32_t) dl->cwnd) {
+        sendDownloadPacket(stream, dl->next);
+        if (!dl->rtt_pending) {
+            dl->rtt_seq = dl->next;
+            dl->rtt_start = getCurrentTime();
+            dl->rtt_pending = 1;
+        }
+        dl->next++;
+    }
+    stream->phase = PHASE_SENT;
+    armStreamTimer(loop, stream, dl->rto);
+}
+
+// The client acknowledged the audio header of a download
+void startDownload(EvLoop * loop, struct stream * stream) {
+    struct download * dl = stream->download;
+
+    dl->cwnd = 2;
+    dl->ssthresh = BULK_SOCKBUF/BUFSIZE;
+    dl->last_progress = getCurrentTime();
+    continueDownload(loop, stream);
+}
+
+// No acknowledgement of a download arrived within the retransmission timeout
+void resendDownload(EvLoop * loop, struct stream * stream) {
+    struct download * dl = stream->download;
+    int err;
+
+    if (getTimediff(dl->last_progress, getCurrentTime()) > 6) {
+        err = printf("Waited for more than 6 seconds for acknowledgement. Closing connection\n");
+        errorHandler(err, "Something went wrong printing to stdout");
+        closeStream(loop, stream, 0);
+        return;
+    }
+    // Retransmission timeout: collapse the window and resend from the oldest unacknowledged packet
+    dl->ssthresh = dl->cwnd/2 > 2 ? dl->cwnd/2 : 2;
+    dl->cwnd = 1;
+    dl->next = dl->base;
+    dl->dupacks = 0;
+    dl->rtt_pending = 0;
+    dl->rto = dl->rto*2 < 1 ? dl->rto*2 : 1;
+    continueDownload(loop, stream);
+}
+
+// An acknowledgement of a download arrived, or the client gave up on it
+void onDownloadAnswer(EvLoop * loop, struct stream * stream, char * msg) {
+    struct download * dl = stream->download;
+    uint32_t ack;
+    double sample;
+    int err;
+
+    if (strcmp(msg, "STOP") == 0) {
+        err = printf("Client stopped the download. Closing connection\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        closeStream(loop, stream, 0);
+        return;
+    }
+    if (strncmp(msg, "ACK ", 4) != 0) {
+        return;
+    }
+    ack = strtoul(msg + 4, NULL, 10);
+
+    if (ack > dl->base && ack <= dl->end) {
+        // Round trip time estimate as in RFC 6298, only sampling packets that were not retransmitted
+        if (dl->rtt_pending && ack > dl->rtt_seq) {
+            sample = getTimediff(dl->rtt_start, getCurrentTime());
+            if (dl->srtt == 0) {
+                dl->srtt = sample;
+                dl->rttvar = sample/2;
+            } else {
+                dl->rttvar = 0.75*dl->rttvar + 0.25*(dl->srtt > sample ? dl->srtt - sample : sample - dl->srtt);
+                dl->srtt = 0.875*dl->srtt + 0.125*sample;
             }
-        } while (nb == 0);
+            dl->rto = dl->srtt + 4*dl->rttvar;
+            dl->rto = dl->rto < 0.01 ? 0.01 : dl->rto;
+            dl->rtt_pending = 0;
+        }
+
+        // Slow start below ssthresh, additive increase above it
+        if (dl->cwnd < dl->ssthresh) {
+            dl->cwnd += ack - dl->base;
+        } else {
+            dl->cwnd += (ack - dl->base)/dl->cwnd;
+        }
+        if (dl->cwnd > BULK_SOCKBUF/BUFSIZE) {
+            dl->cwnd = BULK_SOCKBUF/BUFSIZE;
+        }
+
+        dl->base = ack;
+        if (dl->next < dl->base) {
+            dl->next = dl->base;
+        }
+        dl->dupacks = 0;
+        dl->last_progress = getCurrentTime();
+    } else if (ack == dl->base && ++dl->dupacks == 3) {
+        // Fast retransmit of the packet the client is missing
+        dl->ssthresh = dl->cwnd/2 > 2 ? dl->cwnd/2 : 2;
+        dl->cwnd = dl->ssthresh;
+        dl->rtt_pending = 0;
+        sendDownloadPacket(stream, dl->base);
+    }
+}
+
+// Sends packets [first, first+count) of an audio file to a client as fast as the path allows, instead of at playback rate
+// A plain download asks for the whole file, clients fetching from several mirrors ask each one for a range
+// The client can give up on the transfer by sending "STOP"
+// Packets carry a sequence number and the client acknowledges cumulatively ("ACK <next expected seq>")
+// The number of packets in flight follows TCP-style congestion control:
+//      slow start and additive increase while acknowledgements arrive,
+//      halving the window after 3 duplicate acknowledgements (fast retransmit),
+//      and going back to the oldest unacknowledged packet with a window of 1 after a timeout
+void downloadAudio(EvLoop * loop, int fd, char * filename, struct sockaddr_in client, uint32_t first, uint32_t count) {
+    struct stream * stream;
+    struct download * dl;
+    int err;
+
+    stream = newStream(KIND_DOWNLOAD, fd, client);
+    if (stream == NULL) {
+        err = printf("Out of memory for sessions. Ignoring request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        return;
+    }
+    stream->wav_fd = openAudio(filename, &stream->header);
+    if (stream->wav_fd < 0) {
+        err = printf("Couldn't read audio file. Ignoring request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        endStream(stream);
+        return;
+    }
+    stream->data_offset = lseek(stream->wav_fd, 0, SEEK_CUR);
+    errorHandler(stream->data_offset, "Could not get offset of audio data");
+
+    // Clamp the range to the file
+    dl = stream->download;
+    dl->first = first < stream->header.packets ? first : stream->header.packets;
+    dl->end = count < stream->header.packets - dl->first ? dl->first + count : stream->header.packets;
+    dl->base = dl->next = dl->first;
+    dl->rto = 0.2;
+
+    startAudioHeader(loop, stream, dl->rto);
+}
+
+// The audio header of a session is answered
+void onHeaderAnswer(EvLoop * loop, struct stream * stream, char * msg) {
+    int err;
+
+    // The client plays this file from its own cache, there is nothing left to send
+    if (strcmp(msg, CACHE_HIT) == 0) {
+        err = printf("Client has this file cached. Closing connection\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        closeStream(loop, stream, 0);
+        return;
+    }
+
+    // Late acknowledgements of a previous download from this client are not an answer
+    if (strncmp(msg, "ACK ", 4) == 0) {
+        return;
+    }
+
+    // Go back to listen for requests if we don't receive an acknowledgement back from the client
+    if (strcmp(msg, "ACK") != 0) {
+        err = printf("Received something other than an acknowledgement after sending audio header\nClosing Connection\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        closeStream(loop, stream, 0);
+        return;
+    }
 
-        // When ack has arrived, read it
-        if (FD_ISSET(client_fd, &read_set)) {
-            err = read(client_fd, ack, SIZE);
-            errorHandler(err, "Something went wrong when receiving ack");
+    if (stream->kind == KIND_DOWNLOAD) {
+        startDownload(loop, stream);
+        return;
+    }
+    startSchedule(&stream->sched, packetRate(&stream->header));
+    stream->sched.token = stream->header.token;
+    nextPacket(loop, stream);
+}
+
+// Datagrams came in on the UDP socket while a session is under way: they are answers to it,
+// or requests of other clients, which are dropped. Forged datagrams are dropped as well
+void onSessionDatagrams(EvLoop * loop, int fd) {
+    struct stream * stream = active;
+    struct sockaddr_in from;
+    char msg[SIZE + 1];
+    int len;
+
+    while (active == stream) {
+        len = recvPacket(fd, msg, SIZE, MSG_DONTWAIT, &from);
+        if (len == CRYPTO_FORGED) {
+            continue;
+        }
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
         }
+        errorHandler(len, "Something went wrong when receiving ack");
+        msg[len] = '\0';
 
-        // timeout was set to the amount of time between between each packet transmission to maintain bitrate
-        // The select function changes timeout to the amount of time not slept
-        // Here we convert timeout of struct timeval to to struct timespec to use with nanosleep, to sleep 
-        // the extra amount of time to maintain bitrate
-        extratimeout.tv_sec = timeout.tv_sec;
-        extratimeout.tv_nsec = (timeout.tv_usec)*1E3;
-        err = nanosleep(&extratimeout, NULL);
-        errorHandler(err, "Something went wrong when pacing transmission");
+        // Paced streams take datagrams from any address, a client that moved resumes its stream with one
+        if (stream->phase != PHASE_HEADER && stream->kind != KIND_DOWNLOAD) {
+            onPacedAnswer(loop, stream, msg, &from);
+            continue;
+        }
+        if (from.sin_addr.s_addr != stream->client.sin_addr.s_addr || from.sin_port != stream->client.sin_port) {
+            continue;
+        }
+        if (stream->phase == PHASE_HEADER) {
+            onHeaderAnswer(loop, stream, msg);
+        } else {
+            onDownloadAnswer(loop, stream, msg);
+        }
+    }
+
+    // Send what the acknowledgements made room for, once all of them are in
+    if (active == stream && stream->kind == KIND_DOWNLOAD && stream->phase != PHASE_HEADER) {
+        continueDownload(loop, stream);
+    }
+}
+// Sends the audio header of a local stream, with the ring's memfd and the two eventfds
+int sendLocalHeader(int conn, struct audio_header * header, int fds[3]) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr * cmsg;
+    union {
+        char buf[CMSG_SPACE(3*sizeof(int))];
+        struct cmsghdr align;
+    } control;
 
-    } while (wav_pointer > 0);
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = header;
+    iov.iov_len = sizeof(struct audio_header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
 
-    // When audio file has finished transmitting, send FIN to client
-    sendString(client_fd, "FIN", client);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3*sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 3*sizeof(int));
+
+    return sendmsg(conn, &msg, 0);
+}
+
+// A stream to a client on this host through a shared memory ring, see struct local_ring
+// The client takes packets as fast as its audio device plays them, so the ring needs no pacing, acknowledgements
+// or retransmits: audio is read straight into free slots, and the stream waits on the eventfd while the ring is full
+// The stream is driven by the event loop, so a local client that is slow to ask or to play holds up no one else
+struct local {
+    Arena * arena;
+    int conn, wav_fd, fds[3];   // the ring's memfd, and eventfds for "slot filled" and "slot freed"
+    int timer;                  // the pending timeout, <0 if there is none
+    int got;                    // bytes of the request read so far
+    uint32_t seq;               // next packet to put in the ring
+    off_t data_offset;
+    char request[SIZE + 1];
+    struct audio_header header;
+    struct local_ring * ring;   // NULL until the request is in
+};
+
+void onLocalTimeout(EvLoop * loop, void * arg);
+
+// Restarts the timeout of a local stream, seconds from now
+void armLocalTimeout(EvLoop * loop, struct local * local, double seconds) {
+    if (local->timer >= 0) {
+        ev_cancel(loop, local->timer);
+    }
+    local->timer = ev_timer(loop, seconds, onLocalTimeout, local);
+}
+
+// Once the end of the stream is in the ring we are done, the client keeps the ring mapped until it has played it
+void endLocal(EvLoop * loop, struct local * local) {
+    int i, err;
+
+    if (local->timer >= 0) {
+        ev_cancel(loop, local->timer);
+    }
+    ev_del(loop, local->conn);
+    close(local->conn);
+    if (local->ring != NULL) {
+        ev_del(loop, local->fds[2]);
+        munmap(local->ring, sizeof(struct local_ring));
+        err = printf("Local stream has ended\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+    }
+    for (i = 0; i < 3; i++) {
+        if (local->fds[i] >= 0) {
+            close(local->fds[i]);
+        }
+    }
+    if (local->wav_fd >= 0) {
+        close(local->wav_fd);
+    }
+    arena_free(local->arena);
+}
 
-    // Close file descriptor for wav file transmitted
-    err = close(wav_fd);
-    errorHandler(err, "Something went wrong when closing wav file descriptor");
+void onLocalTimeout(EvLoop * loop, void * arg) {
+    struct local * local = arg;
+    int err;
 
-    // Audio has been streamed successfully
-    err = printf("Audio has been streamed\n");
+    local->timer = -1;
+    if (local->ring == NULL) {
+        err = printf("Local client sent no request. Closing connection\n");
+    } else {
+        err = printf("Local client stopped playing. Closing connection\n");
+    }
     errorHandler(err, "Something went wrong when printing to stdout");
+    endLocal(loop, local);
 }
 
-int main(int argc, char ** argv) {
-    int fd, err;
-    char filename[SIZE];
+// Puts packets in the ring until it is full or holds the end of the stream
+// Returns 1 once the end is in, 0 when the ring is full and we wait for the client to free half of it
+int fillRing(struct local * local) {
+    struct local_ring * ring = local->ring;
+    uint32_t head;
+    uint64_t count = 1;
+    int len, err;
+
+    while (local->seq <= local->header.packets) {
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) < LOCAL_SLOTS) {
+            len = pread(local->wav_fd, ring->slots[head % LOCAL_SLOTS].data, BUFSIZE, local->data_offset + (off_t) local->seq*BUFSIZE);
+            errorHandler(len, "Something went wrong when reading the audio file");
+            ring->slots[head % LOCAL_SLOTS].len = len;
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->client_waiting, __ATOMIC_SEQ_CST)) {
+                err = write(local->fds[1], &count, sizeof(count));
+                errorHandler(err, "Could not wake the local client");
+            }
+            local->seq = len == 0 ? local->header.packets + 1 : local->seq + 1;
+            continue;
+        }
+
+        // The ring is full: wait until the client has freed half of it, checking the tail once more after raising our flag
+        __atomic_store_n(&ring->server_waiting, 1, __ATOMIC_SEQ_CST);
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) > LOCAL_SLOTS/2) {
+            return 0;
+        }
+        __atomic_store_n(&ring->server_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return 1;
+}
+
+// Fills the ring for as long as it has room, and waits for the client otherwise
+void feedLocal(EvLoop * loop, struct local * local) {
+    if (fillRing(local)) {
+        endLocal(loop, local);
+    } else {
+        armLocalTimeout(loop, local, 6);
+    }
+}
+
+// The client freed half of the ring
+void onLocalSpace(EvLoop * loop, int fd, int events, void * arg) {
+    struct local * local = arg;
+    uint64_t count;
+
+    while (read(fd, &count, sizeof(count)) > 0);
+    __atomic_store_n(&local->ring->server_waiting, 0, __ATOMIC_SEQ_CST);
+    feedLocal(loop, local);
+}
+
+// Sets up the ring for the file the client asked for and hands it over
+void startLocal(EvLoop * loop, struct local * local) {
+    int err;
+
+    err = printf("Received local request for filename: %s\n", local->request);
+    errorHandler(err, "Something went wrong when printing to stdout");
+
+    local->wav_fd = openAudio(local->request, &local->header);
+    if (local->wav_fd < 0) {
+        err = printf("Couldn't read audio file. Ignoring request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        endLocal(loop, local);
+        return;
+    }
+    local->data_offset = lseek(local->wav_fd, 0, SEEK_CUR);
+    errorHandler(local->data_offset, "Could not get offset of audio data");
+
+    local->fds[0] = memfd_create("audioserver-ring", MFD_CLOEXEC);
+    errorHandler(local->fds[0], "Could not create shared memory for local stream");
+    err = ftruncate(local->fds[0], sizeof(struct local_ring));
+    errorHandler(err, "Could not size shared memory for local stream");
+    local->ring = mmap(NULL, sizeof(struct local_ring), PROT_READ | PROT_WRITE, MAP_SHARED, local->fds[0], 0);
+    if (local->ring == MAP_FAILED) {
+        errorHandler(-1, "Could not map shared memory for local stream");
+    }
+    local->fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    errorHandler(local->fds[1], "Could not create eventfd");
+    local->fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    errorHandler(local->fds[2], "Could not create eventfd");
+    err = ev_add(loop, local->fds[2], EV_READ, onLocalSpace, local);
+    errorHandler(err, "Could not watch the eventfd of a local stream");
+
+    if (sendLocalHeader(local->conn, &local->header, local->fds) < 0) {
+        err = printf("Could not hand the ring to the client. Closing connection\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        endLocal(loop, local);
+        return;
+    }
+    feedLocal(loop, local);
+}
+
+// The connection of a local client is readable: the request comes in, or once streaming,
+// the client closed its end because it stopped, for instance because it had the track cached
+void onLocalConn(EvLoop * loop, int fd, int events, void * arg) {
+    struct local * local = arg;
+    int len, err;
+
+    if (local->ring != NULL) {
+        err = printf("Local client stopped playing. Closing connection\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        endLocal(loop, local);
+        return;
+    }
+
+    len = read(fd, local->request + local->got, SIZE - local->got);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (len <= 0) {
+        endLocal(loop, local);
+        return;
+    }
+    local->got += len;
+    if (local->got == SIZE || memchr(local->request, '\0', local->got) != NULL) {
+        local->request[local->got] = '\0';
+        startLocal(loop, local);
+    }
+}
+
+// Accepts a local client and waits for its request, REQUEST_TIMEOUT seconds at most
+void onLocalConnection(EvLoop * loop, int listen_fd, int events, void * arg) {
+    struct local * local;
+    Arena * arena;
+    int conn, err;
+
+    conn = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0) {
+        return;
+    }
+    arena = arena_new();
+    if (arena == NULL || (local = arena_alloc(arena, sizeof(struct local))) == NULL) {
+        err = printf("Out of memory for sessions. Ignoring local request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        if (arena != NULL) {
+            arena_free(arena);
+        }
+        close(conn);
+        return;
+    }
+    local->arena = arena;
+    local->conn = conn;
+    local->wav_fd = local->fds[0] = local->fds[1] = local->fds[2] = local->timer = -1;
+    if (ev_add(loop, conn, EV_READ, onLocalConn, local) < 0) {
+        close(conn);
+        arena_free(arena);
+        return;
+    }
+    armLocalTimeout(loop, local, REQUEST_TIMEOUT);
+}
+
+// A download over TCP. Like a local stream it is driven by the event loop, so a slow client holds up no one else
+struct tcp {
+    Arena * arena;
+    int conn, wav_fd;
+    int timer;                  // the pending timeout, <0 if there is none
+    int got;                    // bytes of the request read so far
+    int header_sent;            // bytes of the audio header sent so far
+    off_t data_offset, size;
+    char request[SIZE + 1];
+    struct audio_header header;
+};
+
+void onTcpTimeout(EvLoop * loop, void * arg);
+
+// Restarts the timeout of a TCP download, REQUEST_TIMEOUT seconds from now
+void armTcpTimeout(EvLoop * loop, struct tcp * tcp) {
+    if (tcp->timer >= 0) {
+        ev_cancel(loop, tcp->timer);
+    }
+    tcp->timer = ev_timer(loop, REQUEST_TIMEOUT, onTcpTimeout, tcp);
+}
+
+void endTcp(EvLoop * loop, struct tcp * tcp) {
+    if (tcp->timer >= 0) {
+        ev_cancel(loop, tcp->timer);
+    }
+    ev_del(loop, tcp->conn);
+    close(tcp->conn);
+    if (tcp->wav_fd >= 0) {
+        close(tcp->wav_fd);
+    }
+    arena_free(tcp->arena);
+}
+
+void onTcpTimeout(EvLoop * loop, void * arg) {
+    struct tcp * tcp = arg;
+    int err;
+
+    tcp->timer = -1;
+    if (tcp->wav_fd < 0) {
+        err = printf("TCP client sent no request. Closing connection\n");
+    } else {
+        err = printf("TCP client stopped reading. Closing connection\n");
+    }
+    errorHandler(err, "Something went wrong when printing to stdout");
+    endTcp(loop, tcp);
+}
+
+// The connection has room: header first, then let the kernel copy the audio data straight from the page cache
+void onTcpWritable(EvLoop * loop, int fd, int events, void * arg) {
+    struct tcp * tcp = arg;
+    ssize_t sent = 0;
+    int err;
+
+    while (sent >= 0 && tcp->header_sent < (int) sizeof(tcp->header)) {
+        sent = send(fd, (char *) &tcp->header + tcp->header_sent, sizeof(tcp->header) - tcp->header_sent, MSG_NOSIGNAL);
+        if (sent > 0) {
+            tcp->header_sent += sent;
+        }
+    }
+    while (sent >= 0 && tcp->data_offset < tcp->size) {
+        sent = sendfile(fd, tcp->wav_fd, &tcp->data_offset, tcp->size - tcp->data_offset);
+        if (sent == 0) {
+            break;
+        }
+    }
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        armTcpTimeout(loop, tcp);
+        return;
+    }
+
+    if (sent < 0) {
+        err = printf("Client closed the TCP connection before the download finished\n");
+    } else {
+        err = printf("Audio has been downloaded over TCP\n");
+    }
+    errorHandler(err, "Something went wrong when printing to stdout");
+    endTcp(loop, tcp);
+}
+
+// The request of a TCP client comes in: the same "DOWNLOAD <filename>" request as over UDP
+// The client receives the audio header followed by the audio data until the connection closes
+void onTcpRequest(EvLoop * loop, int fd, int events, void * arg) {
+    struct tcp * tcp = arg;
+    struct stat st;
+    int len, err;
+
+    len = read(fd, tcp->request + tcp->got, SIZE - tcp->got);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (len > 0) {
+        tcp->got += len;
+    }
+    if (tcp->got < SIZE && len > 0) {
+        return;
+    }
+    tcp->request[tcp->got] = '\0';
+    if (tcp->got != SIZE || strncmp(tcp->request, REQ_DOWNLOAD, strlen(REQ_DOWNLOAD)) != 0) {
+        err = printf("Received an invalid request over TCP. Closing connection\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        endTcp(loop, tcp);
+        return;
+    }
+
+    err = printf("Received TCP download request for filename: %s\n", tcp->request + strlen(REQ_DOWNLOAD));
+    errorHandler(err, "Something went wrong when printing to stdout");
+
+    tcp->wav_fd = openAudio(tcp->request + strlen(REQ_DOWNLOAD), &tcp->header);
+    if (tcp->wav_fd < 0) {
+        err = printf("Couldn't read audio file. Closing connection\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        endTcp(loop, tcp);
+        return;
+    }
+    tcp->data_offset = lseek(tcp->wav_fd, 0, SEEK_CUR);
+    errorHandler(tcp->data_offset, "Could not get offset of audio data");
+    err = fstat(tcp->wav_fd, &st);
+    errorHandler(err, "Could not stat audio file");
+    tcp->size = st.st_size;
+
+    err = ev_add(loop, fd, EV_WRITE, onTcpWritable, tcp);
+    errorHandler(err, "Could not watch a TCP connection");
+    armTcpTimeout(loop, tcp);
+}
+
+// Accepts a download connection on the TCP socket and waits for its request, REQUEST_TIMEOUT seconds at most
+void onTcpConnection(EvLoop * loop, int tcp_fd, int events, void * arg) {
+    struct tcp * tcp;
+    Arena * arena;
+    int conn, err;
+
+    conn = accept4(tcp_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0) {
+        return;
+    }
+    setBulkBuffers(conn);
+    arena = arena_new();
+    if (arena == NULL || (tcp = arena_alloc(arena, sizeof(struct tcp))) == NULL) {
+        err = printf("Out of memory for sessions. Ignoring TCP request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+        if (arena != NULL) {
+            arena_free(arena);
+        }
+        close(conn);
+        return;
+    }
+    tcp->arena = arena;
+    tcp->conn = conn;
+    tcp->wav_fd = tcp->timer = -1;
+    if (ev_add(loop, conn, EV_READ, onTcpRequest, tcp) < 0) {
+        close(conn);
+        arena_free(arena);
+        return;
+    }
+    armTcpTimeout(loop, tcp);
+}
+
+// A request came in on the UDP socket: start its session, the event loop drives it from here
+// While a session is under way, datagrams on the socket go to it instead
+void onRequest(EvLoop * loop, int fd, int events, void * arg) {
+    int err, name;
+    unsigned int first, count;
+    unsigned long long token;
+    char filename[MAXPACKET + 1];
     struct sockaddr_in from;
     socklen_t fromlen;
-    
+
+    if (active != NULL) {
+        onSessionDatagrams(loop, fd);
+        return;
+    }
+
+    // Read filename
     fromlen = sizeof(struct sockaddr_in);
+    err = recvfrom(fd, filename, MAXPACKET, 0, (struct sockaddr*) &from, &fromlen);
+    errorHandler(err, "Something went wrong when receiving message from client");
+    filename[err] = '\0';
 
-    // Create socket and bind
-    fd = createSocket();
-    bindSocket(fd);
+    if (strncmp(filename, "ACK", 3) == 0 || strcmp(filename, "STOP") == 0) { // Don't do anything when rogue ACKs or STOPs come in
+        return;
+    }
 
-    // Listen for requests
-    while (1) {
-        err = printf("Listening for requests on port %d\n", PORT);
-
-        // Read filename
-        err = recvfrom(fd, filename, SIZE, 0, (struct sockaddr*) &from, &fromlen);
-        errorHandler(err, "Something went wrong when receiving message from client");
-        
-        if (strcmp(filename, "ACK") != 0) { // Don't do anything when rogue ACKs come in
-            err = printf("Received request for filename: %s\n", filename);
+    // Encrypted session: the actual request is sealed behind the hello
+    session = NULL;
+    if (err >= (int) sizeof(struct secure_hello) && strcmp(filename, SECURE_TAG) == 0) {
+        if (openSecureRequest(filename, err) < 0) {
+            err = printf("Rejected encrypted request that does not carry our key\n");
             errorHandler(err, "Something went wrong when printing to stdout");
+            return;
+        }
+        err = printf("Encrypted session started\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+    }
+
+    if (strncmp(filename, REQ_DOWNLOAD, strlen(REQ_DOWNLOAD)) == 0) {
+        err = printf("Received download request for filename: %s\n", filename + strlen(REQ_DOWNLOAD));
+        errorHandler(err, "Something went wrong when printing to stdout");
+
+        // Send the whole file without realtime pacing
+        downloadAudio(loop, fd, filename + strlen(REQ_DOWNLOAD), from, 0, UINT32_MAX);
+    } else if (strncmp(filename, REQ_RANGE, strlen(REQ_RANGE)) == 0 &&
+            sscanf(filename + strlen(REQ_RANGE), "%u %u %n", &first, &count, &name) == 2) {
+        err = printf("Received request for packets %u to %u of filename: %s\n", first, first + count, filename + strlen(REQ_RANGE) + name);
+        errorHandler(err, "Something went wrong when printing to stdout");
+
+        // Send part of a file, for a client that fetches the rest from other mirrors
+        downloadAudio(loop, fd, filename + strlen(REQ_RANGE) + name, from, first, count);
+    } else if (sscanf(filename, REQ_RESUME "%llu %u", &token, &first) == 2) {
+        err = printf("Received request to resume a stream\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+
+        // Continue a stream that timed out, possibly at a new address
+        resumeAudio(loop, fd, token, first, from);
+    } else if (strncmp(filename, REQ_PLAYLIST, strlen(REQ_PLAYLIST)) == 0) {
+        err = printf("Received playlist request\n");
+        errorHandler(err, "Something went wrong when printing to stdout");
+
+        // Stream all tracks in one session
+        streamPlaylist(loop, fd, filename + strlen(REQ_PLAYLIST), from);
+    } else {
+        err = printf("Received request for filename: %s\n", filename);
+        errorHandler(err, "Something went wrong when printing to stdout");
+
+        // Stream audio to client
+        streamAudio(loop, fd, filename, from);
+    }
+
+    // The request was turned down
+    if (active == NULL) {
+        printListening();
+    }
+}
 
-            // Stream audio to client
-            streamAudio(fd, filename, from);
+int main(int argc, char ** argv) {
+    int fd, tcp_fd, local_fd, err, opt;
+    EvLoop * loop;
+
+    // -k <keyfile> enables encrypted sessions for clients holding the same pre-shared key
+    // -p <port> listens on another port, e.g. behind an impairment proxy on the usual one
+    while ((opt = getopt(argc, argv, "k:p:")) != -1) {
+        switch (opt) {
+            case 'k':
+                errorHandler(crypto_loadkey(optarg, psk), "Could not load pre-shared key");
+                have_psk = 1;
+                break;
+            case 'p':
+                PORT = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: audioserver [-k <keyfile>] [-p <port>]\n");
+                return 1;
         }
-        
     }
 
-    // Close server socket
+    // A client closing its TCP download early should not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Sessions run side by side, so their progress shows up in the log as it happens
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // All session state comes from the pool, so memory stays bounded however many streams are parked
+    errorHandler(pool_init(POOL_BUFFERS), "Could not map the packet buffer pool");
+
+    // Create sockets and bind
+    fd = createSocket();
+    bindSocket(fd);
+    setBulkBuffers(fd);
+    tcp_fd = createTcpSocket();
+    bindSocket(tcp_fd);
+    err = listen(tcp_fd, 16);
+    errorHandler(err, "Could not listen on TCP socket");
+    local_fd = createLocalSocket();
+
+    // EVLOOP in the environment picks the backend
+    loop = ev_new(EV_DEFAULT);
+    errorHandler(loop == NULL ? -1 : 0, "Could not create the event loop, is EVLOOP one of select, poll, epoll or uring?");
+    err = ev_add(loop, fd, EV_READ, onRequest, NULL);
+    errorHandler(err, "Could not watch the UDP socket");
+    err = ev_add(loop, tcp_fd, EV_READ, onTcpConnection, NULL);
+    errorHandler(err, "Could not watch the TCP socket");
+    err = ev_add(loop, local_fd, EV_READ, onLocalConnection, NULL);
+    errorHandler(err, "Could not watch the Unix socket");
+
+    // Listen for requests. Every session runs from here, UDP, TCP and local ones alike
+    printListening();
+    err = ev_run(loop);
+    errorHandler(err, "Something went wrong when waiting for requests");
+
+    // Close server sockets
+    ev_free(loop);
+    err = close(local_fd);
+    errorHandler(err, "Something went wrong when closing Unix socket file descriptor");
+    unlink(LOCAL_SOCKET);
+    err = close(tcp_fd);
+    errorHandler(err, "Something went wrong when closing TCP file descriptor");
     err = close(fd);
     errorHandler(err, "Something went wrong when closing network file descriptor");
     return 0;
-}
\ No newline at end of file
+}
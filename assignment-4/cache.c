@@ -0,0 +1,218 @@
+/* cache.[ch]
+ *
+ * on-disk track cache of the audio client
+ * */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "audio.h"
+#include "cache.h"
+
+#define PART_SUFFIX	".part"
+
+typedef struct _cacheentry {
+  char		name[256];
+  off_t		size;
+  time_t	used;
+} CacheEntry;
+
+/* 64-bit FNV-1a, continued from hash */
+static uint64_t fnv1a (uint64_t hash, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+
+  while (len--) {
+    hash ^= *p++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/* hash of a track, whatever its version */
+static uint64_t track_hash (char *host, char *filename)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  /* the terminating NULs separate the fields, so "a"+"bc" and "ab"+"c" differ */
+  hash = fnv1a (hash, host, strlen(host) + 1);
+  return fnv1a (hash, filename, strlen(filename) + 1);
+}
+
+int cache_path (char *path, int len, char *dir, char *host, char *filename, int64_t mtime, uint32_t packets)
+{
+  uint64_t hash = track_hash (host, filename);
+
+  hash = fnv1a (hash, &mtime, sizeof(mtime));
+  hash = fnv1a (hash, &packets, sizeof(packets));
+
+  if (snprintf (path, len, "%s/%016llx.wav", dir, (unsigned long long) hash) >= len)
+    return -1;
+  return 0;
+}
+
+int cache_alias (char *alias, int len, char *dir, char *host, char *filename)
+{
+  if (snprintf (alias, len, "%s/%016llx.lnk", dir, (unsigned long long) track_hash (host, filename)) >= len)
+    return -1;
+  return 0;
+}
+
+int cache_fresh (char *alias, char *path, int len, char *dir, long max_age)
+{
+  struct stat st;
+  char target[256];
+  ssize_t n;
+
+  /* the alias is a symlink to the entry, replaced whenever the server confirms one */
+  if (lstat (alias, &st) != 0 || time (NULL) - st.st_mtime > max_age)
+    return 0;
+  if ((n = readlink (alias, target, sizeof(target) - 1)) < 0)
+    return 0;
+  target[n] = '\0';
+  if (snprintf (path, len, "%s/%s", dir, target) >= len)
+    return 0;
+  return cache_lookup (path);
+}
+
+void cache_confirm (char *alias, char *path)
+{
+  char part[4096];
+  char *name = strrchr (path, '/');
+
+  /* a new link renamed over the old one, so a reader never sees the alias missing */
+  name = name != NULL ? name + 1 : path;
+  snprintf (part, sizeof(part), "%s" PART_SUFFIX, alias);
+  unlink (part);
+  if (symlink (name, part) != 0 || rename (part, alias) != 0)
+    unlink (part);
+}
+
+int cache_lookup (char *path)
+{
+  struct stat st;
+
+  if (stat (path, &st) != 0 || !S_ISREG(st.st_mode))
+    return 0;
+  /* touch the entry, it is now the most recently used one */
+  utime (path, NULL);
+  return 1;
+}
+
+int cache_create (char *path, int sample_rate, int sample_size, int channels)
+{
+  char part[4096];
+
+  if (snprintf (part, sizeof(part), "%s" PART_SUFFIX, path) >= (int) sizeof(part))
+    return -1;
+  return aud_wavinit (part, sample_rate, sample_size, channels);
+}
+
+int cache_commit (int fd, char *path, unsigned int data_length, char *dir, long long limit)
+{
+  char part[4096];
+
+  snprintf (part, sizeof(part), "%s" PART_SUFFIX, path);
+  if (aud_wavfinish (fd, data_length) < 0) {
+    cache_abort (fd, path);
+    return -1;
+  }
+  close (fd);
+  if (rename (part, path) != 0) {
+    perror ("cache : rename ");
+    unlink (part);
+    return -1;
+  }
+  return cache_evict (dir, limit) < 0 ? -1 : 0;
+}
+
+void cache_abort (int fd, char *path)
+{
+  char part[4096];
+
+  close (fd);
+  snprintf (part, sizeof(part), "%s" PART_SUFFIX, path);
+  unlink (part);
+}
+
+/* a name cache_path or cache_alias makes: 16 lowercase hex digits and suffix.
+ * Other files in the directory, a user's own tracks say, are never evicted */
+static int is_cache_name (const char *name, const char *suffix)
+{
+  int i;
+
+  for (i = 0; i < 16; i++)
+    if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+      return 0;
+  return 0 == strcmp (name + 16, suffix);
+}
+
+static int cmp_used (const void *a, const void *b)
+{
+  const CacheEntry *ea = a, *eb = b;
+
+  return (ea->used > eb->used) - (ea->used < eb->used);
+}
+
+long long cache_evict (char *dir, long long limit)
+{
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+  CacheEntry *entries = NULL, *grown;
+  int count = 0, capacity = 0, i;
+  long long total = 0;
+  char path[4096];
+
+  if (NULL == (d = opendir (dir))) {
+    perror ("cache : opendir ");
+    return -1;
+  }
+
+  /* collect the finished entries, in-progress ones are left alone */
+  while (NULL != (de = readdir (d))) {
+    snprintf (path, sizeof(path), "%s/%s", dir, de->d_name);
+    /* an alias of an evicted entry names nothing any more */
+    if (is_cache_name (de->d_name, ".lnk") && stat (path, &st) != 0) {
+      unlink (path);
+      continue;
+    }
+    if (!is_cache_name (de->d_name, ".wav"))
+      continue;
+    if (stat (path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      if (NULL == (grown = realloc (entries, capacity * sizeof(CacheEntry)))) {
+        free (entries);
+        closedir (d);
+        return -1;
+      }
+      entries = grown;
+    }
+    strcpy (entries[count].name, de->d_name);
+    entries[count].size = st.st_size;
+    entries[count].used = st.st_mtime;
+    total += st.st_size;
+    count++;
+  }
+  closedir (d);
+
+  /* oldest first */
+  qsort (entries, count, sizeof(CacheEntry), cmp_used);
+  for (i = 0; i < count && total > limit; i++) {
+    snprintf (path, sizeof(path), "%s/%s", dir, entries[i].name);
+    if (unlink (path) == 0)
+      total -= entries[i].size;
+  }
+
+  free (entries);
+  return total;
+}
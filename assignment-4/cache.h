@@ -0,0 +1,102 @@
+/* cache.[ch]
+ *
+ * on-disk track cache of the audio client
+ *
+ * every cached track is a complete WAV-file in the cache directory. Its name is a
+ * hash of the server, the filename and the modification time and size the server
+ * reported in the audio header, so a changed file on the server never hits a stale
+ * entry. The modification time of the cache file itself records the last time it
+ * was played and drives LRU eviction.
+ *
+ * next to the entries, an alias per track names the entry the server last confirmed
+ * as current, and its own modification time records when. Within a max-age of that
+ * the track is played from the cache without asking the server at all; after it the
+ * server is asked for the header again, which revalidates the entry or replaces it.
+ * */
+
+#include <stdint.h>
+
+/** build the path of the cache entry for a track
+ *
+ * @param path		buffer receiving the path
+ * @param len		size of the buffer
+ * @param dir		the cache directory
+ * @param host, filename	the server and the track requested from it
+ * @param mtime, packets	the modification time and size reported by the server
+ * @return 0 on success, <0 if the path does not fit in the buffer
+ */
+int cache_path (char *path, int len, char *dir, char *host, char *filename, int64_t mtime, uint32_t packets);
+
+/** build the path of the alias of a track
+ *
+ * the alias does not depend on the version of the track, so it can be looked up
+ * before the server is asked anything.
+ *
+ * @param alias		buffer receiving the path
+ * @param len		size of the buffer
+ * @param dir		the cache directory
+ * @param host, filename	the server and the track requested from it
+ * @return 0 on success, <0 if the path does not fit in the buffer
+ */
+int cache_alias (char *alias, int len, char *dir, char *host, char *filename);
+
+/** look up the entry an alias names, if the server confirmed it at most max_age seconds ago
+ *
+ * on a hit the entry is marked as most recently used.
+ *
+ * @param alias	a path built by cache_alias
+ * @param path	buffer receiving the path of the entry
+ * @param len	size of the buffer
+ * @param dir	the cache directory
+ * @return 1 if a fresh entry is cached, 0 if it is not
+ */
+int cache_fresh (char *alias, char *path, int len, char *dir, long max_age);
+
+/** record that the server confirmed the entry at path as the current version of the track of alias */
+void cache_confirm (char *alias, char *path);
+
+/** look up a cache entry
+ *
+ * on a hit the entry is marked as most recently used.
+ *
+ * @param path	a path built by cache_path
+ * @return 1 if the track is cached, 0 if it is not
+ */
+int cache_lookup (char *path);
+
+/** start filling a cache entry while the track streams in
+ *
+ * the data goes into a temporary file next to the entry, so an interrupted stream
+ * never leaves a truncated track behind.
+ *
+ * @param path	a path built by cache_path
+ * @params sample_rate, sample_size, channels: see aud_readinit in audio.h
+ * @return a descriptor to write the PCM data to, <0 on failure
+ */
+int cache_create (char *path, int sample_rate, int sample_size, int channels);
+
+/** complete a cache entry started with cache_create
+ *
+ * finishes and publishes the entry, then evicts the least recently used entries
+ * until the cache directory holds at most limit bytes. The descriptor is closed.
+ *
+ * @param fd		a descriptor returned by cache_create
+ * @param path		the path given to cache_create
+ * @param data_length	the number of PCM bytes written to fd
+ * @param dir		the cache directory
+ * @param limit		the maximum size of the cache in bytes
+ * @return 0 on success, <0 on failure
+ */
+int cache_commit (int fd, char *path, unsigned int data_length, char *dir, long long limit);
+
+/** throw away a cache entry started with cache_create. The descriptor is closed. */
+void cache_abort (int fd, char *path);
+
+/** evict least recently used entries until dir holds at most limit bytes
+ *
+ * only files named like cache_path names them count as entries; anything else in
+ * dir is neither counted nor removed. Aliases whose entry is gone are removed.
+ *
+ * @return the number of bytes left in the cache, <0 on failure
+ */
+long long cache_evict (char *dir, long long limit);
@@ -0,0 +1,194 @@
+/* conceal.[ch]
+ *
+ * packet loss concealment for streamed PCM audio
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "conceal.h"
+
+static int supported (Concealer *c)
+{
+  return (c->sample_size == 8 || c->sample_size == 16) && c->channels > 0;
+}
+
+static int frame_bytes (Concealer *c)
+{
+  return (c->sample_size / 8) * c->channels;
+}
+
+/* sample i of buf, scaled to the range of 16 bit audio. 8 bit PCM is unsigned */
+static float load (Concealer *c, char *buf, int i)
+{
+  int16_t s;
+
+  if (c->sample_size == 8)
+    return (((unsigned char *) buf)[i] - 128) * 256.0f;
+  memcpy (&s, buf + 2*i, sizeof(s));
+  return s;
+}
+
+static void store (Concealer *c, char *buf, int i, float v)
+{
+  int16_t s;
+
+  if (v > 32767.0f)
+    v = 32767.0f;
+  if (v < -32768.0f)
+    v = -32768.0f;
+  if (c->sample_size == 8) {
+    ((unsigned char *) buf)[i] = (int) (v / 256.0f) + 128;
+    return;
+  }
+  s = (int16_t) v;
+  memcpy (buf + 2*i, &s, sizeof(s));
+}
+
+/* append n frames of buf to the history */
+static void remember (Concealer *c, char *buf, int n)
+{
+  int ch = c->channels, i;
+
+  if (n > c->frames) {
+    buf += (n - c->frames) * frame_bytes (c);
+    n = c->frames;
+  }
+  memmove (c->history, c->history + n*ch, (c->frames - n) * ch * sizeof(float));
+  for (i = 0; i < n*ch; i++)
+    c->history[(c->frames - n)*ch + i] = load (c, buf, i);
+}
+
+/* a gap starts: find the pitch period at the end of the history and prepare it for repetition */
+static void start_gap (Concealer *c)
+{
+  int ch = c->channels, n = c->frames, best = c->max_pitch, p, i, k, ov;
+  float *h = c->history, *x = h + (n - c->match)*ch, *y, w;
+  double corr, energy, score, best_score = 0;
+
+  /* the lag with the highest normalised correlation, compared squared to avoid a sqrt */
+  for (p = c->min_pitch; p <= c->max_pitch; p++) {
+    y = x - p*ch;
+    corr = energy = 0;
+    for (i = 0; i < c->match*ch; i++) {
+      corr += x[i] * y[i];
+      energy += y[i] * y[i];
+    }
+    if (corr <= 0 || energy == 0)
+      continue;
+    score = corr * corr / energy;
+    if (score > best_score) {
+      best_score = score;
+      best = p;
+    }
+  }
+
+  /* the last period, with its last quarter blended into the audio that preceded its first frame,
+   * so the end of the cycle runs smoothly into its start */
+  p = best;
+  ov = p / 4;
+  memcpy (c->cycle, h + (n - p)*ch, p * ch * sizeof(float));
+  for (k = p - ov; k < p; k++) {
+    w = (float) (k - (p - ov) + 1) / (ov + 1);
+    for (i = 0; i < ch; i++)
+      c->cycle[k*ch + i] = (1 - w) * h[(n - p + k)*ch + i] + w * h[(n - 2*p + k)*ch + i];
+  }
+  c->period = p;
+  c->pos = 0;
+  c->erased = 0;
+}
+
+/* next frame of the concealment, faded out once the gap gets long */
+static void next_frame (Concealer *c, float *frame)
+{
+  float gain = 1;
+  int i;
+
+  if (c->erased >= c->hold + c->decay)
+    gain = 0;
+  else if (c->erased > c->hold)
+    gain = 1 - (float) (c->erased - c->hold) / c->decay;
+  for (i = 0; i < c->channels; i++)
+    frame[i] = gain * c->cycle[c->pos*c->channels + i];
+  c->pos = (c->pos + 1) % c->period;
+  c->erased++;
+}
+
+int conceal_init (Concealer *c, int sample_rate, int sample_size, int channels)
+{
+  memset (c, 0, sizeof(Concealer));
+  c->sample_size = sample_size;
+  c->channels = channels;
+  if (!supported (c) || sample_rate < 1000)
+    return 0;
+
+  /* pitch between 66 and 400 Hz, a 5 ms match window and crossfade, fade out from 20 to 80 ms */
+  c->min_pitch = sample_rate / 400;
+  c->max_pitch = sample_rate * 15 / 1000;
+  c->match = sample_rate / 200;
+  c->fade = sample_rate / 200;
+  c->hold = sample_rate / 50;
+  c->decay = sample_rate * 6 / 100;
+  c->frames = 2 * c->max_pitch;
+
+  c->history = calloc (c->frames * channels, sizeof(float));
+  c->cycle = calloc (c->max_pitch * channels, sizeof(float));
+  if (c->history == NULL || c->cycle == NULL) {
+    conceal_free (c);
+    return -1;
+  }
+  return 0;
+}
+
+void conceal_free (Concealer *c)
+{
+  free (c->history);
+  free (c->cycle);
+  c->history = c->cycle = NULL;
+}
+
+void conceal_play (Concealer *c, char *buf, int len)
+{
+  float frame[c->channels > 0 ? c->channels : 1], w, v;
+  int n, i, j;
+
+  if (c->history == NULL)
+    return;
+  n = len / frame_bytes (c);
+
+  if (c->period > 0) {
+    for (i = 0; i < c->fade && i < n; i++) {
+      w = (float) (i + 1) / (c->fade + 1);
+      next_frame (c, frame);
+      for (j = 0; j < c->channels; j++) {
+	v = load (c, buf, i*c->channels + j);
+	store (c, buf, i*c->channels + j, w * v + (1 - w) * frame[j]);
+      }
+    }
+    c->period = 0;
+  }
+  remember (c, buf, n);
+}
+
+void conceal_fill (Concealer *c, char *buf, int len)
+{
+  float frame[c->channels > 0 ? c->channels : 1];
+  int n, i, j;
+
+  if (c->history == NULL) {
+    memset (buf, c->sample_size == 8 ? 128 : 0, len);
+    return;
+  }
+  n = len / frame_bytes (c);
+
+  /* a gap that spans several packets keeps repeating the same period */
+  if (c->period == 0)
+    start_gap (c);
+  for (i = 0; i < n; i++) {
+    next_frame (c, frame);
+    for (j = 0; j < c->channels; j++)
+      store (c, buf, i*c->channels + j, frame[j]);
+  }
+  memset (buf + n * frame_bytes (c), c->sample_size == 8 ? 128 : 0, len - n * frame_bytes (c));
+  remember (c, buf, n);
+}
@@ -0,0 +1,49 @@
+/* conceal.[ch]
+ *
+ * packet loss concealment for streamed PCM audio
+ *
+ * the audio played last is kept in a short history. When packets are lost, the gap
+ * is filled by repeating the last pitch period of the history. The period is the lag
+ * at which the end of the history best matches an earlier stretch of it (the waveform
+ * similarity search of WSOLA), and its end is overlap-added with the period before it,
+ * so it can be repeated without a click. A gap is concealed at full volume for its
+ * first 20 ms and then fades out to silence over the next 60 ms, and the first real
+ * audio after a gap is crossfaded with the continuation of the concealment.
+ *
+ * only 8 and 16 bit PCM is concealed, gaps in other formats are filled with silence.
+ * */
+
+typedef struct _concealer {
+  int		sample_size;	/* bits per sample */
+  int		channels;
+  int		frames;		/* frames of history kept */
+  int		min_pitch, max_pitch;	/* range of the pitch search, in frames */
+  int		match;		/* frames compared by the pitch search */
+  int		fade;		/* frames of crossfade into real audio */
+  int		hold, decay;	/* frames a gap is concealed at full volume, then faded out over */
+  float		*history;	/* interleaved samples, oldest first */
+  float		*cycle;		/* the period repeated during a gap */
+  int		period;		/* frames in cycle, 0 while no gap is concealed */
+  int		pos;		/* next frame of cycle */
+  int		erased;		/* frames synthesised since the gap started */
+} Concealer;
+
+/** set up concealment for a stream
+ *
+ * @params sample_rate, sample_size, channels: see aud_readinit in audio.h
+ * @return 0 on success, <0 on failure
+ */
+int conceal_init (Concealer *c, int sample_rate, int sample_size, int channels);
+
+/** release the buffers of a concealer */
+void conceal_free (Concealer *c);
+
+/** pass real audio on its way to the audio device
+ *
+ * the audio is remembered for the pitch search. After a gap, the start of buf is
+ * crossfaded in place with the continuation of the concealment.
+ */
+void conceal_play (Concealer *c, char *buf, int len);
+
+/** fill buf with len bytes of audio in place of a lost packet */
+void conceal_fill (Concealer *c, char *buf, int len);
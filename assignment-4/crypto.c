@@ -0,0 +1,383 @@
+/* crypto.[ch]
+ *
+ * authenticated encryption of audio datagrams
+ * */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/random.h>
+#include "crypto.h"
+
+typedef uint32_t u32x4 __attribute__ ((vector_size (16)));
+typedef uint32_t u32x8 __attribute__ ((vector_size (32)));
+typedef unsigned __int128 u128;
+
+#define DIR_SERVER	1
+#define DIR_CLIENT	2
+
+static uint32_t le32 (const uint8_t *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof(v));	/* x86 and ARM Linux are little endian */
+  return v;
+}
+
+static uint64_t le64 (const uint8_t *p)
+{
+  uint64_t v;
+  memcpy (&v, p, sizeof(v));
+  return v;
+}
+
+/* ---------------------------------------------------------------- ChaCha20 */
+
+#define ROTL(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d) \
+  a += b; d ^= a; d = ROTL(d, 16); \
+  c += d; b ^= c; b = ROTL(b, 12); \
+  a += b; d ^= a; d = ROTL(d, 8); \
+  c += d; b ^= c; b = ROTL(b, 7)
+#define DOUBLEROUNDS(x) \
+  for (i = 0; i < 10; i++) { \
+    QR(x[0], x[4], x[8],  x[12]); QR(x[1], x[5], x[9],  x[13]); \
+    QR(x[2], x[6], x[10], x[14]); QR(x[3], x[7], x[11], x[15]); \
+    QR(x[0], x[5], x[10], x[15]); QR(x[1], x[6], x[11], x[12]); \
+    QR(x[2], x[7], x[8],  x[13]); QR(x[3], x[4], x[9],  x[14]); \
+  }
+
+/* XOR LANES consecutive keystream blocks into in, starting at the block counter
+ * in state[12]. Lane j of every vector holds the state of block j, so all blocks
+ * go through the rounds together. */
+#define CHACHA_XOR(name, vec, lanes, attr) \
+attr static void name (uint32_t state[16], uint8_t *out, const uint8_t *in) \
+{ \
+  vec x[16], orig[16]; \
+  uint32_t w; \
+  int i, j; \
+  for (i = 0; i < 16; i++) \
+    orig[i] = (vec) {0} + state[i]; \
+  for (j = 0; j < lanes; j++) \
+    orig[12][j] += j; \
+  memcpy (x, orig, sizeof(x)); \
+  DOUBLEROUNDS(x); \
+  for (i = 0; i < 16; i++) \
+    x[i] += orig[i]; \
+  for (j = 0; j < lanes; j++) \
+    for (i = 0; i < 16; i++) { \
+      w = le32 (in + 64*j + 4*i) ^ x[i][j]; \
+      memcpy (out + 64*j + 4*i, &w, sizeof(w)); \
+    } \
+  state[12] += lanes; \
+}
+
+CHACHA_XOR(chacha_xor4, u32x4, 4, )
+CHACHA_XOR(chacha_xor8, u32x8, 8, __attribute__ ((target ("avx2"))))
+
+static void chacha_init (uint32_t state[16], const uint8_t key[32], uint32_t counter, const uint8_t nonce[12])
+{
+  int i;
+
+  state[0] = 0x61707865;	/* "expand 32-byte k" */
+  state[1] = 0x3320646e;
+  state[2] = 0x79622d32;
+  state[3] = 0x6b206574;
+  for (i = 0; i < 8; i++)
+    state[4 + i] = le32 (key + 4*i);
+  state[12] = counter;
+  for (i = 0; i < 3; i++)
+    state[13 + i] = le32 (nonce + 4*i);
+}
+
+static void chacha20_xor (uint8_t *out, const uint8_t *in, size_t len,
+			  const uint8_t key[32], uint32_t counter, const uint8_t nonce[12])
+{
+  static int avx2 = -1;
+  uint32_t state[16];
+  uint8_t tail[512];
+
+  if (avx2 < 0)
+    avx2 = __builtin_cpu_supports ("avx2");
+
+  chacha_init (state, key, counter, nonce);
+  if (avx2)
+    for (; len >= 512; len -= 512, in += 512, out += 512)
+      chacha_xor8 (state, out, in);
+  for (; len >= 256; len -= 256, in += 256, out += 256)
+    chacha_xor4 (state, out, in);
+  if (len) {
+    memset (tail, 0, 256);
+    memcpy (tail, in, len);
+    chacha_xor4 (state, tail, tail);
+    memcpy (out, tail, len);
+  }
+}
+
+/* HChaCha20: a PRF from a 32 byte key and 16 byte input to a 32 byte key */
+static void hchacha20 (uint8_t out[32], const uint8_t key[32], const uint8_t in[16])
+{
+  uint32_t x[16];
+  int i;
+
+  chacha_init (x, key, le32 (in), in + 4);
+  DOUBLEROUNDS(x);
+  memcpy (out, x, 16);
+  memcpy (out + 16, x + 12, 16);
+}
+
+/* ---------------------------------------------------------------- Poly1305 */
+
+/* 64-bit limbs of 44, 44 and 42 bits, as in poly1305-donna */
+typedef struct _poly1305 {
+  uint64_t	r[3], s[2], h[3];
+  uint8_t	pad[16];
+} Poly1305;
+
+#define M44	0xfffffffffffULL
+#define M42	0x3ffffffffffULL
+
+static void poly1305_init (Poly1305 *p, const uint8_t key[32])
+{
+  uint64_t t0 = le64 (key), t1 = le64 (key + 8);
+
+  p->r[0] = t0 & 0xffc0fffffffULL;
+  p->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+  p->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+  p->s[0] = p->r[1] * (5 << 2);
+  p->s[1] = p->r[2] * (5 << 2);
+  p->h[0] = p->h[1] = p->h[2] = 0;
+  memcpy (p->pad, key + 16, 16);
+}
+
+/* absorb len bytes, zero-padding the last block to 16 bytes as the AEAD construction does */
+static void poly1305_update (Poly1305 *p, const uint8_t *m, size_t len)
+{
+  uint64_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], s1 = p->s[0], s2 = p->s[1];
+  uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], t0, t1, c;
+  uint8_t block[16];
+  u128 d0, d1, d2;
+
+  while (len > 0) {
+    if (len < 16) {
+      memset (block, 0, sizeof(block));
+      memcpy (block, m, len);
+      m = block;
+      len = 16;
+    }
+    t0 = le64 (m);
+    t1 = le64 (m + 8);
+    h0 += t0 & M44;
+    h1 += ((t0 >> 44) | (t1 << 20)) & M44;
+    h2 += ((t1 >> 24) & M42) | (1ULL << 40);
+
+    d0 = (u128) h0*r0 + (u128) h1*s2 + (u128) h2*s1;
+    d1 = (u128) h0*r1 + (u128) h1*r0 + (u128) h2*s2;
+    d2 = (u128) h0*r2 + (u128) h1*r1 + (u128) h2*r0;
+
+    c = (uint64_t) (d0 >> 44); h0 = (uint64_t) d0 & M44;
+    d1 += c; c = (uint64_t) (d1 >> 44); h1 = (uint64_t) d1 & M44;
+    d2 += c; c = (uint64_t) (d2 >> 42); h2 = (uint64_t) d2 & M42;
+    h0 += c * 5; c = h0 >> 44; h0 &= M44;
+    h1 += c;
+
+    m += 16;
+    len -= 16;
+  }
+  p->h[0] = h0; p->h[1] = h1; p->h[2] = h2;
+}
+
+static void poly1305_finish (Poly1305 *p, uint8_t tag[16])
+{
+  uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], g0, g1, g2, c, mask, t0, t1;
+
+  c = h1 >> 44; h1 &= M44; h2 += c;
+  c = h2 >> 42; h2 &= M42; h0 += c * 5;
+  c = h0 >> 44; h0 &= M44; h1 += c;
+  c = h1 >> 44; h1 &= M44; h2 += c;
+  c = h2 >> 42; h2 &= M42; h0 += c * 5;
+  c = h0 >> 44; h0 &= M44; h1 += c;
+
+  /* h - p, kept only if h >= p */
+  g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+  g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+  g2 = h2 + c - (1ULL << 42);
+  mask = (g2 >> 63) - 1;
+  h0 = (h0 & ~mask) | (g0 & mask);
+  h1 = (h1 & ~mask) | (g1 & mask);
+  h2 = (h2 & ~mask) | (g2 & mask);
+
+  t0 = le64 (p->pad);
+  t1 = le64 (p->pad + 8);
+  h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+  h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+  h2 += ((t1 >> 24) & M42) + c; h2 &= M42;
+
+  t0 = h0 | (h1 << 44);
+  t1 = (h1 >> 20) | (h2 << 24);
+  memcpy (tag, &t0, 8);
+  memcpy (tag + 8, &t1, 8);
+}
+
+/* ---------------------------------------------------------------- AEAD */
+
+static void aead_tag (uint8_t tag[16], const uint8_t *ct, size_t len, const uint8_t *aad, size_t aadlen,
+		      const uint8_t key[32], const uint8_t nonce[12])
+{
+  uint8_t polykey[64] = {0};
+  uint64_t lengths[2] = {aadlen, len};
+  Poly1305 p;
+
+  /* the one-time Poly1305 key is keystream block 0 */
+  chacha20_xor (polykey, polykey, sizeof(polykey), key, 0, nonce);
+  poly1305_init (&p, polykey);
+  poly1305_update (&p, aad, aadlen);
+  poly1305_update (&p, ct, len);
+  poly1305_update (&p, (uint8_t *) lengths, sizeof(lengths));
+  poly1305_finish (&p, tag);
+}
+
+void aead_seal (uint8_t *ct, uint8_t tag[CRYPTO_TAGBYTES], const uint8_t *pt, size_t len,
+		const uint8_t *aad, size_t aadlen,
+		const uint8_t key[CRYPTO_KEYBYTES], const uint8_t nonce[12])
+{
+  chacha20_xor (ct, pt, len, key, 1, nonce);
+  aead_tag (tag, ct, len, aad, aadlen, key, nonce);
+}
+
+int aead_open (uint8_t *pt, const uint8_t tag[CRYPTO_TAGBYTES], const uint8_t *ct, size_t len,
+	       const uint8_t *aad, size_t aadlen,
+	       const uint8_t key[CRYPTO_KEYBYTES], const uint8_t nonce[12])
+{
+  uint8_t expected[CRYPTO_TAGBYTES], diff = 0;
+  int i;
+
+  aead_tag (expected, ct, len, aad, aadlen, key, nonce);
+  for (i = 0; i < CRYPTO_TAGBYTES; i++)
+    diff |= expected[i] ^ tag[i];
+  if (diff)
+    return -1;
+  chacha20_xor (pt, ct, len, key, 1, nonce);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- sessions */
+
+int crypto_loadkey (char *filename, uint8_t key[CRYPTO_KEYBYTES])
+{
+  int fd, len;
+
+  if (0 > (fd = open (filename, O_RDONLY))) {
+    perror ("crypto : open key ");
+    return -1;
+  }
+  len = read (fd, key, CRYPTO_KEYBYTES);
+  close (fd);
+  if (len != CRYPTO_KEYBYTES) {
+    fprintf (stderr, "crypto : key file must hold %d bytes\n", CRYPTO_KEYBYTES);
+    return -1;
+  }
+  return 0;
+}
+
+void crypto_random (void *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = getrandom (buf, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror ("crypto : getrandom ");
+      exit (1);
+    }
+    buf = (uint8_t *) buf + n;
+    len -= n;
+  }
+}
+
+void crypto_session (CryptoSession *s, const uint8_t psk[CRYPTO_KEYBYTES],
+		     const uint8_t client_nonce[CRYPTO_NONCEBYTES],
+		     const uint8_t server_nonce[CRYPTO_NONCEBYTES], int is_server)
+{
+  uint8_t k1[CRYPTO_KEYBYTES];
+
+  hchacha20 (k1, psk, client_nonce);
+  hchacha20 (s->key, k1, server_nonce);
+  memset (k1, 0, sizeof(k1));
+
+  s->send_dir = is_server ? DIR_SERVER : DIR_CLIENT;
+  s->recv_dir = is_server ? DIR_CLIENT : DIR_SERVER;
+  s->send_seq = 1;	/* 0 is left for crypto_seal_seq */
+  s->recv_max = 0;
+  s->recv_window = 0;
+}
+
+static void make_nonce (uint8_t nonce[12], uint32_t dir, uint64_t seq)
+{
+  memcpy (nonce, &dir, 4);
+  memcpy (nonce + 4, &seq, 8);
+}
+
+int crypto_seal_seq (CryptoSession *s, uint64_t seq, void *out, const void *in, int len)
+{
+  uint8_t nonce[12], *o = out;
+
+  make_nonce (nonce, s->send_dir, seq);
+  memcpy (o, &seq, 8);
+  aead_seal (o + 8, o + 8 + len, in, len, NULL, 0, s->key, nonce);
+  return len + CRYPTO_OVERHEAD;
+}
+
+int crypto_seal (CryptoSession *s, void *out, const void *in, int len)
+{
+  return crypto_seal_seq (s, s->send_seq++, out, in, len);
+}
+
+int crypto_open_seq (CryptoSession *s, uint64_t seq, void *out, const void *in, int len)
+{
+  uint8_t nonce[12];
+  const uint8_t *i = in;
+
+  if (len < CRYPTO_OVERHEAD || le64 (i) != seq)
+    return CRYPTO_FORGED;
+  len -= CRYPTO_OVERHEAD;
+  make_nonce (nonce, s->recv_dir, seq);
+  if (aead_open (out, i + 8 + len, i + 8, len, NULL, 0, s->key, nonce) < 0)
+    return CRYPTO_FORGED;
+  return len;
+}
+
+int crypto_open (CryptoSession *s, void *out, const void *in, int len)
+{
+  uint64_t seq, age;
+
+  if (len < CRYPTO_OVERHEAD)
+    return CRYPTO_FORGED;
+  seq = le64 (in);
+
+  /* reject replays before spending time on the tag */
+  if (seq == 0)
+    return CRYPTO_FORGED;
+  if (seq <= s->recv_max) {
+    age = s->recv_max - seq;
+    if (age >= 64 || (s->recv_window & (1ULL << age)))
+      return CRYPTO_FORGED;
+  }
+
+  if ((len = crypto_open_seq (s, seq, out, in, len)) < 0)
+    return len;
+
+  if (seq > s->recv_max) {
+    age = seq - s->recv_max;
+    s->recv_window = age >= 64 ? 0 : s->recv_window << age;
+    s->recv_window |= 1;
+    s->recv_max = seq;
+  } else {
+    s->recv_window |= 1ULL << (s->recv_max - seq);
+  }
+  return len;
+}
@@ -0,0 +1,10 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "error.h"
+
+void errorHandler(int error, char * msg) {
+    if (error < 0) {
+        fprintf(stderr, "ERROR: %s\n", msg);
+        exit(1);
+    }
+}
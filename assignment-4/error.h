@@ -0,0 +1,6 @@
+// error.[ch]
+//
+// Error handling shared by the programs of this directory
+
+// Basic errorhandler that takes error code and message: a negative error code prints the message and exits
+void errorHandler(int error, char * msg);
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "error.h"
+#include "evloop.h"
+
+// Compares the event loop backends with ping echo traffic over loopback UDP.
+// Every pair is a ping socket and an echo socket connected to each other, and all of them are watched by the loop.
+// Throughput: some of the pairs keep one ping bouncing, the rest are idle but still watched, as in a server with many quiet clients.
+// Wakeup latency: another thread sends timestamped pings to random echo sockets while the loop sleeps, and the echo callback
+// measures how long the ping took to reach it.
+
+static int PAIRS = 250;             // 500 sockets, select can't watch more than FD_SETSIZE
+static int ACTIVE = 32;             // pairs with a ping in flight during the throughput run
+static double SECONDS = 2;
+static double PING_INTERVAL = 0.001;
+
+struct pair {
+    int ping_fd, echo_fd;
+};
+
+struct bench {
+    struct pair *pairs;
+    unsigned long round_trips;
+    int64_t *latencies;
+    int nlatencies, max_latencies;
+    int bouncing;
+    volatile int sending;
+};
+
+static char * BACKEND_NAMES[EV_BACKENDS] = { "select", "poll", "epoll", "uring" };
+
+int64_t getMonotonicNs() {
+    struct timespec now;
+    errorHandler(clock_gettime(CLOCK_MONOTONIC, &now), "Something went wrong when reading the system clock");
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Creates a non-blocking UDP socket on a free loopback port
+int createSocket(struct sockaddr_in * addr) {
+    int fd, err;
+    socklen_t len = sizeof(struct sockaddr_in);
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    errorHandler(fd, "Socket could not be acquired");
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    err = bind(fd, (struct sockaddr *) addr, sizeof(struct sockaddr_in));
+    errorHandler(err, "Could not bind socket");
+    err = getsockname(fd, (struct sockaddr *) addr, &len);
+    errorHandler(err, "Could not read the socket address");
+    return fd;
+}
+
+void createPair(struct pair * pair) {
+    struct sockaddr_in ping_addr, echo_addr;
+    int err;
+
+    pair->ping_fd = createSocket(&ping_addr);
+    pair->echo_fd = createSocket(&echo_addr);
+    err = connect(pair->ping_fd, (struct sockaddr *) &echo_addr, sizeof(struct sockaddr_in));
+    errorHandler(err, "Could not connect ping socket");
+    err = connect(pair->echo_fd, (struct sockaddr *) &ping_addr, sizeof(struct sockaddr_in));
+    errorHandler(err, "Could not connect echo socket");
+}
+
+// Echo socket: send the ping back, and measure its wakeup latency when it came from the sender thread
+void onEcho(EvLoop * loop, int fd, int events, void * arg) {
+    struct bench * bench = arg;
+    int64_t sent;
+    int len;
+
+    len = recv(fd, &sent, sizeof(sent), 0);
+    if (len < 0) {
+        return;
+    }
+    if (bench->sending && len == sizeof(sent) && bench->nlatencies < bench->max_latencies) {
+        bench->latencies[bench->nlatencies++] = getMonotonicNs() - sent;
+        return;
+    }
+    send(fd, &sent, len, 0);
+}
+
+// Ping socket: an echo came back, send the next ping while the throughput run lasts
+void onPing(EvLoop * loop, int fd, int events, void * arg) {
+    struct bench * bench = arg;
+    char msg[8];
+
+    if (recv(fd, msg, sizeof(msg), 0) < 0 || !bench->bouncing) {
+        return;
+    }
+    bench->round_trips++;
+    send(fd, msg, 1, 0);
+}
+
+void onDone(EvLoop * loop, void * arg) {
+    ev_stop(loop);
+}
+
+void * sendPings(void * arg) {
+    struct bench * bench = arg;
+    struct timespec interval;
+    int64_t now;
+    int i, fd;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = PING_INTERVAL * 1E9;
+    while (bench->sending) {
+        nanosleep(&interval, NULL);
+        // Pings come from the ping socket, the echo socket only accepts datagrams from it
+        i = rand() % PAIRS;
+        fd = bench->pairs[i].ping_fd;
+        now = getMonotonicNs();
+        send(fd, &now, sizeof(now), 0);
+    }
+    return NULL;
+}
+
+int compareNs(const void * a, const void * b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void closeBench(EvLoop * loop, struct bench * bench) {
+    int i;
+
+    for (i = 0; i < PAIRS; i++) {
+        close(bench->pairs[i].ping_fd);
+        close(bench->pairs[i].echo_fd);
+    }
+    free(bench->pairs);
+    free(bench->latencies);
+    ev_free(loop);
+}
+
+void runBackend(int backend) {
+    EvLoop * loop;
+    struct bench bench;
+    pthread_t sender;
+    int i, err;
+    double rate;
+
+    loop = ev_new(backend);
+    if (loop == NULL) {
+        printf("%-8s not available\n", BACKEND_NAMES[backend]);
+        return;
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    bench.pairs = calloc(PAIRS, sizeof(struct pair));
+    bench.max_latencies = SECONDS / PING_INTERVAL + 1;
+    bench.latencies = calloc(bench.max_latencies, sizeof(int64_t));
+    if (bench.pairs == NULL || bench.latencies == NULL) {
+        errorHandler(-1, "Out of memory");
+    }
+    for (i = 0; i < PAIRS; i++) {
+        createPair(&bench.pairs[i]);
+    }
+    // select can't take descriptors past FD_SETSIZE
+    for (i = 0; i < PAIRS; i++) {
+        if (ev_add(loop, bench.pairs[i].ping_fd, EV_READ, onPing, &bench) < 0 ||
+                ev_add(loop, bench.pairs[i].echo_fd, EV_READ, onEcho, &bench) < 0) {
+            printf("%-8s %6d can't watch this many sockets\n", ev_backend_name(loop), 2 * PAIRS);
+            closeBench(loop, &bench);
+            return;
+        }
+    }
+
+    // Throughput: keep ACTIVE pings bouncing for SECONDS
+    bench.bouncing = 1;
+    for (i = 0; i < ACTIVE && i < PAIRS; i++) {
+        send(bench.pairs[i].ping_fd, "p", 1, 0);
+    }
+    ev_timer(loop, SECONDS, onDone, &bench);
+    errorHandler(ev_run(loop), "Event loop failed");
+    rate = bench.round_trips / SECONDS;
+    bench.bouncing = 0;
+
+    // Let the pings still in flight land, so the latency run starts with an idle loop
+    ev_timer(loop, 0.1, onDone, &bench);
+    errorHandler(ev_run(loop), "Event loop failed");
+
+    // Wakeup latency: the loop sleeps until the sender thread's ping arrives
+    bench.sending = 1;
+    err = pthread_create(&sender, NULL, sendPings, &bench);
+    if (err != 0) {
+        errorHandler(-1, "Could not start the sender thread");
+    }
+    ev_timer(loop, SECONDS, onDone, &bench);
+    errorHandler(ev_run(loop), "Event loop failed");
+    bench.sending = 0;
+    pthread_join(sender, NULL);
+
+    qsort(bench.latencies, bench.nlatencies, sizeof(int64_t), compareNs);
+    err = printf("%-8s %6d %14.0f %10.1f %10.1f %10.1f\n", ev_backend_name(loop), 2 * PAIRS, rate,
+                 bench.nlatencies ? bench.latencies[bench.nlatencies / 2] / 1E3 : 0.0,
+                 bench.nlatencies ? bench.latencies[bench.nlatencies * 99 / 100] / 1E3 : 0.0,
+                 bench.nlatencies ? bench.latencies[bench.nlatencies - 1] / 1E3 : 0.0);
+    errorHandler(err, "Something went wrong when printing to stdout");
+    fflush(stdout);
+
+    closeBench(loop, &bench);
+}
+
+int main(int argc, char ** argv) {
+    int opt, i, backend;
+
+    // -n <pairs> of sockets watched, -a <active> of them carrying pings, -t <seconds> per run
+    while ((opt = getopt(argc, argv, "n:a:t:")) != -1) {
+        switch (opt) {
+            case 'n':
+                PAIRS = atoi(optarg);
+                break;
+            case 'a':
+                ACTIVE = atoi(optarg);
+                break;
+            case 't':
+                SECONDS = atof(optarg);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc == 0 || PAIRS < 1 || ACTIVE < 0 || SECONDS <= 0) {
+        fprintf(stderr, "Usage: evbench [-n <socket-pairs>] [-a <active-pairs>] [-t <seconds>] [select|poll|epoll|uring]...\n");
+        return 1;
+    }
+
+    printf("%-8s %6s %14s %10s %10s %10s\n", "backend", "fds", "round trips/s", "wake p50", "wake p99", "wake max");
+    printf("%-8s %6s %14s %10s %10s %10s\n", "", "", "", "us", "us", "us");
+    if (optind == argc) {
+        for (i = 0; i < EV_BACKENDS; i++) {
+            runBackend(i);
+        }
+        return 0;
+    }
+    for (i = optind; i < argc; i++) {
+        backend = ev_backend_by_name(argv[i]);
+        if (backend < 0) {
+            fprintf(stderr, "Unknown backend %s\n", argv[i]);
+            return 1;
+        }
+        runBackend(backend);
+    }
+    return 0;
+}
@@ -0,0 +1,670 @@
+/* evloop.[ch]
+ *
+ * event loop on select, poll, epoll or io_uring, chosen at runtime
+ * */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "evloop.h"
+
+/* io_uring submission queue entries, each watched descriptor has one poll in flight */
+#define URING_ENTRIES	1024
+
+typedef struct {
+  int		events;		/* 0 when fd is not watched */
+  ev_callback	cb;
+  void		*arg;
+  uint32_t	gen;		/* io_uring: tells the polls of an earlier registration apart */
+} Watch;
+
+typedef struct {
+  int64_t	deadline;	/* CLOCK_MONOTONIC, in nanoseconds */
+  int		id;
+  ev_timer_callback	cb;
+  void		*arg;
+} Timer;
+
+typedef struct {
+  int		fd;
+  int		events;
+} Ready;
+
+typedef struct {
+  const char	*name;
+  int		(*init) (EvLoop *loop);
+  /* watch events on fd instead of old, 0 for nothing */
+  int		(*update) (EvLoop *loop, int fd, int old, int events);
+  /* wait up to timeout ns, <0 for no limit, and add the ready descriptors to loop->ready */
+  int		(*wait) (EvLoop *loop, int64_t timeout);
+  void		(*free) (EvLoop *loop);
+} Backend;
+
+struct _evloop {
+  const Backend	*backend;
+  Watch		*watches;	/* indexed by fd */
+  int		nwatches, watched;
+  Ready		*ready;
+  int		nready, ready_size;
+  Timer		*timers;	/* binary min-heap on deadline */
+  int		ntimers, timers_size, next_id;
+  int		stopped;
+
+  /* select */
+  fd_set	rset, wset;
+  int		maxfd;
+  /* poll */
+  struct pollfd	*pollfds;
+  int		npollfds, pollsize, *pollidx;
+  /* epoll and io_uring */
+  int		fd;
+  /* io_uring rings */
+  void		*sq_ring, *cq_ring;
+  size_t	sq_ring_size, cq_ring_size;
+  struct io_uring_sqe	*sqes;
+  unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+  unsigned	*cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe	*cqes;
+};
+
+static int64_t now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int add_ready (EvLoop *loop, int fd, int events)
+{
+  Ready *r;
+
+  if (loop->nready == loop->ready_size) {
+    loop->ready_size = loop->ready_size ? loop->ready_size * 2 : 64;
+    r = realloc (loop->ready, loop->ready_size * sizeof(Ready));
+    if (r == NULL)
+      return -1;
+    loop->ready = r;
+  }
+  loop->ready[loop->nready].fd = fd;
+  loop->ready[loop->nready].events = events;
+  loop->nready++;
+  return 0;
+}
+
+/* ---- select */
+
+static int select_init (EvLoop *loop)
+{
+  FD_ZERO (&loop->rset);
+  FD_ZERO (&loop->wset);
+  loop->maxfd = -1;
+  return 0;
+}
+
+static int select_update (EvLoop *loop, int fd, int old, int events)
+{
+  if (fd >= FD_SETSIZE)
+    return -1;
+  FD_CLR (fd, &loop->rset);
+  FD_CLR (fd, &loop->wset);
+  if (events & EV_READ)
+    FD_SET (fd, &loop->rset);
+  if (events & EV_WRITE)
+    FD_SET (fd, &loop->wset);
+  if (events && fd > loop->maxfd)
+    loop->maxfd = fd;
+  while (loop->maxfd >= 0 && loop->watches[loop->maxfd].events == 0)
+    loop->maxfd--;
+  return 0;
+}
+
+static int select_wait (EvLoop *loop, int64_t timeout)
+{
+  fd_set rset = loop->rset, wset = loop->wset;
+  struct timeval tv, *tvp = NULL;
+  int n, fd, events;
+
+  if (timeout >= 0) {
+    tv.tv_sec = timeout / 1000000000;
+    tv.tv_usec = (timeout % 1000000000 + 999) / 1000;
+    tvp = &tv;
+  }
+  n = select (loop->maxfd + 1, &rset, &wset, NULL, tvp);
+  if (n <= 0)
+    return n;
+  for (fd = 0; fd <= loop->maxfd && n > 0; fd++) {
+    events = (FD_ISSET (fd, &rset) ? EV_READ : 0) | (FD_ISSET (fd, &wset) ? EV_WRITE : 0);
+    if (events) {
+      n -= (events & EV_READ ? 1 : 0) + (events & EV_WRITE ? 1 : 0);
+      if (add_ready (loop, fd, events) < 0)
+	return -1;
+    }
+  }
+  return 0;
+}
+
+static void select_free (EvLoop *loop)
+{
+}
+
+/* ---- poll */
+
+static int poll_init (EvLoop *loop)
+{
+  return 0;
+}
+
+static int poll_update (EvLoop *loop, int fd, int old, int events)
+{
+  struct pollfd *p;
+  int *idx, i;
+
+  /* no more descriptors can be watched than there are watches */
+  if (loop->pollsize < loop->nwatches) {
+    idx = realloc (loop->pollidx, loop->nwatches * sizeof(int));
+    if (idx == NULL)
+      return -1;
+    loop->pollidx = idx;
+    p = realloc (loop->pollfds, loop->nwatches * sizeof(struct pollfd));
+    if (p == NULL)
+      return -1;
+    loop->pollfds = p;
+    loop->pollsize = loop->nwatches;
+  }
+
+  if (old == 0) {
+    loop->pollidx[fd] = loop->npollfds++;
+    loop->pollfds[loop->pollidx[fd]].fd = fd;
+  }
+  i = loop->pollidx[fd];
+  if (events == 0) {
+    /* the last entry moves into the hole */
+    loop->pollfds[i] = loop->pollfds[--loop->npollfds];
+    loop->pollidx[loop->pollfds[i].fd] = i;
+    return 0;
+  }
+  loop->pollfds[i].events = (events & EV_READ ? POLLIN : 0) | (events & EV_WRITE ? POLLOUT : 0);
+  return 0;
+}
+
+static int poll_wait (EvLoop *loop, int64_t timeout)
+{
+  struct timespec ts;
+  struct pollfd *p;
+  int n, i, events;
+
+  ts.tv_sec = timeout / 1000000000;
+  ts.tv_nsec = timeout % 1000000000;
+  n = ppoll (loop->pollfds, loop->npollfds, timeout >= 0 ? &ts : NULL, NULL);
+  for (i = 0; i < loop->npollfds && n > 0; i++) {
+    p = &loop->pollfds[i];
+    if (p->revents == 0)
+      continue;
+    n--;
+    events = (p->revents & (POLLIN | POLLHUP | POLLERR) ? EV_READ : 0)
+      | (p->revents & (POLLOUT | POLLHUP | POLLERR) ? EV_WRITE : 0);
+    if (add_ready (loop, p->fd, events) < 0)
+      return -1;
+  }
+  return n < 0 ? n : 0;
+}
+
+static void poll_free (EvLoop *loop)
+{
+  free (loop->pollfds);
+  free (loop->pollidx);
+}
+
+/* ---- epoll */
+
+static int epoll_init (EvLoop *loop)
+{
+  loop->fd = epoll_create1 (EPOLL_CLOEXEC);
+  return loop->fd;
+}
+
+static int epoll_update (EvLoop *loop, int fd, int old, int events)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof(ev));
+  ev.events = (events & EV_READ ? EPOLLIN : 0) | (events & EV_WRITE ? EPOLLOUT : 0);
+  ev.data.fd = fd;
+  if (events == 0)
+    return epoll_ctl (loop->fd, EPOLL_CTL_DEL, fd, &ev);
+  return epoll_ctl (loop->fd, old ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int epoll_wait_ready (EvLoop *loop, int64_t timeout)
+{
+  struct epoll_event evs[256];
+  struct timespec ts;
+  int n, i, events;
+
+  ts.tv_sec = timeout / 1000000000;
+  ts.tv_nsec = timeout % 1000000000;
+  n = epoll_pwait2 (loop->fd, evs, 256, timeout >= 0 ? &ts : NULL, NULL);
+  for (i = 0; i < n; i++) {
+    events = (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? EV_READ : 0)
+      | (evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR) ? EV_WRITE : 0);
+    if (add_ready (loop, evs[i].data.fd, events) < 0)
+      return -1;
+  }
+  return n < 0 ? n : 0;
+}
+
+static void epoll_free (EvLoop *loop)
+{
+  close (loop->fd);
+}
+
+/* ---- io_uring
+ *
+ * every watched descriptor has a one-shot poll in flight. It is armed again once its
+ * completion has been reaped, and the new poll only goes to the kernel with the next
+ * wait, after the callbacks ran: if they left the descriptor ready it completes right
+ * away, which keeps readiness level triggered like on the other backends.
+ */
+
+static struct io_uring_sqe *uring_sqe (EvLoop *loop)
+{
+  unsigned tail = *loop->sq_tail, head = __atomic_load_n (loop->sq_head, __ATOMIC_ACQUIRE);
+  struct io_uring_sqe *sqe;
+
+  /* a full queue is handed to the kernel first */
+  if (tail - head == loop->sq_entries) {
+    if (syscall (__NR_io_uring_enter, loop->fd, tail - head, 0, 0, NULL, 0) < 0)
+      return NULL;
+  }
+  sqe = &loop->sqes[tail & *loop->sq_mask];
+  memset (sqe, 0, sizeof(*sqe));
+  loop->sq_array[tail & *loop->sq_mask] = tail & *loop->sq_mask;
+  __atomic_store_n (loop->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static uint64_t uring_data (int fd, uint32_t gen)
+{
+  return (uint64_t) gen << 32 | (uint32_t) fd;
+}
+
+static int uring_arm (EvLoop *loop, int fd)
+{
+  struct io_uring_sqe *sqe = uring_sqe (loop);
+  int events = loop->watches[fd].events;
+
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = (events & EV_READ ? POLLIN : 0) | (events & EV_WRITE ? POLLOUT : 0);
+  sqe->user_data = uring_data (fd, loop->watches[fd].gen);
+  return 0;
+}
+
+static int uring_init (EvLoop *loop)
+{
+  struct io_uring_params p;
+
+  memset (&p, 0, sizeof(p));
+  loop->fd = syscall (__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (loop->fd < 0)
+    return -1;
+  /* waits with a timeout need IORING_ENTER_EXT_ARG */
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {
+    close (loop->fd);
+    return -1;
+  }
+
+  loop->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  loop->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  loop->sq_ring = mmap (NULL, loop->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			loop->fd, IORING_OFF_SQ_RING);
+  loop->cq_ring = mmap (NULL, loop->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			loop->fd, IORING_OFF_CQ_RING);
+  loop->sqes = mmap (NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQES);
+  if (loop->sq_ring == MAP_FAILED || loop->cq_ring == MAP_FAILED || loop->sqes == MAP_FAILED)
+    return -1;
+
+  loop->sq_head = (unsigned *) ((char *) loop->sq_ring + p.sq_off.head);
+  loop->sq_tail = (unsigned *) ((char *) loop->sq_ring + p.sq_off.tail);
+  loop->sq_mask = (unsigned *) ((char *) loop->sq_ring + p.sq_off.ring_mask);
+  loop->sq_array = (unsigned *) ((char *) loop->sq_ring + p.sq_off.array);
+  loop->sq_entries = p.sq_entries;
+  loop->cq_head = (unsigned *) ((char *) loop->cq_ring + p.cq_off.head);
+  loop->cq_tail = (unsigned *) ((char *) loop->cq_ring + p.cq_off.tail);
+  loop->cq_mask = (unsigned *) ((char *) loop->cq_ring + p.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe *) ((char *) loop->cq_ring + p.cq_off.cqes);
+  return 0;
+}
+
+static int uring_update (EvLoop *loop, int fd, int old, int events)
+{
+  struct io_uring_sqe *sqe;
+
+  /* the poll of the old registration goes, its completions are recognised as stale by the generation */
+  if (old) {
+    sqe = uring_sqe (loop);
+    if (sqe == NULL)
+      return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_data (fd, loop->watches[fd].gen);
+    sqe->user_data = UINT64_MAX;
+  }
+  loop->watches[fd].gen++;
+  if (events == 0)
+    return 0;
+  loop->watches[fd].events = events;
+  return uring_arm (loop, fd);
+}
+
+static int uring_wait (EvLoop *loop, int64_t timeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  int n, fd, events;
+  uint32_t gen;
+
+  memset (&arg, 0, sizeof(arg));
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000000000;
+    ts.tv_nsec = timeout % 1000000000;
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+  }
+  /* the entries the kernel has not consumed yet go along with the wait */
+  n = syscall (__NR_io_uring_enter, loop->fd, *loop->sq_tail - __atomic_load_n (loop->sq_head, __ATOMIC_ACQUIRE), 1,
+	       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  if (n < 0 && errno != ETIME && errno != EINTR)
+    return -1;
+
+  head = *loop->cq_head;
+  tail = __atomic_load_n (loop->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    cqe = &loop->cqes[head & *loop->cq_mask];
+    fd = (int) (uint32_t) cqe->user_data;
+    gen = cqe->user_data >> 32;
+    if (cqe->user_data == UINT64_MAX || fd >= loop->nwatches || loop->watches[fd].events == 0
+	|| loop->watches[fd].gen != gen || cqe->res == -ECANCELED)
+      continue;
+    events = cqe->res < 0 ? EV_READ | EV_WRITE
+      : (cqe->res & (POLLIN | POLLHUP | POLLERR) ? EV_READ : 0) | (cqe->res & (POLLOUT | POLLHUP | POLLERR) ? EV_WRITE : 0);
+    if (add_ready (loop, fd, events) < 0 || uring_arm (loop, fd) < 0)
+      return -1;
+  }
+  __atomic_store_n (loop->cq_head, head, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void uring_free (EvLoop *loop)
+{
+  if (loop->sqes != NULL && loop->sqes != MAP_FAILED)
+    munmap (loop->sqes, loop->sq_entries * sizeof(struct io_uring_sqe));
+  if (loop->cq_ring != NULL && loop->cq_ring != MAP_FAILED)
+    munmap (loop->cq_ring, loop->cq_ring_size);
+  if (loop->sq_ring != NULL && loop->sq_ring != MAP_FAILED)
+    munmap (loop->sq_ring, loop->sq_ring_size);
+  if (loop->fd >= 0)
+    close (loop->fd);
+}
+
+static const Backend backends[EV_BACKENDS] = {
+  { "select", select_init, select_update, select_wait, select_free },
+  { "poll", poll_init, poll_update, poll_wait, poll_free },
+  { "epoll", epoll_init, epoll_update, epoll_wait_ready, epoll_free },
+  { "uring", uring_init, uring_update, uring_wait, uring_free },
+};
+
+/* ---- timers */
+
+static int timer_before (Timer *a, Timer *b)
+{
+  return a->deadline < b->deadline || (a->deadline == b->deadline && a->id < b->id);
+}
+
+/* takes timer i out of the heap, the last timer fills its place and moves up or down to where it belongs */
+static void timer_remove (EvLoop *loop, int i)
+{
+  Timer last = loop->timers[--loop->ntimers];
+  int parent, child;
+
+  if (i == loop->ntimers)
+    return;
+  while (i > 0 && timer_before (&last, &loop->timers[parent = (i - 1) / 2])) {
+    loop->timers[i] = loop->timers[parent];
+    i = parent;
+  }
+  while ((child = 2 * i + 1) < loop->ntimers) {
+    if (child + 1 < loop->ntimers && timer_before (&loop->timers[child + 1], &loop->timers[child]))
+      child++;
+    if (!timer_before (&loop->timers[child], &last))
+      break;
+    loop->timers[i] = loop->timers[child];
+    i = child;
+  }
+  loop->timers[i] = last;
+}
+
+/* ---- loop */
+
+int ev_backend_by_name (const char *name)
+{
+  int i;
+
+  for (i = 0; i < EV_BACKENDS; i++)
+    if (strcmp (name, backends[i].name) == 0)
+      return i;
+  return -1;
+}
+
+const char *ev_backend_name (EvLoop *loop)
+{
+  return loop->backend->name;
+}
+
+EvLoop *ev_new (int backend)
+{
+  EvLoop *loop;
+  char *env;
+
+  if (backend == EV_DEFAULT) {
+    env = getenv ("EVLOOP");
+    backend = env != NULL ? ev_backend_by_name (env) : EV_EPOLL;
+  }
+  if (backend < 0 || backend >= EV_BACKENDS)
+    return NULL;
+
+  loop = calloc (1, sizeof(EvLoop));
+  if (loop == NULL)
+    return NULL;
+  loop->backend = &backends[backend];
+  loop->fd = -1;
+  if (loop->backend->init (loop) < 0) {
+    ev_free (loop);
+    return NULL;
+  }
+  return loop;
+}
+
+void ev_free (EvLoop *loop)
+{
+  loop->backend->free (loop);
+  free (loop->watches);
+  free (loop->ready);
+  free (loop->timers);
+  free (loop);
+}
+
+int ev_add (EvLoop *loop, int fd, int events, ev_callback cb, void *arg)
+{
+  Watch *w;
+  int n = loop->nwatches ? loop->nwatches : 64, old;
+
+  if (fd < 0 || events == 0 || (events & ~(EV_READ | EV_WRITE)))
+    return -1;
+  if (fd >= loop->nwatches) {
+    while (n <= fd)
+      n *= 2;
+    w = realloc (loop->watches, n * sizeof(Watch));
+    if (w == NULL)
+      return -1;
+    memset (w + loop->nwatches, 0, (n - loop->nwatches) * sizeof(Watch));
+    loop->watches = w;
+    loop->nwatches = n;
+  }
+
+  old = loop->watches[fd].events;
+  loop->watches[fd].events = events;
+  if (loop->backend->update (loop, fd, old, events) < 0) {
+    loop->watches[fd].events = old;
+    return -1;
+  }
+  loop->watches[fd].cb = cb;
+  loop->watches[fd].arg = arg;
+  if (old == 0)
+    loop->watched++;
+  return 0;
+}
+
+int ev_del (EvLoop *loop, int fd)
+{
+  int old;
+
+  if (fd < 0 || fd >= loop->nwatches || loop->watches[fd].events == 0)
+    return -1;
+  old = loop->watches[fd].events;
+  loop->watches[fd].events = 0;
+  loop->watched--;
+  return loop->backend->update (loop, fd, old, 0);
+}
+
+int ev_timer (EvLoop *loop, double seconds, ev_timer_callback cb, void *arg)
+{
+  Timer t, *timers;
+  int i, parent;
+
+  if (loop->ntimers == loop->timers_size) {
+    loop->timers_size = loop->timers_size ? loop->timers_size * 2 : 16;
+    timers = realloc (loop->timers, loop->timers_size * sizeof(Timer));
+    if (timers == NULL)
+      return -1;
+    loop->timers = timers;
+  }
+  t.deadline = now_ns () + (int64_t) (seconds * 1E9);
+  t.id = loop->next_id++ & INT32_MAX;
+  t.cb = cb;
+  t.arg = arg;
+
+  for (i = loop->ntimers++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (!timer_before (&t, &loop->timers[parent]))
+      break;
+    loop->timers[i] = loop->timers[parent];
+  }
+  loop->timers[i] = t;
+  return t.id;
+}
+
+void ev_cancel (EvLoop *loop, int id)
+{
+  int i;
+
+  /* taken out right away, so sessions that re-arm their timer on every packet don't fill the heap */
+  for (i = 0; i < loop->ntimers; i++)
+    if (loop->timers[i].id == id) {
+      timer_remove (loop, i);
+      return;
+    }
+}
+
+int ev_run_once (EvLoop *loop, double timeout)
+{
+  int64_t wait = timeout >= 0 ? (int64_t) (timeout * 1E9) : -1, now;
+  int i, fd, events, ran = 0;
+  Watch *w;
+  Timer t;
+
+  if (loop->ntimers > 0) {
+    now = now_ns ();
+    if (wait < 0 || loop->timers[0].deadline - now < wait)
+      wait = loop->timers[0].deadline > now ? loop->timers[0].deadline - now : 0;
+  }
+
+  loop->nready = 0;
+  if (loop->backend->wait (loop, wait) < 0 && errno != EINTR)
+    return -1;
+
+  /* callbacks may remove any descriptor, so each one is checked again before it runs */
+  for (i = 0; i < loop->nready; i++) {
+    fd = loop->ready[i].fd;
+    w = &loop->watches[fd];
+    events = loop->ready[i].events & w->events;
+    if (events) {
+      w->cb (loop, fd, events, w->arg);
+      ran++;
+    }
+  }
+
+  now = now_ns ();
+  while (loop->ntimers > 0 && loop->timers[0].deadline <= now) {
+    t = loop->timers[0];
+    timer_remove (loop, 0);
+    t.cb (loop, t.arg);
+    ran++;
+  }
+  return ran;
+}
+
+static void wait_ready (EvLoop *loop, int fd, int events, void *arg)
+{
+  *(int *) arg |= events;
+}
+
+int ev_wait (EvLoop *loop, int fd, int events, double timeout)
+{
+  int64_t deadline = now_ns () + (int64_t) (timeout * 1E9), left = -1;
+  int ready = 0;
+
+  if (ev_add (loop, fd, events, wait_ready, &ready) < 0)
+    return -1;
+  /* other descriptors may end a round before fd is ready */
+  do {
+    if (timeout >= 0 && (left = deadline - now_ns ()) < 0)
+      left = 0;
+    if (ev_run_once (loop, timeout >= 0 ? left / 1E9 : -1) < 0) {
+      ev_del (loop, fd);
+      return -1;
+    }
+  } while (!ready && left != 0);
+  ev_del (loop, fd);
+  return ready;
+}
+
+int ev_run (EvLoop *loop)
+{
+  loop->stopped = 0;
+  while (!loop->stopped && (loop->watched > 0 || loop->ntimers > 0))
+    if (ev_run_once (loop, -1) < 0)
+      return -1;
+  loop->stopped = 0;
+  return 0;
+}
+
+void ev_stop (EvLoop *loop)
+{
+  loop->stopped = 1;
+}
@@ -0,0 +1,97 @@
+/* evloop.[ch]
+ *
+ * event loop on select, poll, epoll or io_uring, chosen at runtime
+ *
+ * file descriptors are registered with a callback that runs when they are readable
+ * or writable, and one-shot timers with a callback that runs when they expire. Each
+ * wait collects every ready descriptor in one call to the backend before any of the
+ * callbacks run, and readiness is level triggered on every backend: a callback that
+ * leaves data unread is called again on the next round.
+ *
+ * the backend is picked when the loop is created. EV_DEFAULT takes the one named in
+ * the EVLOOP environment variable (select, poll, epoll or uring), or else epoll.
+ * */
+
+/* backends */
+#define EV_DEFAULT	-1
+#define EV_SELECT	0
+#define EV_POLL		1
+#define EV_EPOLL	2
+#define EV_URING	3
+#define EV_BACKENDS	4
+
+/* events */
+#define EV_READ		1
+#define EV_WRITE	2
+
+typedef struct _evloop EvLoop;
+
+/** called when fd is ready
+ *
+ * @param events	the EV_READ and EV_WRITE events that are ready, or both on an error or hangup
+ */
+typedef void (*ev_callback) (EvLoop *loop, int fd, int events, void *arg);
+
+typedef void (*ev_timer_callback) (EvLoop *loop, void *arg);
+
+/** create a loop
+ *
+ * @param backend	EV_SELECT, EV_POLL, EV_EPOLL, EV_URING or EV_DEFAULT
+ * @return the loop, or NULL when the backend is not available
+ */
+EvLoop *ev_new (int backend);
+
+/** destroy a loop. Registered descriptors are not closed */
+void ev_free (EvLoop *loop);
+
+/** @return the backend of name, or <0 when there is none by that name */
+int ev_backend_by_name (const char *name);
+
+/** @return the name of the backend the loop runs on */
+const char *ev_backend_name (EvLoop *loop);
+
+/** watch fd, or change what is watched when it is registered already
+ *
+ * @param events	EV_READ, EV_WRITE or both
+ * @return 0 on success, <0 on failure, e.g. an fd above FD_SETSIZE on select
+ */
+int ev_add (EvLoop *loop, int fd, int events, ev_callback cb, void *arg);
+
+/** stop watching fd. May be called from any callback, fd included */
+int ev_del (EvLoop *loop, int fd);
+
+/** run cb once, seconds from now
+ *
+ * @return an id for ev_cancel, or <0 on failure
+ */
+int ev_timer (EvLoop *loop, double seconds, ev_timer_callback cb, void *arg);
+
+/** cancel a timer that has not run yet */
+void ev_cancel (EvLoop *loop, int id);
+
+/** wait for events and run their callbacks
+ *
+ * @param timeout	seconds to wait at most when nothing is ready, <0 to wait for the first event
+ * @return the number of callbacks run, <0 on failure
+ */
+int ev_run_once (EvLoop *loop, double timeout);
+
+/** wait for fd alone, for code that blocks on one descriptor at a time
+ *
+ * fd is watched for the wait only, so it must not be watched by the loop already.
+ * Callbacks of other descriptors and timers of the loop run as they become due.
+ *
+ * @param events	EV_READ, EV_WRITE or both
+ * @param timeout	seconds to wait at most, <0 for no limit
+ * @return the events that are ready, 0 on timeout, <0 on failure
+ */
+int ev_wait (EvLoop *loop, int fd, int events, double timeout);
+
+/** run until ev_stop is called or nothing is left to wait for
+ *
+ * @return 0 when stopped, <0 on failure
+ */
+int ev_run (EvLoop *loop);
+
+/** make ev_run return after the current round */
+void ev_stop (EvLoop *loop);
@@ -0,0 +1,128 @@
+/* pool.[ch]
+ *
+ * packet buffer pool and per-session arenas of the audio server
+ * */
+
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+/* buffers a thread keeps for itself, and how many move to or from the pool at a time */
+#define CACHE_SIZE	64
+#define CACHE_BATCH	32
+
+/* arena allocations are aligned to this, after the link word at the start of every buffer */
+#define ALIGN		16
+
+typedef struct _freebuf {
+  struct _freebuf	*next;
+} FreeBuf;
+
+static FreeBuf		*free_list = NULL;
+static pthread_mutex_t	pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread void	*cache[CACHE_SIZE];
+static __thread int	cached = 0;
+
+int pool_init (size_t count)
+{
+  size_t len = count * POOL_BUFSIZE, huge = 2 * 1024 * 1024, i;
+  char *base;
+
+  /* huge pages need a multiple of their size, and fail unless the system has some reserved */
+  base = mmap (NULL, (len + huge - 1) / huge * huge, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (base == MAP_FAILED)
+    base = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return -1;
+
+  pthread_mutex_lock (&pool_lock);
+  for (i = count; i-- > 0; ) {
+    FreeBuf *buf = (FreeBuf *) (base + i * POOL_BUFSIZE);
+    buf->next = free_list;
+    free_list = buf;
+  }
+  pthread_mutex_unlock (&pool_lock);
+  return 0;
+}
+
+void *pool_get (void)
+{
+  FreeBuf *buf;
+
+  if (cached == 0) {
+    pthread_mutex_lock (&pool_lock);
+    while (cached < CACHE_BATCH && free_list != NULL) {
+      cache[cached++] = free_list;
+      free_list = free_list->next;
+    }
+    pthread_mutex_unlock (&pool_lock);
+    if (cached == 0)
+      return NULL;
+  }
+  buf = cache[--cached];
+  return buf;
+}
+
+void pool_put (void *buf)
+{
+  FreeBuf *b;
+
+  if (cached == CACHE_SIZE) {
+    pthread_mutex_lock (&pool_lock);
+    while (cached > CACHE_SIZE - CACHE_BATCH) {
+      b = cache[--cached];
+      b->next = free_list;
+      free_list = b;
+    }
+    pthread_mutex_unlock (&pool_lock);
+  }
+  cache[cached++] = buf;
+}
+
+Arena *arena_new (void)
+{
+  Arena local = { NULL, POOL_BUFSIZE }, *a;
+
+  a = arena_alloc (&local, sizeof(Arena));
+  if (a != NULL)
+    *a = local;
+  return a;
+}
+
+void *arena_alloc (Arena *a, size_t size)
+{
+  void *buf, *mem;
+
+  size = (size + ALIGN - 1) / ALIGN * ALIGN;
+  if (size > POOL_BUFSIZE - ALIGN)
+    return NULL;
+
+  /* the newest buffer is full: chain a new one in front */
+  if (a->used + size > POOL_BUFSIZE) {
+    buf = pool_get ();
+    if (buf == NULL)
+      return NULL;
+    *(void **) buf = a->buffers;
+    a->buffers = buf;
+    a->used = ALIGN;
+  }
+  mem = (char *) a->buffers + a->used;
+  a->used += size;
+  memset (mem, 0, size);
+  return mem;
+}
+
+void arena_free (Arena *a)
+{
+  void *buf = a->buffers, *next;
+
+  /* the arena lives in its own first buffer, so read the links before giving buffers back */
+  while (buf != NULL) {
+    next = *(void **) buf;
+    pool_put (buf);
+    buf = next;
+  }
+}
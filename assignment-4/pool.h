@@ -0,0 +1,55 @@
+/* pool.[ch]
+ *
+ * packet buffer pool and per-session arenas of the audio server
+ *
+ * the pool maps all of its buffers in one go when the server starts, on huge pages
+ * if the system has some reserved, so nothing is allocated while packets are sent
+ * and the memory of the server stays bounded however many sessions it holds. Every
+ * thread keeps a short free list of its own and only takes the pool lock to refill
+ * or empty it a batch at a time.
+ *
+ * an arena hands out the memory for the state of one session from pool buffers, and
+ * gives all of them back to the pool in one step when the session ends.
+ * */
+
+#include <stddef.h>
+
+/* size of a pool buffer, large enough for any datagram of a session */
+#define POOL_BUFSIZE	2048
+
+typedef struct _arena {
+  void		*buffers;	/* pool buffers in use, linked through their first word */
+  size_t	used;		/* bytes handed out from the newest buffer */
+} Arena;
+
+/** map the pool
+ *
+ * @param count		the number of buffers in the pool
+ * @return 0 on success, <0 on failure
+ */
+int pool_init (size_t count);
+
+/** take a buffer of POOL_BUFSIZE bytes from the pool
+ *
+ * @return the buffer, or NULL when the pool is exhausted
+ */
+void *pool_get (void);
+
+/** give a buffer back to the pool */
+void pool_put (void *buf);
+
+/** create an arena, itself stored in its first pool buffer
+ *
+ * @return the arena, or NULL when the pool is exhausted
+ */
+Arena *arena_new (void);
+
+/** allocate zeroed memory from an arena
+ *
+ * @param size	at most POOL_BUFSIZE - 16 bytes
+ * @return the memory, or NULL when the pool is exhausted
+ */
+void *arena_alloc (Arena *a, size_t size);
+
+/** give every buffer of an arena back to the pool, the arena included */
+void arena_free (Arena *a);
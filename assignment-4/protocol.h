@@ -0,0 +1,90 @@
+/* protocol.h
+ *
+ * wire format shared by audioserver and audioclient
+ * */
+
+#include <stdint.h>
+#include "crypto.h"
+
+#define BUFSIZE 1024
+#define SIZE 64
+
+// Request prefix for a bulk download instead of a realtime stream, e.g. "DOWNLOAD song.wav"
+#define REQ_DOWNLOAD "DOWNLOAD "
+
+// Request prefix for part of a file, "RANGE <first packet> <packet count> <filename>"
+// The server answers with the audio header of the whole file, then sends the range like a download
+#define REQ_RANGE "RANGE "
+
+// Request to continue a stream that broke off, "RESUME <token> <seq>" with the token from its header
+// and the first packet the client still needs. It may come from a new address, the server sends the rest of the stream there
+#define REQ_RESUME "RESUME "
+
+// Request prefix for gapless playback of several files, followed by the filenames separated by newlines
+// Playlist requests may be up to BUFSIZE bytes long
+#define REQ_PLAYLIST "PLAYLIST\n"
+
+// Socket buffer size used for bulk downloads, both for UDP and TCP
+#define BULK_SOCKBUF (4*1024*1024)
+
+// First packet of every session, describing the audio data that follows
+struct audio_header {
+    int32_t sample_rate;
+    int32_t sample_size;
+    int32_t channels;
+    uint32_t packets;       // number of BUFSIZE chunks in the data chunk of the file
+    int64_t mtime;          // modification time of the file, identifies the version clients may have cached
+    uint64_t token;         // resumes the stream after a timeout, 0 if it can't be resumed
+};
+
+// Reply to an audio header instead of "ACK" when the client already has this version of the file
+#define CACHE_HIT "HIT"
+
+// Sent between two tracks of a playlist when the next track has a different format,
+// so the client knows it must reconfigure its audio device. Acknowledged like audio packets
+#define FORMAT_TAG "FMT"
+struct format_marker {
+    char tag[4];
+    struct audio_header header;
+};
+
+// Data packet of a bulk download. The last packet of a file may carry less than BUFSIZE bytes
+// Streams send their packets in the same form, acknowledged with "ACK <seq>", and end with a packet without data
+struct dl_packet {
+    uint32_t seq;
+    char data[BUFSIZE];
+};
+
+// Local transport for clients on the server's host. They connect to this Unix socket and send the filename, in SIZE bytes
+// The server answers with the audio header, passing along a memfd that holds a struct local_ring and two eventfds:
+// one the server signals when it filled a slot, one the client signals when it freed one
+#define LOCAL_SOCKET "/tmp/audioserver.sock"
+#define LOCAL_SLOTS 64
+
+// Single producer, single consumer ring in shared memory. The server fills slots and advances head,
+// the client plays them and advances tail, which is all the acknowledgement the server needs
+// A side about to sleep sets its waiting flag first, and the other side only signals when the flag is set
+// The server sleeps until half of the ring is free again, so it is woken once per LOCAL_SLOTS/2 packets
+struct local_ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t server_waiting;
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t client_waiting;
+    struct {
+        uint32_t len;           // bytes of audio in data, 0 marks the end of the stream
+        char data[BUFSIZE];
+    } slots[LOCAL_SLOTS] __attribute__((aligned(64)));
+};
+
+// Largest datagram of a session, a sealed download packet
+#define MAXPACKET (sizeof(struct dl_packet) + CRYPTO_OVERHEAD)
+
+// Start of an encrypted session, sent instead of a plain request
+// It is followed by the request sealed with the pre-shared key (nonce: the first 12 bytes of nonce, aad: this struct)
+// The server answers with its own nonce followed by the audio header sealed with the session key at sequence number 0,
+// after which every datagram in both directions is sealed with the session key
+#define SECURE_TAG "SECURE"
+struct secure_hello {
+    char tag[8];
+    uint8_t nonce[CRYPTO_NONCEBYTES];
+};